@@ -9,6 +9,7 @@ make
 src/sans -h || true
 src/sans --version || true
 test/test.py
+test/tcp_flood.py
 
 cd src
 rm -f *.html
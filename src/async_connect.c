@@ -35,6 +35,7 @@
 #include "async_connect.h"
 #include "event.h"
 #include "log.h"
+#include "pool.h"
 #include "utils.h"
 
 
@@ -65,10 +66,25 @@ typedef struct
     void *data;
     ev_io w_read;
     ev_io w_write;
+    ev_timer timer;
 } ctx_t;
 
 
+/*
+ * @var  ctx_pool
+ * @desc pool of connection contexts
+ */
+static THREAD_LOCAL pool_t ctx_pool = POOL_INIT(sizeof(ctx_t));
+
+
+/*
+ * @desc timeout of connecting and SOCKS5 handshake, in ms
+ */
+#define CONNECT_TIMEOUT 3000
+
+
 static void connect_cb(ev_io *w);
+static void timeout_cb(ev_timer *w);
 static void socks5_send_cb(ev_io *w);
 static void socks5_recv_cb(ev_io *w);
 
@@ -119,17 +135,18 @@ int socks5_init(const char *host, const char *port)
  *        cb      - callback
  *        socks5  - connect via SOCKS5 or not
  *        data    - additional data
+ * @ret   handle of connection, or NULL if cb has been called
  */
-void async_connect(const struct sockaddr *addr, socklen_t addrlen,
-                   void (*cb)(int, void *), int socks5, void *data)
+void *async_connect(const struct sockaddr *addr, socklen_t addrlen,
+                    void (*cb)(int, void *), int socks5, void *data)
 {
-    ctx_t *ctx = (ctx_t *)malloc(sizeof(ctx_t));
+    ctx_t *ctx = (ctx_t *)pool_alloc(&ctx_pool);
     if (ctx == NULL)
     {
-        LOG("out of memory");
         (cb)(-1, data);
-        return;
+        return NULL;
     }
+    bzero(ctx, sizeof(ctx_t));
     ctx->socks5 = socks5;
 
     if (socks5)
@@ -144,9 +161,9 @@ void async_connect(const struct sockaddr *addr, socklen_t addrlen,
         if (sock < 0)
         {
             ERROR("socket");
-            free(ctx);
+            pool_free(&ctx_pool, ctx);
             (cb)(-1, data);
-            return;
+            return NULL;
         }
 
         setnonblock(sock);
@@ -163,14 +180,20 @@ void async_connect(const struct sockaddr *addr, socklen_t addrlen,
                 // 连接失败
                 LOG("connect to SOCKS5 server failed");
                 close(sock);
-                free(ctx);
+                pool_free(&ctx_pool, ctx);
                 (cb)(-1, data);
-                return;
+                return NULL;
             }
         }
         ev_io_init(&(ctx->w_write), connect_cb, sock, EV_WRITE);
         ctx->w_write.data = (void *)ctx;
-        ev_io_start(&(ctx->w_write));
+        if (ev_io_start(&(ctx->w_write)) != 0)
+        {
+            close(sock);
+            pool_free(&ctx_pool, ctx);
+            (cb)(-1, data);
+            return NULL;
+        }
     }
     else
     {
@@ -182,9 +205,9 @@ void async_connect(const struct sockaddr *addr, socklen_t addrlen,
         if (sock < 0)
         {
             ERROR("socket");
-            free(ctx);
+            pool_free(&ctx_pool, ctx);
             (cb)(-1, data);
-            return;
+            return NULL;
         }
 
         setnonblock(sock);
@@ -201,15 +224,50 @@ void async_connect(const struct sockaddr *addr, socklen_t addrlen,
                 // 连接失败
                 LOG("connect failed");
                 close(sock);
-                free(ctx);
+                pool_free(&ctx_pool, ctx);
                 (cb)(-1, data);
-                return;
+                return NULL;
             }
         }
         ev_io_init(&(ctx->w_write), connect_cb, sock, EV_WRITE);
         ctx->w_write.data = (void *)ctx;
-        ev_io_start(&(ctx->w_write));
+        if (ev_io_start(&(ctx->w_write)) != 0)
+        {
+            close(sock);
+            pool_free(&ctx_pool, ctx);
+            (cb)(-1, data);
+            return NULL;
+        }
     }
+
+    ev_timer_init(&(ctx->timer), timeout_cb, CONNECT_TIMEOUT, 0);
+    ctx->timer.data = (void *)ctx;
+    ev_timer_start(&(ctx->timer));
+    return ctx;
+}
+
+
+/*
+ * @func  async_connect_cancel()
+ * @desc  stop connecting, cb is not called
+ */
+void async_connect_cancel(void *handle)
+{
+    ctx_t *ctx = (ctx_t *)handle;
+
+    assert(ctx != NULL);
+
+    if (ev_is_active(&(ctx->w_read)))
+    {
+        ev_io_stop(&(ctx->w_read));
+    }
+    if (ev_is_active(&(ctx->w_write)))
+    {
+        ev_io_stop(&(ctx->w_write));
+    }
+    ev_timer_stop(&(ctx->timer));
+    close(ctx->w_write.fd);
+    pool_free(&ctx_pool, ctx);
 }
 
 
@@ -235,12 +293,19 @@ static void connect_cb(ev_io *w)
             ev_io_init(&ctx->w_write, socks5_send_cb, w->fd, EV_WRITE);
             ctx->w_read.data = (void *)ctx;
             ctx->w_write.data = (void *)ctx;
-            ev_io_start(&(ctx->w_write));
+            if (ev_io_start(&(ctx->w_write)) != 0)
+            {
+                close(w->fd);
+                (ctx->cb)(-1, ctx->data);
+                ev_timer_stop(&(ctx->timer));
+                pool_free(&ctx_pool, ctx);
+            }
         }
         else
         {
             (ctx->cb)(w->fd, ctx->data);
-            free(ctx);
+            ev_timer_stop(&(ctx->timer));
+            pool_free(&ctx_pool, ctx);
         }
     }
     else
@@ -251,14 +316,16 @@ static void connect_cb(ev_io *w)
             LOG("connect to SOCKS5 server failed");
             close(w->fd);
             (ctx->cb)(-1, ctx->data);
-            free(ctx);
+            ev_timer_stop(&(ctx->timer));
+            pool_free(&ctx_pool, ctx);
         }
         else
         {
             LOG("connect failed");
             close(w->fd);
             (ctx->cb)(-1, ctx->data);
-            free(ctx);
+            ev_timer_stop(&(ctx->timer));
+            pool_free(&ctx_pool, ctx);
         }
     }
 }
@@ -323,11 +390,18 @@ static void socks5_send_cb(ev_io *w)
         }
         close(w->fd);
         (ctx->cb)(-1, ctx->data);
-        free(ctx);
+        ev_timer_stop(&(ctx->timer));
+        pool_free(&ctx_pool, ctx);
         return;
     }
 
-    ev_io_start(&(ctx->w_read));
+    if (ev_io_start(&(ctx->w_read)) != 0)
+    {
+        close(w->fd);
+        (ctx->cb)(-1, ctx->data);
+        ev_timer_stop(&(ctx->timer));
+        pool_free(&ctx_pool, ctx);
+    }
 }
 
 
@@ -354,7 +428,8 @@ static void socks5_recv_cb(ev_io *w)
         }
         close(w->fd);
         (ctx->cb)(-1, ctx->data);
-        free(ctx);
+        ev_timer_stop(&(ctx->timer));
+        pool_free(&ctx_pool, ctx);
         return;
     }
 
@@ -366,7 +441,8 @@ static void socks5_recv_cb(ev_io *w)
             LOG("SOCKS5 handshake failed");
             close(w->fd);
             (ctx->cb)(-1, ctx->data);
-            free(ctx);
+            ev_timer_stop(&(ctx->timer));
+            pool_free(&ctx_pool, ctx);
             return;
         }
         ctx->state = HELLO_RCVD;
@@ -377,12 +453,14 @@ static void socks5_recv_cb(ev_io *w)
             LOG("SOCKS5 handshake failed");
             close(w->fd);
             (ctx->cb)(-1, ctx->data);
-            free(ctx);
+            ev_timer_stop(&(ctx->timer));
+            pool_free(&ctx_pool, ctx);
             return;
         }
         // 连接建立
         (ctx->cb)(w->fd, ctx->data);
-        free(ctx);
+        ev_timer_stop(&(ctx->timer));
+        pool_free(&ctx_pool, ctx);
         return;
     default:
         // 不应该来到这里
@@ -390,5 +468,36 @@ static void socks5_recv_cb(ev_io *w)
         break;
     }
 
-    ev_io_start(&(ctx->w_write));
+    if (ev_io_start(&(ctx->w_write)) != 0)
+    {
+        close(w->fd);
+        (ctx->cb)(-1, ctx->data);
+        ev_timer_stop(&(ctx->timer));
+        pool_free(&ctx_pool, ctx);
+    }
+}
+
+
+/*
+ * @func timeout_cb()
+ * @desc connect or SOCKS5 handshake timeout
+ */
+static void timeout_cb(ev_timer *w)
+{
+    ctx_t *ctx = (ctx_t *)(w->data);
+
+    assert(ctx != NULL);
+
+    LOG("connect timeout");
+    if (ev_is_active(&(ctx->w_read)))
+    {
+        ev_io_stop(&(ctx->w_read));
+    }
+    if (ev_is_active(&(ctx->w_write)))
+    {
+        ev_io_stop(&(ctx->w_write));
+    }
+    close(ctx->w_write.fd);
+    (ctx->cb)(-1, ctx->data);
+    pool_free(&ctx_pool, ctx);
 }
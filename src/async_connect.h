@@ -44,9 +44,19 @@ extern int socks5_init(const char *host, const char *port);
  *        cb      - callback
  *        socks5  - connect via SOCK5 or not
  *        data    - additional data
+ * @ret   handle to cancel with async_connect_cancel() until cb is called,
+ *        or NULL if cb has been called already, such as socket() failed
  */
-extern void async_connect(const struct sockaddr *addr, socklen_t addrlen,
-                          void (*cb)(int, void *), int socks5, void *data);
+extern void *async_connect(const struct sockaddr *addr, socklen_t addrlen,
+                           void (*cb)(int, void *), int socks5, void *data);
+
+
+/*
+ * @func  async_connect_cancel()
+ * @desc  stop connecting and close socket, cb is not called
+ * @param handle - returned by async_connect(), before cb is called
+ */
+extern void async_connect_cancel(void *handle);
 
 
 #endif // ASYNC_CONNECT_H
@@ -21,169 +21,689 @@
 #include <string.h>
 #include "cache.h"
 #include "dns.h"
+#include "event.h"
 #include "log.h"
+#include "utils.h"
 
 
 /*
- * @type entry_t
- * @desc hash table entry
+ * @type slot_t
+ * @desc slot of hash table, hash is stored inline so that probing does not
+ *       touch cache items of other names
  */
-typedef struct entry_t
+typedef struct
 {
-    cache_t *data;
-    struct entry_t *next;
-} entry_t;
+    uint32_t hash;
+    cache_t *cache;
+} slot_t;
 
 
 /*
- * @var  htable
- * @desc hash table to store DNS records
+ * @type table_t
+ * @desc open addressing hash table with linear probing
  */
-#define HASH_SIZE 2039
-static entry_t * htable[HASH_SIZE];
+typedef struct
+{
+    slot_t *slots;
+    uint32_t mask;      // capacity - 1
+    uint32_t count;     // count of items
+} table_t;
+
+
+/*
+ * @var  tables, migrate_pos
+ * @desc tables[0] is current table, tables[1] is old table being migrated
+ *       to tables[0] after growing, a few slots on every insert
+ * @memo deleted slots of old table are marked with TOMBSTONE, so that
+ *       probing of remaining items is not broken
+ */
+#define TABLE_MIN 64
+#define MIGRATE_STEP 16
+static cache_t tombstone;
+#define TOMBSTONE (&tombstone)
+static THREAD_LOCAL table_t tables[2];
+static THREAD_LOCAL uint32_t migrate_pos;
+
+
+/*
+ * @var  hand
+ * @desc hand of CLOCK, items are kept in a ring in order of insertion
+ */
+static THREAD_LOCAL cache_t *hand;
+
+
+/*
+ * @var  heap
+ * @desc min-heap of items ordered by expire time, expired items are popped
+ *       from it, so the cost is proportional to count of expired items
+ */
+static THREAD_LOCAL cache_t **heap;
+static THREAD_LOCAL int heap_len;
+static THREAD_LOCAL int heap_cap;
+#define HEAP_MIN 64
+
+
+/*
+ * @var  limit
+ * @desc max bytes used by cached replies, hash tables and heap
+ */
+static THREAD_LOCAL size_t limit = 16 * 1024 * 1024;
+
+
+/*
+ * @var  used
+ * @desc bytes used by cached replies, hash tables and heap
+ */
+static THREAD_LOCAL size_t used;
+
+
+/*
+ * @var  evictions
+ * @desc count of replies evicted before expired
+ */
+static THREAD_LOCAL unsigned long evictions;
 
 
 /*
  * @func hash()
- * @desc hash function
+ * @desc keyed hash of name and type
+ * @memo the table only needs a well mixed 32-bit value, low bits are used
+ *       as slot index and the whole value is kept in slot_t
  */
-static int hash(const char *name, int type)
+static uint32_t hash(const char *name, int type)
 {
-    int h = type;
-    while (*name != '\0')
+    return (uint32_t)hash_name(name, (uint32_t)type);
+}
+
+
+/*
+ * @func  table_find()
+ * @desc  find slot of name and type in table
+ * @ret   slot, or NULL if not found
+ */
+static slot_t *table_find(table_t *t, const char *name, int type, uint32_t h)
+{
+    if (t->slots == NULL)
     {
-        h = (h * 257 + (int)(uint8_t)(*name)) % HASH_SIZE;
-        name++;
+        return NULL;
+    }
+    for (uint32_t i = h & t->mask; t->slots[i].cache != NULL; i = (i + 1) & t->mask)
+    {
+        slot_t *slot = &(t->slots[i]);
+        if ((slot->hash == h) && (slot->cache != TOMBSTONE)
+            && (slot->cache->type == type) && (strcmp(slot->cache->name, name) == 0))
+        {
+            return slot;
+        }
     }
-    return h;
+    return NULL;
 }
 
 
 /*
- * @func  cache_insert()
- * @desc  insert an item into hash table
- * @param name  - domain name
- *        cache - cache item
+ * @func  table_put()
+ * @desc  put item into empty slot of table
  */
-int cache_insert(cache_t *cache)
+static void table_put(table_t *t, cache_t *cache)
 {
-    int h = hash(cache->name, cache->type);
+    uint32_t i = cache->hash & t->mask;
+    while (t->slots[i].cache != NULL)
+    {
+        i = (i + 1) & t->mask;
+    }
+    t->slots[i].hash = cache->hash;
+    t->slots[i].cache = cache;
+    t->count++;
+}
 
-    entry_t *entry = htable[h];
 
-    while (entry != NULL)
+/*
+ * @func  table_remove()
+ * @desc  remove item in slot from table
+ * @memo  following items are shifted backward, no tombstone is left, except
+ *        in old table
+ */
+static void table_remove(table_t *t, slot_t *slot)
+{
+    t->count--;
+    if (t == &tables[1])
     {
-        if ((entry->data->type == cache->type)
-            && (strcmp(entry->data->name, cache->name) == 0))
+        slot->cache = TOMBSTONE;
+        return;
+    }
+
+    uint32_t i = (uint32_t)(slot - t->slots);
+    uint32_t j = i;
+    for (;;)
+    {
+        j = (j + 1) & t->mask;
+        if (t->slots[j].cache == NULL)
         {
-            // 要插入的条目已经存在
-            return -1;
+            break;
+        }
+        // 如果 j 的理想位置在 (i, j] 之间，不能移动
+        uint32_t k = t->slots[j].hash & t->mask;
+        if (((j - k) & t->mask) < ((j - i) & t->mask))
+        {
+            continue;
         }
-        entry = entry->next;
+        t->slots[i] = t->slots[j];
+        i = j;
     }
+    t->slots[i].cache = NULL;
+}
 
-    entry = (entry_t *)malloc(sizeof(entry_t));
-    if (entry == NULL)
+
+/*
+ * @func  migrate()
+ * @desc  move up to n slots of old table to current table
+ */
+static void migrate(uint32_t n)
+{
+    table_t *old = &tables[1];
+    while ((old->slots != NULL) && (n-- > 0))
+    {
+        slot_t *slot = &(old->slots[migrate_pos]);
+        if ((slot->cache != NULL) && (slot->cache != TOMBSTONE))
+        {
+            table_put(&tables[0], slot->cache);
+            old->count--;
+            slot->cache = TOMBSTONE;
+        }
+        if (migrate_pos++ == old->mask)
+        {
+            used -= ((size_t)old->mask + 1) * sizeof(slot_t);
+            free(old->slots);
+            old->slots = NULL;
+            old->mask = 0;
+            old->count = 0;
+        }
+    }
+}
+
+
+/*
+ * @func  table_full()
+ * @desc  check if one more item can not be inserted without growing
+ */
+static int table_full(const table_t *t)
+{
+    return (t->slots == NULL) || (t->count + 1 > (t->mask + 1) / 4 * 3);
+}
+
+
+/*
+ * @func  grow()
+ * @desc  make sure one more item can be inserted into current table
+ */
+static int grow(void)
+{
+    table_t *t = &tables[0];
+    if (!table_full(t))
+    {
+        return 0;
+    }
+
+    uint32_t size = (t->slots == NULL) ? TABLE_MIN : (t->mask + 1) * 2;
+    slot_t *slots = (slot_t *)calloc(size, sizeof(slot_t));
+    if (slots == NULL)
     {
         LOG("out of memory");
         return -1;
     }
-    entry->data = cache;
-    entry->next = htable[h];
-    htable[h] = entry;
+
+    // 上一次扩容的迁移还未完成，先完成迁移
+    migrate(UINT32_MAX);
+    if (t->slots != NULL)
+    {
+        tables[1] = *t;
+        migrate_pos = 0;
+    }
+    t->slots = slots;
+    t->mask = size - 1;
+    t->count = 0;
+    used += (size_t)size * sizeof(slot_t);
     return 0;
 }
 
 
 /*
- * @func  cache_search()
- * @desc  search in cache
- * @param name - domain name
- *        type - record type
- * @ret   pointer to cache item, or NULL
+ * @func  find()
+ * @desc  find slot of name and type in current and old table
+ */
+static slot_t *find(const char *name, int type, uint32_t h, table_t **t)
+{
+    for (int i = 0; i < 2; i++)
+    {
+        slot_t *slot = table_find(&tables[i], name, type, h);
+        if (slot != NULL)
+        {
+            *t = &tables[i];
+            return slot;
+        }
+    }
+    return NULL;
+}
+
+
+/*
+ * @func  expired()
+ * @desc  check if cache item is expired
+ */
+static int expired(const cache_t *cache)
+{
+    return cache->expire <= ev_now();
+}
+
+
+/*
+ * @func  heap_set()
+ * @desc  put item at index i of heap
+ */
+static void heap_set(int i, cache_t *cache)
+{
+    heap[i] = cache;
+    cache->heapidx = i;
+}
+
+
+/*
+ * @func  heap_fix()
+ * @desc  move item at index i up or down to restore heap order
  */
-cache_t *cache_search(const char *name, int type)
+static void heap_fix(int i)
 {
-    int h = hash(name, type);
+    cache_t *cache = heap[i];
 
-    entry_t *entry = htable[h];
+    while (i > 0)
+    {
+        int parent = (i - 1) / 2;
+        if (heap[parent]->expire <= cache->expire)
+        {
+            break;
+        }
+        heap_set(i, heap[parent]);
+        i = parent;
+    }
+    while (2 * i + 1 < heap_len)
+    {
+        int child = 2 * i + 1;
+        if ((child + 1 < heap_len) && (heap[child + 1]->expire < heap[child]->expire))
+        {
+            child++;
+        }
+        if (cache->expire <= heap[child]->expire)
+        {
+            break;
+        }
+        heap_set(i, heap[child]);
+        i = child;
+    }
+    heap_set(i, cache);
+}
 
-    while (entry != NULL)
+
+/*
+ * @func  heap_push()
+ * @desc  add item to heap
+ */
+static int heap_push(cache_t *cache)
+{
+    if (heap_len == heap_cap)
     {
-        if ((entry->data->type == type) && (strcmp(entry->data->name, name) == 0))
+        int cap = (heap_cap == 0) ? HEAP_MIN : heap_cap * 2;
+        cache_t **p = (cache_t **)realloc(heap, cap * sizeof(cache_t *));
+        if (p == NULL)
         {
-            return entry->data;
+            LOG("out of memory");
+            return -1;
         }
-        entry = entry->next;
+        used += (size_t)(cap - heap_cap) * sizeof(cache_t *);
+        heap = p;
+        heap_cap = cap;
     }
-    return NULL;
+    heap_set(heap_len, cache);
+    heap_len++;
+    heap_fix(heap_len - 1);
+    return 0;
 }
 
 
 /*
- * @func  cache_delete()
- * @desc  delete cache item
- * @param name - domain name
- *        type - record type
+ * @func  heap_remove()
+ * @desc  remove item from heap
  */
-int cache_delete(const char *name, int type)
+static void heap_remove(cache_t *cache)
+{
+    int i = cache->heapidx;
+    heap_len--;
+    if (i != heap_len)
+    {
+        heap_set(i, heap[heap_len]);
+        heap_fix(i);
+    }
+}
+
+
+/*
+ * @func  release()
+ * @desc  free hash tables and heap when cache becomes empty
+ */
+static void release(void)
+{
+    for (int i = 0; i < 2; i++)
+    {
+        if (tables[i].slots != NULL)
+        {
+            used -= ((size_t)tables[i].mask + 1) * sizeof(slot_t);
+            free(tables[i].slots);
+            tables[i].slots = NULL;
+            tables[i].mask = 0;
+            tables[i].count = 0;
+        }
+    }
+    used -= (size_t)heap_cap * sizeof(cache_t *);
+    free(heap);
+    heap = NULL;
+    heap_len = 0;
+    heap_cap = 0;
+}
+
+
+/*
+ * @func  grow_size()
+ * @desc  bytes of hash table and heap to be allocated for one more item
+ */
+static size_t grow_size(void)
 {
-    int h = hash(name, type);
+    size_t n = 0;
+    if (table_full(&tables[0]))
+    {
+        n += ((tables[0].slots == NULL) ? TABLE_MIN : ((size_t)tables[0].mask + 1) * 2)
+             * sizeof(slot_t);
+    }
+    if (heap_len == heap_cap)
+    {
+        n += ((heap_cap == 0) ? HEAP_MIN : (size_t)heap_cap) * sizeof(cache_t *);
+    }
+    return n;
+}
 
-    entry_t *entry = htable[h];
-    entry_t *last = NULL;
 
-    while (entry != NULL)
+/*
+ * @func  drop()
+ * @desc  remove item in slot from hash table, deadline heap and CLOCK ring,
+ *        and free it
+ */
+static void drop(table_t *t, slot_t *slot)
+{
+    cache_t *cache = slot->cache;
+
+    table_remove(t, slot);
+    heap_remove(cache);
+
+    if (cache->cnext == cache)
+    {
+        hand = NULL;
+    }
+    else
     {
-        if ((entry->data->type == type) && (strcmp(entry->data->name, name) == 0))
+        cache->cprev->cnext = cache->cnext;
+        cache->cnext->cprev = cache->cprev;
+        if (hand == cache)
         {
-            if (last == NULL)
-            {
-                htable[h] = NULL;
-                free(entry);
-            }
-            else
-            {
-                last->next = entry->next;
-                free(entry);
-            }
-            return 0;
+            hand = cache->cnext;
         }
-        last = entry;
-        entry = entry->next;
     }
-    return -1;
+
+    used -= cache->size;
+    free(cache);
+    if (hand == NULL)
+    {
+        release();
+    }
 }
 
 
 /*
- * @func cache_tick(void)
- * @desc tick every seconds
+ * @func  drop_item()
+ * @desc  find slot of item and drop it
  */
-void cache_tick(void)
+static void drop_item(cache_t *cache)
 {
-    for (int i = 0; i < HASH_SIZE; i++)
+    for (int i = 0; i < 2; i++)
     {
-        entry_t *entry = htable[i];
-        entry_t *last = NULL;
-        while (entry != NULL)
+        table_t *t = &tables[i];
+        if (t->slots == NULL)
+        {
+            continue;
+        }
+        uint32_t j = cache->hash & t->mask;
+        while ((t->slots[j].cache != NULL) && (t->slots[j].cache != cache))
         {
-            entry->data->ttl--;
-            if (entry->data->ttl == 0)
-            {
-                if (last == NULL)
-                {
-                    htable[i] = NULL;
-                    free(entry);
-                }
-                else
-                {
-                    last->next = entry->next;
-                    free(entry);
-                }
-            }
-            last = entry;
-            entry = entry->next;
+            j = (j + 1) & t->mask;
+        }
+        if (t->slots[j].cache == cache)
+        {
+            drop(t, &(t->slots[j]));
+            return;
         }
     }
 }
+
+
+/*
+ * @func  reclaim()
+ * @desc  free expired items
+ */
+static void reclaim(void)
+{
+    while ((heap_len > 0) && expired(heap[0]))
+    {
+        drop_item(heap[0]);
+    }
+}
+
+
+/*
+ * @func  evict()
+ * @desc  evict items until size bytes can be inserted
+ * @memo  CLOCK: item referenced since last pass gets a second chance,
+ *        call reclaim() first so that only unexpired items are evicted
+ */
+static void evict(size_t size)
+{
+    while ((hand != NULL) && (used + size > limit))
+    {
+        cache_t *cache = hand;
+        if (cache->ref)
+        {
+            cache->ref = 0;
+            hand = cache->cnext;
+            continue;
+        }
+        evictions++;
+        drop_item(cache);
+    }
+}
+
+
+/*
+ * @func  cache_set_limit()
+ * @desc  set memory limit of cache of current thread
+ * @param size - max bytes used by cached replies, 0 to disable cache
+ */
+void cache_set_limit(size_t size)
+{
+    limit = size;
+    reclaim();
+    evict(0);
+}
+
+
+/*
+ * @func  cache_stat()
+ * @desc  get statistics of cache of current thread
+ * @param used_bytes - bytes used by cached replies, may be NULL
+ *        evict_cnt  - count of replies evicted before expired, may be NULL
+ */
+void cache_stat(size_t *used_bytes, unsigned long *evict_cnt)
+{
+    if (used_bytes != NULL)
+    {
+        *used_bytes = used;
+    }
+    if (evict_cnt != NULL)
+    {
+        *evict_cnt = evictions;
+    }
+}
+
+
+/*
+ * @func  cache_insert()
+ * @desc  insert a reply into cache
+ * @param name   - domain name
+ *        type   - record type
+ *        msg    - reply, copied
+ *        msglen - length of reply
+ *        ttl    - reply expires after ttl seconds
+ */
+int cache_insert(const char *name, int type, const void *msg, int msglen,
+                 uint32_t ttl)
+{
+    if ((ttl == 0) || (msglen <= 0))
+    {
+        return -1;
+    }
+    if (ttl > CACHE_MAX_TTL)
+    {
+        ttl = CACHE_MAX_TTL;
+    }
+
+    size_t namelen = strlen(name) + 1;
+    size_t size = sizeof(cache_t) + msglen + namelen;
+    if (size > limit)
+    {
+        return -1;
+    }
+
+    uint32_t h = hash(name, type);
+    table_t *t;
+    slot_t *slot = find(name, type, h, &t);
+    if (slot != NULL)
+    {
+        // 同名条目用新的应答替换
+        drop(t, slot);
+    }
+
+    // 先回收过期条目，仍然超出限制才淘汰未过期的
+    // 哈希表和 heap 扩容的内存也计入限制
+    reclaim();
+    evict(size + grow_size());
+    if (used + size + grow_size() > limit)
+    {
+        return -1;
+    }
+
+    if (grow() != 0)
+    {
+        return -1;
+    }
+    migrate(MIGRATE_STEP);
+
+    cache_t *cache = (cache_t *)malloc(size);
+    if (cache == NULL)
+    {
+        LOG("out of memory");
+        return -1;
+    }
+    cache->stored = ev_now();
+    cache->expire = cache->stored + (ev_tstamp)ttl * 1000000;
+    cache->size = size;
+    cache->hash = h;
+    cache->type = type;
+    cache->msglen = msglen;
+    cache->ref = 0;
+    memcpy(cache->msg, msg, msglen);
+    cache->name = (char *)cache->msg + msglen;
+    memcpy(cache->name, name, namelen);
+    if (heap_push(cache) != 0)
+    {
+        free(cache);
+        return -1;
+    }
+    table_put(&tables[0], cache);
+
+    // 插入到 hand 之前，即 hand 最后经过的位置
+    if (hand == NULL)
+    {
+        cache->cnext = cache;
+        cache->cprev = cache;
+        hand = cache;
+    }
+    else
+    {
+        cache->cnext = hand;
+        cache->cprev = hand->cprev;
+        hand->cprev->cnext = cache;
+        hand->cprev = cache;
+    }
+    used += size;
+
+    return 0;
+}
+
+
+/*
+ * @func  cache_search()
+ * @desc  search in cache
+ * @param name   - domain name
+ *        type   - record type
+ *        buf    - buffer to store the reply, TTLs are decreased by age
+ *        buflen - length of buffer
+ * @ret   length of reply, or -1 if not found
+ */
+int cache_search(const char *name, int type, void *buf, int buflen)
+{
+    table_t *t;
+    slot_t *slot = find(name, type, hash(name, type), &t);
+    if (slot == NULL)
+    {
+        return -1;
+    }
+
+    cache_t *cache = slot->cache;
+    if (expired(cache))
+    {
+        drop(t, slot);
+        return -1;
+    }
+    if (cache->msglen > buflen)
+    {
+        return -1;
+    }
+    cache->ref = 1;
+    memcpy(buf, cache->msg, cache->msglen);
+    ns_age(buf, cache->msglen, (uint32_t)((ev_now() - cache->stored) / 1000000));
+    return cache->msglen;
+}
+
+
+/*
+ * @func  cache_delete()
+ * @desc  delete cache item
+ * @param name - domain name
+ *        type - record type
+ */
+int cache_delete(const char *name, int type)
+{
+    table_t *t;
+    slot_t *slot = find(name, type, hash(name, type), &t);
+    if (slot == NULL)
+    {
+        return -1;
+    }
+    drop(t, slot);
+    return 0;
+}
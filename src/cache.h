@@ -20,122 +20,92 @@
 #ifndef CACHE_H
 #define CACHE_H
 
+#include <stddef.h>
 #include <stdint.h>
 #include "dns.h"
+#include "event.h"
 
 /*
- * @type ns_a
- * @desc A record
+ * @def   CACHE_MAX_TTL
+ * @desc  upper bound of how long a reply is cached, in seconds
  */
-typedef uint32_t ns_a;
+#define CACHE_MAX_TTL 86400
 
 
 /*
- * @type ns_aaaa
- * @desc AAAA record
- */
-typedef uint8_t ns_aaaa[16];
-
-
-/*
- * @type ns_ns
- * @desc NS record
- */
-typedef char ns_ns[NS_NAMESZ];
-
-
-/*
- * @type ns_cname
- * @desc CNAME record
- */
-typedef char ns_cname[NS_NAMESZ];
-
-
-/*
- * @type ns_mx
- * @desc MX record
- */
-typedef struct ns_mx
-{
-    int priority;
-    char mx[NS_NAMESZ];
-} ns_mx;
-
-
-/*
- * @type ns_soa
- * @desc SOA record
+ * @type cache_t
+ * @desc cache item, a complete DNS reply
  */
-typedef struct ns_soa
+typedef struct cache_t
 {
-    char mname[NS_NAMESZ];
-    char rname[NS_NAMESZ];
-    uint32_t serial;
-    uint32_t refresh;
-    uint32_t retry;
-    uint32_t expire;
-    uint32_t minimum;
-} ns_soa;
-
-
-/*
- * @type ns_txt
- * @desc TXT record
- */
-typedef char ns_txt[NS_NAMESZ];
+    struct cache_t *cnext;  // next item in CLOCK ring
+    struct cache_t *cprev;  // previous item in CLOCK ring
+    ev_tstamp stored;       // time when reply was received
+    ev_tstamp expire;       // expire time
+    size_t size;            // memory used by this item
+    uint32_t hash;          // hash of name and type
+    int type;               // record type
+    int msglen;             // length of reply
+    int ref;                // referenced since CLOCK hand passed
+    int heapidx;            // index in deadline heap
+    char *name;             // domain name, stored after reply
+    uint8_t msg[];          // reply
+} cache_t;
 
 
 /*
- * @type ns_ptr
- * @desc PTR record
+ * @func  cache_set_limit()
+ * @desc  set memory limit of cache of current thread
+ * @param size - max bytes used by cached replies and their index, 0 to
+ *               disable cache
+ * @memo  least recently used replies are evicted with CLOCK algorithm
  */
-typedef char ns_ptr[NS_NAMESZ];
+extern void cache_set_limit(size_t size);
 
 
 /*
- * @type ns_block
- * @desc custom record type, 1 means this domain is blocked, 0 means not
+ * @func  cache_stat()
+ * @desc  get statistics of cache of current thread
+ * @param used_bytes - bytes used by cached replies and their index, may be
+ *                     NULL
+ *        evict_cnt  - count of replies evicted before expired, may be NULL
  */
-typedef int ns_block;
-
-
-/*
- * @type cache_t
- * @desc cache item
- */
-typedef struct cache_t
-{
-    char name[NS_NAMESZ];   // domain name
-    uint32_t ttl;           // TTL
-    int type;               // record type
-    int count;              // record count
-    uint8_t data[0];        // data
-} cache_t;
+extern void cache_stat(size_t *used_bytes, unsigned long *evict_cnt);
 
 
 /*
  * @func  cache_insert()
- * @desc  insert an item into hash table
- * @param cache - cache item
+ * @desc  insert a reply into cache
+ * @param name   - domain name
+ *        type   - record type
+ *        msg    - reply, copied
+ *        msglen - length of reply
+ *        ttl    - reply expires after ttl seconds
+ * @memo  existing item of the same name and type is replaced
  */
-extern int cache_insert(cache_t *cache);
+extern int cache_insert(const char *name, int type, const void *msg, int msglen,
+                        uint32_t ttl);
 
 
 /*
  * @func  cache_search()
  * @desc  search in cache
- * @param name - domain name
- *        type - record type
- * @ret   pointer to cache item
+ * @param name   - domain name
+ *        type   - record type
+ *        buf    - buffer to store the reply, TTLs are decreased by age
+ *        buflen - length of buffer
+ * @ret   length of reply, or -1 if not found
  */
-extern cache_t *cache_search(const char *name, int type);
+extern int cache_search(const char *name, int type, void *buf, int buflen);
 
 
 /*
- * @func cache_tick(void)
- * @desc tick every seconds
+ * @func  cache_delete()
+ * @desc  delete cache item
+ * @param name - domain name
+ *        type - record type
  */
-extern void cache_tick(void);
+extern int cache_delete(const char *name, int type);
 
 
 #endif // CACHE_H
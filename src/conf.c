@@ -75,6 +75,64 @@ static void _strncpy(char *dest, const char *src, size_t n)
 }
 
 
+/*
+ * @func  parse_int()
+ * @desc  parse integer in range [min, max]
+ * @ret   0 - if succeed
+ *        -1 - if failed
+ */
+static int parse_int(const char *str, int min, int max, int *value)
+{
+    char *end;
+    long n = strtol(str, &end, 10);
+    if ((*str == '\0') || (*end != '\0') || (n < min) || (n > max))
+    {
+        return -1;
+    }
+    *value = (int)n;
+    return 0;
+}
+
+
+/*
+ * @func  parse_size()
+ * @desc  parse size in bytes, with optional suffix K, M or G, at most 1G
+ * @ret   0 - if succeed
+ *        -1 - if failed
+ */
+static int parse_size(const char *str, long *value)
+{
+    char *end;
+    long n = strtol(str, &end, 10);
+    if ((*str == '\0') || (n < 0))
+    {
+        return -1;
+    }
+    long unit = 1;
+    switch (toupper((int)(unsigned char)*end))
+    {
+    case 'G':
+        unit *= 1024;
+        // fall through
+    case 'M':
+        unit *= 1024;
+        // fall through
+    case 'K':
+        unit *= 1024;
+        end++;
+        break;
+    default:
+        break;
+    }
+    if ((*end != '\0') || (n > (1L << 30) / unit))
+    {
+        return -1;
+    }
+    *value = n * unit;
+    return 0;
+}
+
+
 /*
  * @func  read_conf()
  * @desc  read config file
@@ -183,6 +241,72 @@ static int read_conf(const char *file, conf_t *conf)
             my_strncpy(conf->server.addr, value);
             my_strncpy(conf->server.port, p + 1);
         }
+        else if (strcmp(key, "blocked_list") == 0)
+        {
+            my_strncpy(conf->blocked_list, value);
+        }
+        else if (strcmp(key, "cn_list") == 0)
+        {
+            my_strncpy(conf->cn_list, value);
+        }
+        else if (strcmp(key, "verdict_file") == 0)
+        {
+            my_strncpy(conf->verdict_file, value);
+        }
+        else if (strcmp(key, "max_watchers") == 0)
+        {
+            if (parse_int(value, 0, 1000000, &(conf->max_watchers)) != 0)
+            {
+                fprintf(stderr, "parse config file failed at line: %d\n", line_num);
+                fclose(f);
+                return -1;
+            }
+        }
+        else if (strcmp(key, "max_queries") == 0)
+        {
+            if (parse_int(value, 1, 65535, &(conf->max_queries)) != 0)
+            {
+                fprintf(stderr, "parse config file failed at line: %d\n", line_num);
+                fclose(f);
+                return -1;
+            }
+        }
+        else if (strcmp(key, "cache_size") == 0)
+        {
+            if (parse_size(value, &(conf->cache_size)) != 0)
+            {
+                fprintf(stderr, "parse config file failed at line: %d\n", line_num);
+                fclose(f);
+                return -1;
+            }
+        }
+        else if (strcmp(key, "workers") == 0)
+        {
+            if (parse_int(value, 0, 1024, &(conf->workers)) != 0)
+            {
+                fprintf(stderr, "parse config file failed at line: %d\n", line_num);
+                fclose(f);
+                return -1;
+            }
+        }
+        else if (strcmp(key, "timeout") == 0)
+        {
+            if (parse_int(value, 1, 60000, &(conf->timeout)) != 0)
+            {
+                fprintf(stderr, "parse config file failed at line: %d\n", line_num);
+                fclose(f);
+                return -1;
+            }
+        }
+        else if (strcmp(key, "retries") == 0)
+        {
+            if (parse_int(value, 0, 10, &(conf->retries)) != 0)
+            {
+                fprintf(stderr, "parse config file failed at line: %d\n", line_num);
+                fclose(f);
+                return -1;
+            }
+        }
         else if (strcmp(key, "socks5") == 0)
         {
             p = strrchr(value, ':');
@@ -212,6 +336,12 @@ int parse_args(int argc, char **argv, conf_t *conf)
     const char *conf_file = NULL;
 
     bzero(conf, sizeof(conf_t));
+    conf->max_watchers = -1;
+    conf->max_queries = -1;
+    conf->cache_size = -1;
+    conf->workers = -1;
+    conf->timeout = -1;
+    conf->retries = -1;
 
     for (int i = 1; i < argc; i++)
     {
@@ -281,6 +411,30 @@ int parse_args(int argc, char **argv, conf_t *conf)
         }
     }
 
+    if (conf->max_watchers < 0)
+    {
+        conf->max_watchers = 4096;
+    }
+    if (conf->max_queries < 0)
+    {
+        conf->max_queries = 4096;
+    }
+    if (conf->cache_size < 0)
+    {
+        conf->cache_size = 16 * 1024 * 1024;
+    }
+    if (conf->workers < 0)
+    {
+        conf->workers = 0;
+    }
+    if (conf->timeout < 0)
+    {
+        conf->timeout = 150;
+    }
+    if (conf->retries < 0)
+    {
+        conf->retries = 2;
+    }
     if (conf->pidfile[0] == '\0')
     {
         strcpy(conf->pidfile, "/run/sans.pid");
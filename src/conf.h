@@ -30,9 +30,18 @@ typedef struct
     int verbose;
     int nspresolver;
     int daemon;
+    int max_watchers;
+    int max_queries;
+    long cache_size;
+    int workers;
+    int timeout;
+    int retries;
     char user[16];
     char pidfile[64];
     char logfile[64];
+    char blocked_list[128];
+    char cn_list[128];
+    char verdict_file[128];
     struct
     {
         char addr[64];
@@ -20,6 +20,7 @@
 #include <assert.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 
 #ifdef __MINGW32__
 #  include "win.h"
@@ -28,7 +29,6 @@
 #endif
 
 #include "dns.h"
-#include "query.h"
 #include "resolv.h"
 #include "utils.h"
 
@@ -53,21 +53,6 @@ void ns_setid(void *msg, uint16_t id)
 }
 
 
-/*
- * @func ns_newid()
- * @desc generate a new unique ID
- */
-uint16_t ns_newid(void)
-{
-    uint16_t id;
-    do
-    {
-        id = rand_uint16();
-    } while ((id == 0) || (query_search(id) != NULL));
-    return id;
-}
-
-
 /*
  * @func  ns_type_str()
  * @desc  convert DNS type to string
@@ -169,6 +154,35 @@ int ns_mkquery(void *buf, int buflen, const char *name, int type)
 }
 
 
+/*
+ * @func  ns_mkreply()
+ * @desc  make DNS reply without answer, e.g. SERVFAIL
+ * @param buf    - buffer
+ *        buflen - length of buffer
+ *        name   - domain name
+ *        type   - query type
+ *        rcode  - response code
+ */
+int ns_mkreply(void *buf, int buflen, const char *name, int type, int rcode)
+{
+    int n = ns_mkquery(buf, buflen, name, type);
+    if (n < 0)
+    {
+        return -1;
+    }
+    ns_flag flag =
+    {
+        .qr = 1,
+        .opcode = ns_o_query,
+        .rd = 1,
+        .ra = 1,
+        .rcode = rcode
+    };
+    memcpy(&(((ns_header *)buf)->flag), &flag, 2);
+    return n;
+}
+
+
 /*
  * @func  ns_parse_query()
  * @desc  parse DNS query
@@ -252,3 +266,321 @@ int ns_parse_reply(void *msg, int msglen, char *name, int *type)
 
     return 0;
 }
+
+
+/*
+ * @func  ns_reply_ttl()
+ * @desc  check if reply can be cached, and get its TTL
+ * @param msg    - message
+ *        msglen - length of message
+ *        name   - domain name queried
+ *        type   - query type
+ *        ttl    - minimum TTL of answer records, or for NXDOMAIN/NODATA
+ *                 the SOA minimum in authority section (RFC 2308)
+ */
+int ns_reply_ttl(void *msg, int msglen, const char *name, int type,
+                 uint32_t *ttl)
+{
+    ns_msg nsmsg;
+    ns_rr nsrr;
+
+    assert(msg != NULL);
+    assert(name != NULL);
+    assert(ttl != NULL);
+
+    if (ns_initparse((const u_char *)msg, msglen, &nsmsg) < 0)
+    {
+        return -1;
+    }
+
+    // 只缓存完整的 NOERROR 和 NXDOMAIN 应答，TC 置位的不缓存
+    uint16_t flags = ns_msg_flag(nsmsg);
+    int rcode = flags & 0x000f;
+    if (((rcode != ns_r_noerror) && (rcode != ns_r_nxdomain)) || ((flags & 0x0200) != 0))
+    {
+        return -1;
+    }
+    if (ns_msg_count(nsmsg, ns_s_qd) != 1)
+    {
+        return -1;
+    }
+
+    // 问题必须与查询一致，防止把别的应答缓存到这个名字下
+    if (ns_parserr(&nsmsg, ns_s_qd, 0, &nsrr) != 0)
+    {
+        return -1;
+    }
+    if (((int)ns_rr_type(nsrr) != type) || (strcasecmp(ns_rr_name(nsrr), name) != 0))
+    {
+        return -1;
+    }
+
+    uint32_t min = UINT32_MAX;
+    for (int i = 0; i < ns_msg_count(nsmsg, ns_s_an); i++)
+    {
+        if (ns_parserr(&nsmsg, ns_s_an, i, &nsrr) != 0)
+        {
+            return -1;
+        }
+        if (ns_rr_ttl(nsrr) < min)
+        {
+            min = ns_rr_ttl(nsrr);
+        }
+    }
+
+    if ((rcode == ns_r_noerror) && (ns_msg_count(nsmsg, ns_s_an) > 0))
+    {
+        *ttl = min;
+        return 0;
+    }
+
+    // NXDOMAIN 或 NODATA，TTL 取 SOA 的 TTL 与 MINIMUM 中较小者，
+    // 没有 SOA 的否定应答不缓存
+    for (int i = 0; i < ns_msg_count(nsmsg, ns_s_ns); i++)
+    {
+        if (ns_parserr(&nsmsg, ns_s_ns, i, &nsrr) != 0)
+        {
+            return -1;
+        }
+        if (ns_rr_type(nsrr) != ns_t_soa)
+        {
+            continue;
+        }
+        // MNAME、RNAME 之后是 5 个 32 位整数，MINIMUM 是最后一个
+        if (ns_rr_rdlen(nsrr) < 2 + 5 * NS_INT32SZ)
+        {
+            return -1;
+        }
+        const u_char *ptr = (const u_char *)ns_rr_rdata(nsrr)
+                            + ns_rr_rdlen(nsrr) - NS_INT32SZ;
+        uint32_t minimum;
+        NS_GET32(minimum, ptr);
+        if (ns_rr_ttl(nsrr) < min)
+        {
+            min = ns_rr_ttl(nsrr);
+        }
+        if (minimum < min)
+        {
+            min = minimum;
+        }
+        *ttl = (min < NS_MAXNEGTTL) ? min : NS_MAXNEGTTL;
+        return 0;
+    }
+
+    return -1;
+}
+
+
+/*
+ * @func  ns_age()
+ * @desc  decrease TTL of every record in message
+ * @param msg    - message, must have been checked by ns_reply_ttl()
+ *        msglen - length of message
+ *        age    - seconds since message was received
+ */
+void ns_age(void *msg, int msglen, uint32_t age)
+{
+    ns_msg nsmsg;
+
+    assert(msg != NULL);
+
+    if ((age == 0) || (ns_initparse((const u_char *)msg, msglen, &nsmsg) < 0))
+    {
+        return;
+    }
+
+    const u_char *eom = ns_msg_end(nsmsg);
+    u_char *ptr = (u_char *)msg + NS_HFIXEDSZ;
+
+    // 跳过问题部分
+    for (int i = 0; i < ns_msg_count(nsmsg, ns_s_qd); i++)
+    {
+        int n = dn_skipname(ptr, eom);
+        if (n < 0)
+        {
+            return;
+        }
+        ptr += n + NS_QFIXEDSZ;
+    }
+
+    int count = ns_msg_count(nsmsg, ns_s_an) + ns_msg_count(nsmsg, ns_s_ns)
+                + ns_msg_count(nsmsg, ns_s_ar);
+    for (int i = 0; i < count; i++)
+    {
+        int n = dn_skipname(ptr, eom);
+        if ((n < 0) || (ptr + n + NS_RRFIXEDSZ > eom))
+        {
+            return;
+        }
+        ptr += n;
+
+        uint16_t rrtype;
+        uint32_t ttl;
+        uint16_t rdlen;
+        NS_GET16(rrtype, ptr);
+        ptr += NS_INT16SZ;  // class
+        if (rrtype == ns_t_opt)
+        {
+            // OPT 记录的 TTL 字段是 EDNS 标志，不能改
+            ptr += NS_INT32SZ;
+        }
+        else
+        {
+            NS_GET32(ttl, ptr);
+            ttl = (ttl > age) ? ttl - age : 0;
+            ptr -= NS_INT32SZ;
+            NS_PUT32(ttl, ptr);
+        }
+        NS_GET16(rdlen, ptr);
+        ptr += rdlen;
+    }
+}
+
+
+/*
+ * @func  ns_tolower()
+ * @desc  convert ASCII letters of domain name to lower case
+ * @ret   1 - if name has upper case letters
+ *        0 - if not
+ */
+int ns_tolower(char *name)
+{
+    int upper = 0;
+    for (; *name != '\0'; name++)
+    {
+        if ((*name >= 'A') && (*name <= 'Z'))
+        {
+            *name += 'a' - 'A';
+            upper = 1;
+        }
+    }
+    return upper;
+}
+
+
+/*
+ * @func  ns_setqcase()
+ * @desc  set letter case of question name in message
+ * @param msg    - message
+ *        msglen - length of message
+ *        qname  - the same name in wire format, letter case is copied from
+ *                 it, or NULL to convert to lower case
+ */
+void ns_setqcase(void *msg, int msglen, const uint8_t *qname)
+{
+    uint8_t *name = (uint8_t *)msg + NS_HFIXEDSZ;
+    const uint8_t *end = (uint8_t *)msg + msglen;
+
+    // 名字的长度，压缩过的不处理
+    int len = 0;
+    while ((name + len < end) && (name[len] != 0))
+    {
+        if (((name[len] & NS_CMPRSFLGS) != 0) || (name + len + name[len] >= end))
+        {
+            return;
+        }
+        len += name[len] + 1;
+    }
+    if (name + len >= end)
+    {
+        return;
+    }
+
+    for (int i = 0; i < len; i++)
+    {
+        uint8_t c = name[i];
+        if ((c >= 'A') && (c <= 'Z'))
+        {
+            c += 'a' - 'A';
+        }
+        if (qname == NULL)
+        {
+            name[i] = c;
+        }
+        else
+        {
+            uint8_t q = qname[i];
+            if ((q >= 'A') && (q <= 'Z'))
+            {
+                q += 'a' - 'A';
+            }
+            if (c != q)
+            {
+                // 与 qname 不是同一个域名
+                return;
+            }
+        }
+    }
+    if (qname != NULL)
+    {
+        if (qname[len] != 0)
+        {
+            return;
+        }
+        memcpy(name, qname, len);
+    }
+}
+
+
+/*
+ * @func  ns_registrable()
+ * @desc  find registrable domain of name
+ * @param name - domain name in lower case
+ * @ret   pointer to registrable domain in name, or NULL
+ */
+const char *ns_registrable(const char *name)
+{
+    static const char *const second[] =
+    {
+        "ac", "co", "com", "edu", "go", "gov", "mil", "ne", "net", "or", "org"
+    };
+
+    // 从右往左找出最后三个 label 的起点
+    const char *label[3] = {NULL, NULL, NULL};
+    const char *p = name + strlen(name);
+    int n = 0;
+    while ((n < 3) && (p > name))
+    {
+        const char *end = p;
+        while ((p > name) && (*(p - 1) != '.'))
+        {
+            p--;
+        }
+        label[n++] = p;
+        if (end == p)
+        {
+            // 空 label，不是合法域名
+            return NULL;
+        }
+        if (p > name)
+        {
+            p--;
+        }
+    }
+    if (n < 2)
+    {
+        // 顶级域名本身
+        return NULL;
+    }
+
+    // 反向解析等基础设施域名没有可注册的部分，如 in-addr.arpa，使用完整域名
+    if (strcmp(label[0], "arpa") == 0)
+    {
+        return (n < 3) ? NULL : name;
+    }
+
+    // 国家顶级域名下常见的二级后缀，如 co.uk、com.cn
+    if (strlen(label[0]) == 2)
+    {
+        size_t len = label[0] - label[1] - 1;
+        for (size_t i = 0; i < sizeof(second) / sizeof(second[0]); i++)
+        {
+            if ((strlen(second[i]) == len) && (memcmp(label[1], second[i], len) == 0))
+            {
+                // 后缀本身时 label[2] 为 NULL
+                return label[2];
+            }
+        }
+    }
+    return label[1];
+}
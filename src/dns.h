@@ -39,6 +39,12 @@
 #define NS_NAMESZ 2048
 
 
+/*
+* @desc upper bound of negative caching TTL, 3 hours as suggested by RFC 2308
+*/
+#define NS_MAXNEGTTL 10800
+
+
 /*
  * @type ns_flag
  * @desc DNS flags
@@ -146,6 +152,7 @@ typedef enum
     ns_t_mx = 15,       // Mail routing information
     ns_t_txt = 16,      // Text strings
     ns_t_aaaa = 28,     // Ip6 Address
+    ns_t_opt = 41,      // EDNS0 option
     ns_t_any = 255,     // Wildcard match
     ns_t_block = 256, // Custom type, is blocked
 } ns_type;
@@ -176,13 +183,6 @@ extern uint16_t ns_getid(void *msg);
 extern void ns_setid(void *msg, uint16_t id);
 
 
-/*
- * @func ns_newid()
- * @desc generate a new unique ID
- */
-extern uint16_t ns_newid(void);
-
-
 /*
  * @func  ns_type_str()
  * @desc  convert DNS type to string
@@ -202,6 +202,18 @@ const char *ns_type_str(int type);
 extern int ns_mkquery(void *buf, int buflen, const char *name, int type);
 
 
+/*
+ * @func  ns_mkreply()
+ * @desc  make DNS reply without answer, e.g. SERVFAIL
+ * @param buf    - buffer
+ *        buflen - length of buffer
+ *        name   - domain name
+ *        type   - query type
+ *        rcode  - response code
+ */
+extern int ns_mkreply(void *buf, int buflen, const char *name, int type, int rcode);
+
+
 /*
  * @func  ns_parse_query()
  * @desc  parse DNS query
@@ -216,4 +228,64 @@ extern int ns_parse_query(void *msg, int msglen, char *dname, int *type);
 extern int ns_parse_reply(void *msg, int msglen, char *dname, int *type);
 
 
+/*
+ * @func  ns_reply_ttl()
+ * @desc  check if reply can be cached, and get its TTL
+ * @param msg    - message
+ *        msglen - length of message
+ *        name   - domain name queried
+ *        type   - query type
+ *        ttl    - minimum TTL of answer records, or for NXDOMAIN/NODATA
+ *                 the SOA minimum in authority section (RFC 2308)
+ * @ret   0 - if reply can be cached
+ *        -1 - if not
+ */
+extern int ns_reply_ttl(void *msg, int msglen, const char *name, int type,
+                        uint32_t *ttl);
+
+
+/*
+ * @func  ns_age()
+ * @desc  decrease TTL of every record in message
+ * @param msg    - message, must have been checked by ns_reply_ttl()
+ *        msglen - length of message
+ *        age    - seconds since message was received
+ */
+extern void ns_age(void *msg, int msglen, uint32_t age);
+
+
+/*
+ * @func  ns_tolower()
+ * @desc  convert ASCII letters of domain name to lower case
+ * @ret   1 - if name has upper case letters
+ *        0 - if not
+ */
+extern int ns_tolower(char *name);
+
+
+/*
+ * @func  ns_setqcase()
+ * @desc  set letter case of question name in message
+ * @param msg    - message
+ *        msglen - length of message
+ *        qname  - the same name in wire format, letter case is copied from
+ *                 it, or NULL to convert to lower case
+ */
+extern void ns_setqcase(void *msg, int msglen, const uint8_t *qname);
+
+
+/*
+ * @func  ns_registrable()
+ * @desc  find registrable domain of name, like "example.com" of
+ *        "www.example.com" and "example.co.uk" of "www.example.co.uk"
+ * @param name - domain name in lower case
+ * @ret   pointer to registrable domain in name, name itself if it is
+ *        under arpa, such as reverse lookups, or NULL if name is a top
+ *        level domain, a known second level suffix or an arpa zone
+ * @memo  a few common second level suffixes are known, there is no public
+ *        suffix list
+ */
+extern const char *ns_registrable(const char *name);
+
+
 #endif // DNS_H
@@ -17,7 +17,19 @@
  * along with this program. If not, see <http://www.gnu.org/licenses/>.
  */
 
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#if defined(HAVE_RECVMMSG) && defined(HAVE_SENDMMSG) && !defined(__MINGW32__)
+#  define USE_MMSG
+#  ifndef _GNU_SOURCE
+#    define _GNU_SOURCE
+#  endif
+#endif
+
 #include <assert.h>
+#include <errno.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -36,7 +48,9 @@
 #include "dnsmsg.h"
 #include "event.h"
 #include "log.h"
+#include "pool.h"
 #include "query.h"
+#include "uring.h"
 
 
 /*
@@ -51,17 +65,238 @@ typedef struct
     int protocol;
     ev_io w;
     // used in TCP mode
+    ev_timer timer;
     int msglen;
     int offset;
 } ctx_t;
 
 
+/*
+ * @var  ctx_pool
+ *       msg_pool
+ * @desc pools of connection contexts and TCP message buffers
+ */
+static THREAD_LOCAL pool_t ctx_pool = POOL_INIT(sizeof(ctx_t));
+static THREAD_LOCAL pool_t msg_pool = POOL_INIT(NS_PACKETSZ);
+
+
+/*
+ * @desc timeout of receiving DNS message via TCP, in ms
+ */
+#define TCP_TIMEOUT 3000
+
+
+/*
+ * @desc max count of UDP messages received or sent in one syscall
+ */
+#define UDP_BATCH 64
+
+
+/*
+ * @var  batch
+ * @desc count of UDP messages received or sent in one syscall
+ */
+static int batch = UDP_BATCH;
+
+
+#ifdef USE_MMSG
+/*
+ * @type recv_batch_t
+ * @desc buffers for recvmmsg()
+ */
+typedef struct
+{
+    struct mmsghdr hdr[UDP_BATCH];
+    struct iovec iov[UDP_BATCH];
+    struct sockaddr_storage addr[UDP_BATCH];
+    uint8_t msg[UDP_BATCH][NS_PACKETSZ];
+} recv_batch_t;
+
+
+/*
+ * @type send_batch_t
+ * @desc UDP messages to be sent with sendmmsg() before next poll
+ */
+typedef struct
+{
+    int cnt;
+    ev_prepare w;
+    struct mmsghdr hdr[UDP_BATCH];
+    struct iovec iov[UDP_BATCH];
+    struct
+    {
+        int sock;
+        struct sockaddr_storage addr;
+        uint8_t msg[NS_PACKETSZ];
+    } item[UDP_BATCH];
+} send_batch_t;
+
+
+static THREAD_LOCAL recv_batch_t *rbatch;
+static THREAD_LOCAL send_batch_t *sbatch;
+#endif
+
+
 static void query_udp_recv_cb(ev_io *w);
+static void query_udp_msg(void *data, int sock, void *msg, int msglen,
+                          const struct sockaddr *addr, socklen_t addrlen);
 static void query_tcp_recv_cb(ev_io *w);
 static void reply_udp_recv_cb(ev_io *w);
+static void reply_udp_msg(void *data, int sock, void *msg, int msglen,
+                          const struct sockaddr *addr, socklen_t addrlen);
 static void reply_tcp_recv_cb(ev_io *w);
 static void query_tcp_send_cb(ev_io *w);
 static void reply_tcp_send_cb(ev_io *w);
+static void tcp_timeout_cb(ev_timer *w);
+static int udp_send(int sock, void *msg, int msglen,
+                    const struct sockaddr *addr, socklen_t addrlen);
+static void reply_overload(query_t *query);
+
+
+/*
+ * @func  ctx_new()
+ * @desc  get a connection context from pool
+ */
+static ctx_t *ctx_new(void)
+{
+    ctx_t *ctx = (ctx_t *)pool_alloc(&ctx_pool);
+    if (ctx != NULL)
+    {
+        ctx->msg = NULL;
+    }
+    return ctx;
+}
+
+
+/*
+ * @func  ctx_free()
+ * @desc  put connection context and its message buffer back to pool
+ */
+static void ctx_free(ctx_t *ctx)
+{
+    pool_free(&msg_pool, ctx->msg);
+    pool_free(&ctx_pool, ctx);
+}
+
+
+/*
+ * @func  dnsmsg_set_batch()
+ * @desc  set max count of UDP messages received or sent in one syscall
+ */
+void dnsmsg_set_batch(int n)
+{
+    batch = (n < 1) ? 1 : ((n > UDP_BATCH) ? UDP_BATCH : n);
+}
+
+
+#ifdef USE_MMSG
+/*
+ * @func  udp_recv_batch()
+ * @desc  drain UDP socket with recvmmsg()
+ * @param w  - watcher
+ *        cb - handler of each message
+ * @ret   0 - if succeed
+ *        -1 - if out of memory
+ */
+static int udp_recv_batch(ev_io *w,
+                          void (*cb)(void *data, int sock, void *msg, int msglen,
+                                     const struct sockaddr *addr, socklen_t addrlen))
+{
+    if (rbatch == NULL)
+    {
+        rbatch = (recv_batch_t *)malloc(sizeof(recv_batch_t));
+        if (rbatch == NULL)
+        {
+            LOG("out of memory");
+            return -1;
+        }
+    }
+
+    // 最多读取 4 批，避免饿死其他 socket
+    for (int round = 0; round < 4; round++)
+    {
+        for (int i = 0; i < batch; i++)
+        {
+            rbatch->iov[i].iov_base = rbatch->msg[i];
+            rbatch->iov[i].iov_len = NS_PACKETSZ;
+            bzero(&(rbatch->hdr[i]), sizeof(struct mmsghdr));
+            rbatch->hdr[i].msg_hdr.msg_name = &(rbatch->addr[i]);
+            rbatch->hdr[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_storage);
+            rbatch->hdr[i].msg_hdr.msg_iov = &(rbatch->iov[i]);
+            rbatch->hdr[i].msg_hdr.msg_iovlen = 1;
+        }
+        int n = recvmmsg(w->fd, rbatch->hdr, batch, MSG_DONTWAIT, NULL);
+        if (n < 0)
+        {
+            if ((errno != EAGAIN) && (errno != EWOULDBLOCK))
+            {
+                ERROR("recvmmsg");
+            }
+            break;
+        }
+        for (int i = 0; i < n; i++)
+        {
+            if (rbatch->hdr[i].msg_len > 0)
+            {
+                cb(w->data, w->fd, rbatch->msg[i], (int)rbatch->hdr[i].msg_len,
+                   (struct sockaddr *)&(rbatch->addr[i]),
+                   rbatch->hdr[i].msg_hdr.msg_namelen);
+            }
+        }
+        if (n < batch)
+        {
+            break;
+        }
+    }
+    return 0;
+}
+
+
+/*
+ * @func  udp_flush()
+ * @desc  send queued UDP messages with sendmmsg(), one call per socket
+ */
+static void udp_flush(void)
+{
+    int i = 0;
+    while (i < sbatch->cnt)
+    {
+        int sock = sbatch->item[i].sock;
+        int j = i;
+        while ((j < sbatch->cnt) && (sbatch->item[j].sock == sock))
+        {
+            j++;
+        }
+        int n = sendmmsg(sock, &(sbatch->hdr[i]), j - i, 0);
+        if (n > 0)
+        {
+            i += n;
+        }
+        else if ((n < 0) && (errno == EINTR))
+        {
+            continue;
+        }
+        else
+        {
+            // 丢弃发送失败的消息，同 sendto()
+            ERROR("sendmmsg");
+            i++;
+        }
+    }
+    sbatch->cnt = 0;
+}
+
+
+/*
+ * @func  udp_flush_cb()
+ * @desc  send queued UDP messages before polling
+ */
+static void udp_flush_cb(ev_prepare *w)
+{
+    ev_prepare_stop(w);
+    udp_flush();
+}
+#endif
 
 
 /*
@@ -69,39 +304,59 @@ static void reply_tcp_send_cb(ev_io *w);
  * @desc receive DNS query asynchronously
  * @memo msg whill be freed after callback
  */
-void query_recv(int sock, int protocol, void (*cb)(uint16_t id))
+int query_recv(int sock, int protocol, void (*cb)(uint16_t id))
 {
     assert(sock > 0);
     assert(protocol == ns_udp || protocol == ns_tcp);
     assert(cb != NULL);
 
-    ctx_t *ctx = (ctx_t *)malloc(sizeof(ctx_t));
+    ctx_t *ctx = ctx_new();
     if (ctx == NULL)
     {
-        LOG("out of memory");
-        return;
+        return -1;
     }
     ctx->cb = (void (*)())cb;
 
     if (protocol == ns_udp)
     {
         ev_io_init(&(ctx->w), query_udp_recv_cb, sock, EV_READ);
+        if (uring_enabled())
+        {
+            // io_uring 失效时改用 ctx->w 读取
+            ctx->w.data = (void *)ctx;
+            if (uring_recv(sock, query_udp_msg, ctx, &(ctx->w)) != 0)
+            {
+                ctx_free(ctx);
+                return -1;
+            }
+            return 0;
+        }
     }
     else
     {
-        ctx->msg = malloc(NS_PACKETSZ);
+        ctx->msg = pool_alloc(&msg_pool);
         if (ctx->msg == NULL)
         {
-            LOG("out of memory");
-            free(ctx);
-            return;
+            ctx_free(ctx);
+            return -1;
         }
         ev_io_init(&(ctx->w), query_tcp_recv_cb, sock, EV_READ);
         ctx->msglen = 0;
         ctx->offset = 0;
     }
     ctx->w.data = (void *)ctx;
-    ev_io_start(&(ctx->w));
+    if (ev_io_start(&(ctx->w)) != 0)
+    {
+        ctx_free(ctx);
+        return -1;
+    }
+    if (protocol == ns_tcp)
+    {
+        ev_timer_init(&(ctx->timer), tcp_timeout_cb, TCP_TIMEOUT, 0);
+        ctx->timer.data = (void *)ctx;
+        ev_timer_start(&(ctx->timer));
+    }
+    return 0;
 }
 
 
@@ -111,45 +366,72 @@ void query_recv(int sock, int protocol, void (*cb)(uint16_t id))
  */
 static void query_udp_recv_cb(ev_io *w)
 {
-    ctx_t *ctx = (ctx_t *)(w->data);
+#ifdef USE_MMSG
+    if ((batch > 1) && (udp_recv_batch(w, query_udp_msg) == 0))
+    {
+        return;
+    }
+#endif
+
+    uint8_t msg[NS_PACKETSZ];
+    struct sockaddr_storage addr;
+    socklen_t addrlen = sizeof(struct sockaddr_storage);
+    int msglen = recvfrom(w->fd, msg, NS_PACKETSZ, 0,
+                          (struct sockaddr *)&addr, &addrlen);
+    if (msglen <= 0)
+    {
+        ERROR("recvfrom");
+    }
+    else
+    {
+        query_udp_msg(w->data, w->fd, msg, msglen, (struct sockaddr *)&addr, addrlen);
+    }
+}
+
+
+/*
+ * @func  query_udp_msg()
+ * @desc  handle DNS query received via UDP
+ * @param data - context
+ *        sock - UDP socket
+ *        addr - address of client
+ */
+static void query_udp_msg(void *data, int sock, void *msg, int msglen,
+                          const struct sockaddr *addr, socklen_t addrlen)
+{
+    ctx_t *ctx = (ctx_t *)data;
 
     assert(ctx != NULL);
 
-    uint8_t msg[NS_PACKETSZ];
-    query_t *query = (query_t *)malloc(sizeof(query_t));
+    char name[NS_NAMESZ];
+    int type;
+    if ((addrlen > sizeof(struct sockaddr_in6))
+        || (ns_parse_query(msg, msglen, name, &type) != 0))
+    {
+        LOG("bad query");
+        return;
+    }
+    // 域名统一转为小写，问题中的原始大小写在应答时恢复
+    query_t *query = query_new(name, ns_tolower(name)
+                                     ? (uint8_t *)msg + sizeof(ns_header) : NULL);
     if (query == NULL)
     {
-        LOG("out of memory");
         return;
     }
-    query->sock = w->fd;
+    query->sock = sock;
     query->protocol = ns_udp;
-    query->addrlen = sizeof(struct sockaddr_storage);
-    int msglen = recvfrom(w->fd, msg, NS_PACKETSZ, 0,
-                          (struct sockaddr *)&(query->addr),
-                          &(query->addrlen));
-    if (msglen <= 0)
+    memcpy(&(query->addr), addr, addrlen);
+    query->addrlen = addrlen;
+    query->id = ns_getid(msg);
+    query->type = type;
+    if (query_add(query) == 0)
     {
-        ERROR("recvfrom");
+        (ctx->cb)(query->id);
     }
     else
     {
-        query->id = ns_getid(msg);
-        if (ns_parse_query(msg, msglen, query->name, &(query->type)) != 0)
-        {
-            LOG("bad query");
-        }
-        else
-        {
-            if (query_add(query) == 0)
-            {
-                (ctx->cb)(query->id);
-            }
-            else
-            {
-                free(query);
-            }
-        }
+        reply_overload(query);
+        query_free(query);
     }
 }
 
@@ -177,9 +459,9 @@ static void query_tcp_recv_cb(ev_io *w)
                 ERROR("recv");
             }
             ev_io_stop(w);
+            ev_timer_stop(&(ctx->timer));
             close(w->fd);
-            free(ctx->msg);
-            free(ctx);
+            ctx_free(ctx);
             return;
         }
         ctx->msglen = (int)ntohs(msglen);
@@ -201,42 +483,49 @@ static void query_tcp_recv_cb(ev_io *w)
                 ERROR("recv");
             }
             ev_io_stop(w);
+            ev_timer_stop(&(ctx->timer));
             close(w->fd);
-            free(ctx->msg);
-            free(ctx);
+            ctx_free(ctx);
         }
         else if (ctx->offset + n == ctx->msglen)
         {
             // 读取 DNS 请求完毕
             ev_io_stop(w);
-            query_t *query = (query_t *)malloc(sizeof(query_t));
+            ev_timer_stop(&(ctx->timer));
+            char name[NS_NAMESZ];
+            int type;
+            query_t *query = NULL;
+            if (ns_parse_query(ctx->msg, ctx->msglen, name, &type) != 0)
+            {
+                LOG("bad query");
+            }
+            else
+            {
+                query = query_new(name, ns_tolower(name)
+                                        ? (uint8_t *)ctx->msg + sizeof(ns_header)
+                                        : NULL);
+            }
             if (query == NULL)
             {
-                LOG("out of memory");
-                free(ctx->msg);
-                free(ctx);
+                close(w->fd);
+                ctx_free(ctx);
                 return;
             }
             query->sock = w->fd;
             query->protocol = ns_tcp;
+            query->addrlen = 0;
             query->id = ns_getid(ctx->msg);
-            if (ns_parse_query(ctx->msg, ctx->msglen, query->name, &(query->type)) == 0)
+            query->type = type;
+            if (query_add(query) == 0)
             {
-                if (query_add(query) == 0)
-                {
-                    (ctx->cb)(query->id);
-                }
-                else
-                {
-                    free(query);
-                }
+                (ctx->cb)(query->id);
             }
             else
             {
-                LOG("bad query");
+                reply_overload(query);
+                query_free(query);
             }
-            free(ctx->msg);
-            free(ctx);
+            ctx_free(ctx);
         }
     }
 }
@@ -247,39 +536,59 @@ static void query_tcp_recv_cb(ev_io *w)
  * @desc receive DNS query asynchronously
  * @memo msg whill be freed after callback
  */
-void reply_recv(int sock, int protocol, void (*cb)(void *msg, int msglen))
+int reply_recv(int sock, int protocol, void (*cb)(void *msg, int msglen))
 {
     assert(sock > 0);
     assert(protocol == ns_udp || protocol == ns_tcp);
     assert(cb != NULL);
 
-    ctx_t *ctx = (ctx_t *)malloc(sizeof(ctx_t));
+    ctx_t *ctx = ctx_new();
     if (ctx == NULL)
     {
-        LOG("out of memory");
-        return;
+        return -1;
     }
     ctx->cb = cb;
 
     if (protocol == ns_udp)
     {
         ev_io_init(&(ctx->w), reply_udp_recv_cb, sock, EV_READ);
+        if (uring_enabled())
+        {
+            // io_uring 失效时改用 ctx->w 读取
+            ctx->w.data = (void *)ctx;
+            if (uring_recv(sock, reply_udp_msg, ctx, &(ctx->w)) != 0)
+            {
+                ctx_free(ctx);
+                return -1;
+            }
+            return 0;
+        }
     }
     else
     {
-        ctx->msg = malloc(NS_PACKETSZ);
+        ctx->msg = pool_alloc(&msg_pool);
         if (ctx->msg == NULL)
         {
-            LOG("out of memory");
-            free(ctx);
-            return;
+            ctx_free(ctx);
+            return -1;
         }
         ev_io_init(&(ctx->w), reply_tcp_recv_cb, sock, EV_READ);
         ctx->msglen = 0;
         ctx->offset = 0;
     }
     ctx->w.data = (void *)ctx;
-    ev_io_start(&(ctx->w));
+    if (ev_io_start(&(ctx->w)) != 0)
+    {
+        ctx_free(ctx);
+        return -1;
+    }
+    if (protocol == ns_tcp)
+    {
+        ev_timer_init(&(ctx->timer), tcp_timeout_cb, TCP_TIMEOUT, 0);
+        ctx->timer.data = (void *)ctx;
+        ev_timer_start(&(ctx->timer));
+    }
+    return 0;
 }
 
 
@@ -289,9 +598,12 @@ void reply_recv(int sock, int protocol, void (*cb)(void *msg, int msglen))
  */
 static void reply_udp_recv_cb(ev_io *w)
 {
-    ctx_t *ctx = (ctx_t *)(w->data);
-
-    assert(ctx != NULL);
+#ifdef USE_MMSG
+    if ((batch > 1) && (udp_recv_batch(w, reply_udp_msg) == 0))
+    {
+        return;
+    }
+#endif
 
     uint8_t msg[NS_PACKETSZ];
     int msglen = recvfrom(w->fd, msg, NS_PACKETSZ, 0, NULL, NULL);
@@ -301,11 +613,30 @@ static void reply_udp_recv_cb(ev_io *w)
     }
     else
     {
-        (ctx->cb)(msg, msglen);
+        reply_udp_msg(w->data, w->fd, msg, msglen, NULL, 0);
     }
 }
 
 
+/*
+ * @func  reply_udp_msg()
+ * @desc  handle DNS reply received via UDP
+ * @param data - context
+ */
+static void reply_udp_msg(void *data, int sock, void *msg, int msglen,
+                          const struct sockaddr *addr, socklen_t addrlen)
+{
+    ctx_t *ctx = (ctx_t *)data;
+
+    assert(ctx != NULL);
+    (void)sock;
+    (void)addr;
+    (void)addrlen;
+
+    (ctx->cb)(msg, msglen);
+}
+
+
 /*
  * @func reply_tcp_recv_cb()
  * @desc callback for recivie DNS reply via TCP
@@ -329,9 +660,9 @@ static void reply_tcp_recv_cb(ev_io *w)
                 ERROR("recv");
             }
             ev_io_stop(w);
+            ev_timer_stop(&(ctx->timer));
             close(w->fd);
-            free(ctx->msg);
-            free(ctx);
+            ctx_free(ctx);
             return;
         }
         ctx->msglen = (int)ntohs(msglen);
@@ -353,61 +684,82 @@ static void reply_tcp_recv_cb(ev_io *w)
                 ERROR("recv");
             }
             ev_io_stop(w);
+            ev_timer_stop(&(ctx->timer));
             close(w->fd);
-            free(ctx->msg);
-            free(ctx);
+            ctx_free(ctx);
         }
         else if (ctx->offset + n == ctx->msglen)
         {
             // 读取 DNS 应答完毕
             ev_io_stop(w);
+            ev_timer_stop(&(ctx->timer));
             close(w->fd);
             (ctx->cb)(ctx->msg, ctx->msglen);
-            free(ctx->msg);
-            free(ctx);
+            ctx_free(ctx);
         }
     }
 }
 
 
+/*
+ * @func tcp_timeout_cb()
+ * @desc callback for timeout of receiving DNS message via TCP
+ */
+static void tcp_timeout_cb(ev_timer *w)
+{
+    ctx_t *ctx = (ctx_t *)(w->data);
+
+    assert(ctx != NULL);
+
+    ev_io_stop(&(ctx->w));
+    close(ctx->w.fd);
+    ctx_free(ctx);
+}
+
+
 /*
  * @func query_send()
  * @desc send DNS query
- * @memo synchronously for UDP, asynchronously for TCP
+ * @memo synchronously for UDP (queued with io_uring or sendmmsg), asynchronously for TCP
  */
-void query_send(int sock, int protocol, void *msg, int msglen,
-                const struct sockaddr *addr, socklen_t addrlen)
+int query_send(int sock, int protocol, void *msg, int msglen,
+               const struct sockaddr *addr, socklen_t addrlen)
 {
     if (protocol == ns_udp)
     {
-        ssize_t n = sendto(sock, msg, msglen, 0, addr, addrlen);
-        if (n < 0)
-        {
-            ERROR("sendto");
-        }
+        return udp_send(sock, msg, msglen, addr, addrlen);
     }
     else
     {
-        ctx_t *ctx = (ctx_t *)malloc(sizeof(ctx_t));
+        ctx_t *ctx = ctx_new();
         if (ctx == NULL)
         {
-            LOG("out of memory");
-            return;
+            return -1;
+        }
+        if (msglen > NS_PACKETSZ)
+        {
+            LOG("message too long");
+            ctx_free(ctx);
+            return -1;
         }
-        ctx->msg = malloc(msglen);
+        ctx->msg = pool_alloc(&msg_pool);
         if (ctx->msg == NULL)
         {
-            LOG("out of memory");
-            free(ctx);
-            return;
+            ctx_free(ctx);
+            return -1;
         }
         memcpy(ctx->msg, msg, msglen);
         ctx->msglen = msglen;
         ctx->offset = -2;
         ev_io_init(&(ctx->w), query_tcp_send_cb, sock, EV_WRITE);
         ctx->w.data = (void *)ctx;
-        ev_io_start(&(ctx->w));
+        if (ev_io_start(&(ctx->w)) != 0)
+        {
+            ctx_free(ctx);
+            return -1;
+        }
     }
+    return 0;
 }
 
 
@@ -434,8 +786,7 @@ static void query_tcp_send_cb(ev_io *w)
                 ERROR("send");
             }
             ev_io_stop(w);
-            free(ctx->msg);
-            free(ctx);
+            ctx_free(ctx);
             return;
         }
         ctx->offset = 0;
@@ -453,16 +804,14 @@ static void query_tcp_send_cb(ev_io *w)
             }
             ev_io_stop(w);
             close(w->fd);
-            free(ctx->msg);
-            free(ctx);
+            ctx_free(ctx);
             return;
         }
         if (ctx->offset + n == ctx->msglen)
         {
             // 发送 DNS 请求完毕
             ev_io_stop(w);
-            free(ctx->msg);
-            free(ctx);
+            ctx_free(ctx);
         }
     }
 }
@@ -471,42 +820,47 @@ static void query_tcp_send_cb(ev_io *w)
 /*
  * @func reply_send()
  * @desc send DNS reply
- * @memo synchronously for UDP, asynchronously for TCP
+ * @memo synchronously for UDP (queued with io_uring or sendmmsg), asynchronously for TCP
  *       if protocol is TCP, sock will be closed after reply sent
  */
-void reply_send(int sock, int protocol, void *msg, int msglen,
-                const struct sockaddr *addr, socklen_t addrlen)
+int reply_send(int sock, int protocol, void *msg, int msglen,
+               const struct sockaddr *addr, socklen_t addrlen)
 {
     if (protocol == ns_udp)
     {
-        ssize_t n = sendto(sock, msg, msglen, 0, addr, addrlen);
-        if (n < 0)
-        {
-            ERROR("sendto");
-        }
+        return udp_send(sock, msg, msglen, addr, addrlen);
     }
     else
     {
-        ctx_t *ctx = (ctx_t *)malloc(sizeof(ctx_t));
+        ctx_t *ctx = ctx_new();
         if (ctx == NULL)
         {
-            LOG("out of memory");
-            return;
+            return -1;
         }
-        ctx->msg = malloc(msglen);
+        if (msglen > NS_PACKETSZ)
+        {
+            LOG("message too long");
+            ctx_free(ctx);
+            return -1;
+        }
+        ctx->msg = pool_alloc(&msg_pool);
         if (ctx->msg == NULL)
         {
-            LOG("out of memory");
-            free(ctx);
-            return;
+            ctx_free(ctx);
+            return -1;
         }
         memcpy(ctx->msg, msg, msglen);
         ctx->msglen = msglen;
         ctx->offset = -2;
         ev_io_init(&(ctx->w), reply_tcp_send_cb, sock, EV_WRITE);
         ctx->w.data = (void *)ctx;
-        ev_io_start(&(ctx->w));
+        if (ev_io_start(&(ctx->w)) != 0)
+        {
+            ctx_free(ctx);
+            return -1;
+        }
     }
+    return 0;
 }
 
 
@@ -534,8 +888,7 @@ static void reply_tcp_send_cb(ev_io *w)
             }
             ev_io_stop(w);
             close(w->fd);
-            free(ctx->msg);
-            free(ctx);
+            ctx_free(ctx);
             return;
         }
         ctx->offset = 0;
@@ -553,8 +906,7 @@ static void reply_tcp_send_cb(ev_io *w)
             }
             ev_io_stop(w);
             close(w->fd);
-            free(ctx->msg);
-            free(ctx);
+            ctx_free(ctx);
             return;
         }
         if (ctx->offset + n == ctx->msglen)
@@ -562,8 +914,95 @@ static void reply_tcp_send_cb(ev_io *w)
             // 发送 DNS 消息完毕
             ev_io_stop(w);
             close(w->fd);
-            free(ctx->msg);
-            free(ctx);
+            ctx_free(ctx);
+        }
+    }
+}
+
+
+/*
+ * @func  udp_send()
+ * @desc  send UDP message, queued with io_uring or sendmmsg() if possible
+ */
+static int udp_send(int sock, void *msg, int msglen,
+                    const struct sockaddr *addr, socklen_t addrlen)
+{
+    if (uring_enabled())
+    {
+        return uring_sendto(sock, msg, msglen, addr, addrlen);
+    }
+
+#ifdef USE_MMSG
+    if ((batch > 1) && (msglen <= NS_PACKETSZ))
+    {
+        if (sbatch == NULL)
+        {
+            sbatch = (send_batch_t *)malloc(sizeof(send_batch_t));
+            if (sbatch == NULL)
+            {
+                LOG("out of memory");
+                return -1;
+            }
+            sbatch->cnt = 0;
+            ev_prepare_init(&(sbatch->w), udp_flush_cb);
+        }
+        if (sbatch->cnt >= batch)
+        {
+            udp_flush();
+        }
+
+        int i = sbatch->cnt++;
+        sbatch->item[i].sock = sock;
+        memcpy(sbatch->item[i].msg, msg, msglen);
+        memcpy(&(sbatch->item[i].addr), addr, addrlen);
+        sbatch->iov[i].iov_base = sbatch->item[i].msg;
+        sbatch->iov[i].iov_len = msglen;
+        bzero(&(sbatch->hdr[i]), sizeof(struct mmsghdr));
+        sbatch->hdr[i].msg_hdr.msg_name = &(sbatch->item[i].addr);
+        sbatch->hdr[i].msg_hdr.msg_namelen = addrlen;
+        sbatch->hdr[i].msg_hdr.msg_iov = &(sbatch->iov[i]);
+        sbatch->hdr[i].msg_hdr.msg_iovlen = 1;
+        if (!ev_is_active(&(sbatch->w)))
+        {
+            ev_prepare_start(&(sbatch->w));
         }
+        return 0;
+    }
+#endif
+
+    ssize_t n = sendto(sock, msg, msglen, 0, addr, addrlen);
+    if (n < 0)
+    {
+        ERROR("sendto");
+        return -1;
+    }
+    return 0;
+}
+
+
+/*
+ * @func  reply_overload()
+ * @desc  answer SERVFAIL at once to query not added for overload
+ * @memo  TCP socket is closed after reply sent
+ */
+static void reply_overload(query_t *query)
+{
+    uint8_t msg[NS_PACKETSZ];
+    int msglen = ns_mkreply(msg, NS_PACKETSZ, query->name, query->type,
+                            ns_r_servfail);
+    if (msglen > 0)
+    {
+        ns_setid(msg, query->id);
+        // 与 reply_one() 相同，还原客户端问题中的大小写 (0x20)
+        ns_setqcase(msg, msglen, query_qname(query));
+        if (reply_send(query->sock, query->protocol, msg, msglen,
+                       (struct sockaddr *)&(query->addr), query->addrlen) == 0)
+        {
+            return;
+        }
+    }
+    if (query->protocol == ns_tcp)
+    {
+        close(query->sock);
     }
 }
@@ -28,8 +28,10 @@
  * @func query_recv()
  * @desc receive DNS query asynchronously
  * @memo @memo the query received will be inserted into query list
+ * @ret  0 - if succeed
+ *       -1 - if failed
  */
-extern void query_recv(int sock, int protocol, void (*cb)(uint16_t id));
+extern int query_recv(int sock, int protocol, void (*cb)(uint16_t id));
 
 
 /*
@@ -37,27 +39,41 @@ extern void query_recv(int sock, int protocol, void (*cb)(uint16_t id));
  * @desc receive DNS reply asynchronously
  * @memo msg will be freed after callback
  *       if protocol is ns_tcp, sock will be closed after receive 
+ * @ret  0 - if succeed
+ *       -1 - if failed
  */
-extern void reply_recv(int sock, int protocol, void (*cb)(void *msg, int msglen));
+extern int reply_recv(int sock, int protocol, void (*cb)(void *msg, int msglen));
 
 
 /*
  * @func query_send()
  * @desc send DNS query
- * @memo synchronously for UDP, asynchronously for TCP
+ * @memo synchronously for UDP (queued with io_uring or sendmmsg), asynchronously for TCP
+ * @ret  0 - if succeed
+ *       -1 - if failed
  */
-extern void query_send(int sock, int protocol, void *msg, int msglen,
-                       const struct sockaddr *addr, socklen_t addrlen);
+extern int query_send(int sock, int protocol, void *msg, int msglen,
+                      const struct sockaddr *addr, socklen_t addrlen);
 
 
 /*
  * @func reply_send()
  * @desc send DNS reply
- * @memo synchronously for UDP, asynchronously for TCP
+ * @memo synchronously for UDP (queued with io_uring or sendmmsg), asynchronously for TCP
  *       if prot is TCP, sock will be closed after reply sent
+ * @ret  0 - if succeed
+ *       -1 - if failed, sock is not closed
  */
-extern void reply_send(int sock, int protocol, void *msg, int msglen,
-                       const struct sockaddr *addr, socklen_t addrlen);
+extern int reply_send(int sock, int protocol, void *msg, int msglen,
+                      const struct sockaddr *addr, socklen_t addrlen);
+
+
+/*
+ * @func  dnsmsg_set_batch()
+ * @desc  set max count of UDP messages received or sent in one syscall
+ * @param n - count, 1 means no batching
+ */
+extern void dnsmsg_set_batch(int n);
 
 
 #endif // DNSMSG_H
@@ -0,0 +1,222 @@
+/*
+ * domains.c - preloaded domain lists
+ *
+ * Copyright (C) 2014 - 2015, Xiaoxiao <i@xiaoxiao.im>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "dns.h"
+#include "domains.h"
+#include "dtable.h"
+#include "log.h"
+
+
+/*
+ * @var  table
+ * @desc domains of all lists, value is 1 byte of blocked or not
+ */
+static dtable_t table = {NULL, 0, 0, NULL, 0, 1};
+
+
+/*
+ * @func  parse_line()
+ * @desc  find domain in a line of list file
+ * @param line - the line, modified
+ * @ret   the domain in lower case, or NULL if there is no valid domain
+ */
+static char *parse_line(char *line)
+{
+    // 跳过行首空白符
+    while ((*line == ' ') || (*line == '\t'))
+    {
+        line++;
+    }
+    // 跳过注释、adblock 的例外规则和 URL 规则
+    if ((*line == '#') || (*line == '!') || (*line == '[') || (*line == '@')
+        || ((*line == '|') && (*(line + 1) != '|')))
+    {
+        return NULL;
+    }
+
+    char *p = strstr(line, "=/");
+    if (p != NULL)
+    {
+        // dnsmasq: server=/example.com/114.114.114.114
+        line = p + 2;
+    }
+    else if (*line == '|')
+    {
+        // adblock: ||example.com^
+        line += 2;
+    }
+    if (*line == '.')
+    {
+        line++;
+    }
+
+    char *name = line;
+    for (p = name; *p != '\0'; p++)
+    {
+        if ((*p >= 'A') && (*p <= 'Z'))
+        {
+            *p += 'a' - 'A';
+        }
+        else if ((*p == '/') || (*p == '^') || (*p == ' ') || (*p == '\t')
+                 || (*p == '\r') || (*p == '\n'))
+        {
+            break;
+        }
+        else if (!(((*p >= 'a') && (*p <= 'z')) || ((*p >= '0') && (*p <= '9'))
+                   || (*p == '-') || (*p == '_') || (*p == '.')))
+        {
+            // 通配符等无法按后缀匹配的规则
+            return NULL;
+        }
+    }
+    *p = '\0';
+    if ((p > name) && (*(p - 1) == '.'))
+    {
+        *(--p) = '\0';
+    }
+
+    // 检查 label 长度
+    size_t len = p - name;
+    if ((len == 0) || (len >= NS_NAMESZ))
+    {
+        return NULL;
+    }
+    size_t label = 0;
+    for (p = name; ; p++)
+    {
+        if ((*p == '.') || (*p == '\0'))
+        {
+            if ((label == 0) || (label > 63))
+            {
+                return NULL;
+            }
+            if (*p == '\0')
+            {
+                break;
+            }
+            label = 0;
+        }
+        else
+        {
+            label++;
+        }
+    }
+    return name;
+}
+
+
+/*
+ * @func  load()
+ * @desc  append domains in file to table
+ * @param path    - path of list file
+ *        blocked - blocked or not
+ */
+static int load(const char *path, char blocked)
+{
+    FILE *f = fopen(path, "r");
+    if (f == NULL)
+    {
+        ERROR(path);
+        return -1;
+    }
+
+    char buf[512];
+    while (fgets(buf, sizeof(buf), f) != NULL)
+    {
+        size_t len = strlen(buf);
+        if ((len > 0) && (buf[len - 1] != '\n') && !feof(f))
+        {
+            // 太长的行，丢弃剩余部分
+            int c;
+            while (((c = fgetc(f)) != EOF) && (c != '\n'));
+            continue;
+        }
+        char *name = parse_line(buf);
+        if ((name != NULL) && (dtable_add(&table, name, &blocked) != 0))
+        {
+            fclose(f);
+            return -1;
+        }
+    }
+    fclose(f);
+    return 0;
+}
+
+
+/*
+ * @func  domains_load()
+ * @desc  load domain lists
+ * @memo  blocked list is loaded first, so that it wins when a domain is in
+ *        both lists
+ */
+int domains_load(const char *blocked_list, const char *cn_list)
+{
+    domains_free();
+    if (((blocked_list != NULL) && (load(blocked_list, 1) != 0))
+        || ((cn_list != NULL) && (load(cn_list, 0) != 0))
+        || (dtable_build(&table) != 0))
+    {
+        domains_free();
+        return -1;
+    }
+    return 0;
+}
+
+
+/*
+ * @func  domains_search()
+ * @desc  search domain lists
+ */
+int domains_search(const char *name)
+{
+    uint32_t match[DTABLE_MAX_MATCH];
+    int n = dtable_match(&table, name, match);
+    return (n > 0) ? *DTABLE_VALUE(&table, match[n - 1]) : -1;
+}
+
+
+/*
+ * @func  domains_stat()
+ * @desc  get statistics of domain lists
+ */
+void domains_stat(size_t *count, size_t *bytes)
+{
+    if (count != NULL)
+    {
+        *count = table.count;
+    }
+    if (bytes != NULL)
+    {
+        *bytes = table.size + table.count * sizeof(uint32_t);
+    }
+}
+
+
+/*
+ * @func  domains_free()
+ * @desc  free domain lists
+ */
+void domains_free(void)
+{
+    dtable_free(&table);
+}
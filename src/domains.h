@@ -0,0 +1,68 @@
+/*
+ * domains.h - preloaded domain lists
+ *
+ * Copyright (C) 2014 - 2015, Xiaoxiao <i@xiaoxiao.im>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DOMAINS_H
+#define DOMAINS_H
+
+#include <stddef.h>
+
+
+/*
+ * @func  domains_load()
+ * @desc  load domain lists
+ * @param blocked_list - file of blocked domains, or NULL
+ *        cn_list      - file of domains not blocked, or NULL
+ * @memo  one domain per line, lines like "server=/example.com/..." of
+ *        dnsmasq and "||example.com" of adblock are also accepted, other
+ *        lines are skipped. call it before worker threads are started,
+ *        the lists are read only afterwards
+ */
+extern int domains_load(const char *blocked_list, const char *cn_list);
+
+
+/*
+ * @func  domains_search()
+ * @desc  search domain lists
+ * @param name - domain name in lower case
+ * @ret   1 - blocked
+ *        0 - not blocked
+ *        -1 - not listed
+ * @memo  the longest listed suffix of name is used, a domain in both lists
+ *        is blocked
+ */
+extern int domains_search(const char *name);
+
+
+/*
+ * @func  domains_stat()
+ * @desc  get statistics of domain lists
+ * @param count - count of domains
+ *        bytes - memory used
+ */
+extern void domains_stat(size_t *count, size_t *bytes);
+
+
+/*
+ * @func  domains_free()
+ * @desc  free domain lists
+ */
+extern void domains_free(void);
+
+
+#endif // DOMAINS_H
@@ -0,0 +1,294 @@
+/*
+ * dtable.c - sorted table of domain names
+ *
+ * Copyright (C) 2014 - 2015, Xiaoxiao <i@xiaoxiao.im>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include "dtable.h"
+#include "log.h"
+
+
+/*
+ * @func  dtable_init()
+ * @desc  initialize an empty table
+ */
+void dtable_init(dtable_t *table, size_t vsize)
+{
+    bzero(table, sizeof(dtable_t));
+    table->vsize = vsize;
+}
+
+
+/*
+ * @func  reverse()
+ * @desc  reverse labels of domain name
+ * @param name - domain name
+ *        len  - length of name
+ *        key  - buffer of at least len + 1 bytes
+ */
+static void reverse(const char *name, size_t len, char *key)
+{
+    const char *end = name + len;
+    char *p = key;
+    while (end > name)
+    {
+        const char *start = end;
+        while ((start > name) && (*(start - 1) != '.'))
+        {
+            start--;
+        }
+        memcpy(p, start, end - start);
+        p += end - start;
+        if (start > name)
+        {
+            *p++ = '.';
+            start--;
+        }
+        end = start;
+    }
+    *p = '\0';
+}
+
+
+/*
+ * @func  dtable_add()
+ * @desc  append a domain
+ */
+int dtable_add(dtable_t *table, const char *name, const void *value)
+{
+    size_t len = strlen(name);
+    if (len >= NS_NAMESZ)
+    {
+        return -1;
+    }
+    char key[NS_NAMESZ];
+    reverse(name, len, key);
+    return dtable_add_key(table, key, value);
+}
+
+
+/*
+ * @func  dtable_add_key()
+ * @desc  append a reversed domain
+ */
+int dtable_add_key(dtable_t *table, const char *key, const void *value)
+{
+    size_t len = table->vsize + strlen(key) + 1;
+    if (table->size + len > table->cap)
+    {
+        size_t cap = (table->cap < 65536) ? 65536 : table->cap * 2;
+        char *p = (char *)realloc(table->blob, cap);
+        if (p == NULL)
+        {
+            LOG("out of memory");
+            return -1;
+        }
+        table->blob = p;
+        table->cap = cap;
+    }
+    memcpy(table->blob + table->size, value, table->vsize);
+    memcpy(table->blob + table->size + table->vsize, key, len - table->vsize);
+    table->size += len;
+    table->count++;
+    return 0;
+}
+
+
+/*
+ * @func  compare()
+ * @desc  compare reversed domains for qsort(), the one appended first is
+ *        less if both are the same
+ */
+static int compare(const void *a, const void *b)
+{
+    const char *x = *(const char *const *)a;
+    const char *y = *(const char *const *)b;
+    int r = strcmp(x, y);
+    if (r == 0)
+    {
+        r = (x < y) ? -1 : 1;
+    }
+    return r;
+}
+
+
+/*
+ * @func  dtable_build()
+ * @desc  sort entries and remove duplicates
+ * @memo  blob is rewritten in sorted order, so that neighbours of binary
+ *        search are near in memory
+ */
+int dtable_build(dtable_t *table)
+{
+    if (table->size >= UINT32_MAX)
+    {
+        LOG("too many domains");
+        return -1;
+    }
+    if (table->index != NULL)
+    {
+        LOG("table is built already");
+        return -1;
+    }
+    if (table->count == 0)
+    {
+        return 0;
+    }
+
+    const char **keys = (const char **)malloc(table->count * sizeof(char *));
+    uint32_t *index = (uint32_t *)malloc(table->count * sizeof(uint32_t));
+    char *blob = (char *)malloc(table->size);
+    if ((keys == NULL) || (index == NULL) || (blob == NULL))
+    {
+        free(keys);
+        free(index);
+        free(blob);
+        LOG("out of memory");
+        return -1;
+    }
+
+    size_t off = 0;
+    for (size_t i = 0; i < table->count; i++)
+    {
+        keys[i] = DTABLE_KEY(table, off);
+        off += table->vsize + strlen(keys[i]) + 1;
+    }
+    qsort(keys, table->count, sizeof(char *), compare);
+
+    // 去重，按排序后的顺序重写 blob
+    size_t n = 0;
+    off = 0;
+    for (size_t i = 0; i < table->count; i++)
+    {
+        if ((n > 0) && (strcmp(keys[i], blob + index[n - 1] + table->vsize) == 0))
+        {
+            continue;
+        }
+        size_t len = table->vsize + strlen(keys[i]) + 1;
+        memcpy(blob + off, keys[i] - table->vsize, len);
+        index[n++] = (uint32_t)off;
+        off += len;
+    }
+    free(keys);
+    free(table->blob);
+
+    table->blob = (char *)realloc(blob, off);
+    if (table->blob == NULL)
+    {
+        table->blob = blob;
+    }
+    table->size = off;
+    table->cap = off;
+    table->count = n;
+    uint32_t *p = (uint32_t *)realloc(index, n * sizeof(uint32_t));
+    table->index = (p != NULL) ? p : index;
+    return 0;
+}
+
+
+/*
+ * @func  lower_bound()
+ * @desc  find first entry not less than first len bytes of key in
+ *        index[lo, count)
+ */
+static size_t lower_bound(const dtable_t *table, size_t lo, const char *key, size_t len)
+{
+    size_t hi = table->count;
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        if (strncmp(DTABLE_KEY(table, table->index[mid]), key, len) < 0)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+
+/*
+ * @func  dtable_match()
+ * @desc  find entries of all suffixes of name
+ */
+int dtable_match(const dtable_t *table, const char *name, uint32_t *match)
+{
+    size_t len = strlen(name);
+    if ((table->count == 0) || (len >= NS_NAMESZ))
+    {
+        return 0;
+    }
+    char key[NS_NAMESZ];
+    reverse(name, len, key);
+
+    // 每次多匹配一个 label："com"，"com.example"，……
+    // 后一个总比前一个大，从上次的位置开始查找
+    int n = 0;
+    size_t lo = 0;
+    size_t p = 0;
+    while (n < DTABLE_MAX_MATCH)
+    {
+        while ((p < len) && (key[p] != '.'))
+        {
+            p++;
+        }
+        lo = lower_bound(table, lo, key, p);
+        if (lo >= table->count)
+        {
+            break;
+        }
+        const char *entry = DTABLE_KEY(table, table->index[lo]);
+        if (strncmp(entry, key, p) != 0)
+        {
+            // 没有以它开头的域名，更长的后缀也不会有
+            break;
+        }
+        if (entry[p] == '\0')
+        {
+            match[n++] = table->index[lo];
+            lo++;
+        }
+        if (p >= len)
+        {
+            break;
+        }
+        p++;
+    }
+    return n;
+}
+
+
+/*
+ * @func  dtable_free()
+ * @desc  free memory of table
+ */
+void dtable_free(dtable_t *table)
+{
+    if (table->cap > 0)
+    {
+        // 自己分配的 index，只对外是只读的
+        free(table->blob);
+        free((void *)(uintptr_t)table->index);
+    }
+    dtable_init(table, table->vsize);
+}
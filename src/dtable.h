@@ -0,0 +1,113 @@
+/*
+ * dtable.h - sorted table of domain names
+ *
+ * Copyright (C) 2014 - 2015, Xiaoxiao <i@xiaoxiao.im>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DTABLE_H
+#define DTABLE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "dns.h"
+
+
+/*
+ * @type dtable_t
+ * @desc domains with labels reversed, like "com.example.www", sorted so
+ *       that subdomains of a domain are contiguous
+ * @memo every entry in blob is a value of vsize bytes, followed by the
+ *       reversed domain ending with '\0'. it has no pointers, so a table
+ *       written to a file can be searched in place after mmap()
+ */
+typedef struct
+{
+    char *blob;
+    size_t size;            // bytes used in blob
+    size_t cap;             // bytes allocated for blob, 0 if not owned
+    const uint32_t *index;  // offsets of entries, sorted by domain
+    size_t count;           // count of entries
+    size_t vsize;           // size of value
+} dtable_t;
+
+
+/*
+ * @def   DTABLE_VALUE, DTABLE_KEY
+ * @desc  value and reversed domain of entry at offset off
+ */
+#define DTABLE_VALUE(t, off) ((t)->blob + (off))
+#define DTABLE_KEY(t, off) ((t)->blob + (off) + (t)->vsize)
+
+
+/*
+ * @def   DTABLE_MAX_MATCH
+ * @desc  max count of matched suffixes of a name
+ */
+#define DTABLE_MAX_MATCH (NS_NAMESZ / 2)
+
+
+/*
+ * @func  dtable_init()
+ * @desc  initialize an empty table
+ * @param vsize - size of value of every entry
+ */
+extern void dtable_init(dtable_t *table, size_t vsize);
+
+
+/*
+ * @func  dtable_add()
+ * @desc  append a domain, before the table is built
+ * @param name  - domain name
+ *        value - value of vsize bytes
+ */
+extern int dtable_add(dtable_t *table, const char *name, const void *value);
+
+
+/*
+ * @func  dtable_add_key()
+ * @desc  append a reversed domain, like dtable_add()
+ */
+extern int dtable_add_key(dtable_t *table, const char *key, const void *value);
+
+
+/*
+ * @func  dtable_build()
+ * @desc  sort entries and remove duplicates, the first appended one of the
+ *        same domain is kept
+ * @memo  a table is built only once, it is read only afterwards
+ */
+extern int dtable_build(dtable_t *table);
+
+
+/*
+ * @func  dtable_match()
+ * @desc  find entries of all suffixes of name
+ * @param name  - domain name in lower case
+ *        match - offsets of matched entries, shorter suffix first, at most
+ *                DTABLE_MAX_MATCH
+ * @ret   count of matched entries
+ */
+extern int dtable_match(const dtable_t *table, const char *name, uint32_t *match);
+
+
+/*
+ * @func  dtable_free()
+ * @desc  free memory of table built by dtable_build()
+ */
+extern void dtable_free(dtable_t *table);
+
+
+#endif // DTABLE_H
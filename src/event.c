@@ -20,11 +20,25 @@
 #include <assert.h>
 #include <errno.h>
 #include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include <sys/time.h>
+#include <time.h>
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#if defined(HAVE_SYS_EPOLL_H) && defined(HAVE_EPOLL_CREATE1) && !defined(DISABLE_EPOLL)
+#  define USE_EPOLL
+#endif
 
 #ifdef __MINGW32__
 #  include "win.h"
+#elif defined(USE_EPOLL)
+#  include <sys/epoll.h>
+#  include <unistd.h>
 #else
 #  include <sys/select.h>
 #endif
@@ -37,48 +51,195 @@
  * @var  run
  * @desc should run
  */
-static volatile int run;
+static THREAD_LOCAL volatile int run;
+
+
+/*
+ * @type pending_t
+ * @desc triggered watcher waiting to be invoked
+ */
+typedef struct
+{
+    ev_io *w;       // NULL if watcher stopped before invoked
+} pending_t;
+
+
+/*
+ * @var  pendings
+ * @desc ready list collected by each poll, grows on demand
+ */
+static THREAD_LOCAL pending_t *pendings;
+static THREAD_LOCAL int pendings_cnt;
+static THREAD_LOCAL int pendings_size;
+
+
+/*
+ * @var  stat_polls, stat_events
+ * @desc count of poll calls and invoked watchers
+ */
+static THREAD_LOCAL unsigned long stat_polls;
+static THREAD_LOCAL unsigned long stat_events;
+
+
+/*
+ * @type fdinfo_t
+ * @desc watchers attached to a file descriptor
+ */
+typedef struct
+{
+    ev_io *head;    // active watchers on this fd
+    int events;     // events registered in backend
+} fdinfo_t;
+
+
+/*
+ * @var  fdtab
+ * @desc watchers indexed by file descriptor, grows on demand
+ */
+static THREAD_LOCAL fdinfo_t *fdtab;
+static THREAD_LOCAL int fdtab_size;
+
+
+/*
+ * @var  wcount, wlimit
+ * @desc count of active watchers, and upper limit (0 means unlimited)
+ */
+static THREAD_LOCAL int wcount;
+static THREAD_LOCAL int wlimit;
+
+
+#ifdef USE_EPOLL
+/*
+ * @var  epfd
+ * @desc epoll file descriptor
+ */
+static THREAD_LOCAL int epfd = -1;
+#else
+/*
+ * @var  rfds, wfds
+ * @desc fd sets passed to select(), maintained by ev_io_start()/ev_io_stop()
+ */
+static THREAD_LOCAL fd_set rfds, wfds;
+static THREAD_LOCAL int max_fd = -1;
+#endif
+
+
+/*
+ * @desc timer wheel
+ *       TW_LEVELS levels of TW_SLOTS slots, level n holds timers expire in
+ *       [TW_SLOTS^n, TW_SLOTS^(n+1)) ms, and is cascaded into lower levels
+ *       when level n-1 wraps around. timers expire beyond the top level
+ *       are parked in top level and re-cascaded until they come in range.
+ */
+#define TW_BITS 6
+#define TW_SLOTS (1 << TW_BITS)
+#define TW_MASK (TW_SLOTS - 1)
+#define TW_LEVELS 4
+#define TW_RANGE ((1ULL << (TW_BITS * TW_LEVELS)) - 1)
+static THREAD_LOCAL ev_timer *wheel[TW_LEVELS][TW_SLOTS];
+
+
+/*
+ * @var  wheel_now
+ * @desc time of next tick to process, in ms of monotonic clock
+ */
+static THREAD_LOCAL uint64_t wheel_now;
 
 
 /*
- * @var  changed
- * @desc is event listener changed since last select()
+ * @var  tcount
+ * @desc count of active timers
  */
-static volatile int changed;
+static THREAD_LOCAL int tcount;
 
 
 /*
-* @var  twcb
-* @desc timeout callback
-*/
-static void (*twcb)(void);
+ * @var  now
+ * @desc time of current loop iteration, in ms of monotonic clock
+ */
+static THREAD_LOCAL uint64_t now;
 
 
 /*
- * @var  wlist
- * @desc event watcher list
+ * @var  now_us
+ * @desc time of current loop iteration, in us of monotonic clock
  */
-#define WLIST_SIZE 128
-static ev_io *wlist[WLIST_SIZE];
+static THREAD_LOCAL ev_tstamp now_us;
 
 
 /*
- * @var  tv
- * @desc timestamp
+ * @var  prepares
+ * @desc active prepare watchers
  */
-static struct timeval tv;
+static THREAD_LOCAL ev_prepare *prepares;
+
+
+/*
+ * @func  ev_time()
+ * @desc  read monotonic clock
+ * @ret   time in us
+ */
+static ev_tstamp ev_time(void)
+{
+#if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC)
+    struct timespec ts;
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+    {
+        return (ev_tstamp)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+    }
+#endif
+    struct timeval t;
+    gettimeofday(&t, NULL);
+    return (ev_tstamp)t.tv_sec * 1000000 + t.tv_usec;
+}
+
+
+/*
+ * @func  ev_update()
+ * @desc  update time of current loop iteration
+ */
+static void ev_update(void)
+{
+    ev_tstamp t = ev_time();
+    // 没有单调时钟时，墙上时间可能回拨
+    if (t > now_us)
+    {
+        now_us = t;
+        now = t / 1000;
+    }
+}
+
+
+/*
+ * @func  ev_now()
+ * @desc  get time of current loop iteration
+ */
+ev_tstamp ev_now(void)
+{
+    return now_us;
+}
 
 
 /*
  * @func  ev_init()
  * @desc  initialize event loop
- * @param cb - timeout callback
  */
-int ev_init(void (*cb)(void))
+int ev_init(void)
 {
     run = 1;
-    twcb = cb;
-    gettimeofday(&tv, NULL);
+    ev_update();
+    wheel_now = now;
+#ifdef USE_EPOLL
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd < 0)
+    {
+        ERROR("epoll_create1");
+        return -1;
+    }
+#else
+    FD_ZERO(&rfds);
+    FD_ZERO(&wfds);
+#endif
     return 0;
 }
 
@@ -100,6 +261,107 @@ void ev_io_init(ev_io *w, void (*cb)(struct ev_io *w), int fd, int event)
     w->fd = fd;
     w->event = event;
     w->cb = cb;
+    w->active = 0;
+    w->pending = 0;
+    w->prev = NULL;
+    w->next = NULL;
+}
+
+
+/*
+ * @func  ev_set_limit()
+ * @desc  set max count of active io watchers
+ * @param max - max count, 0 means unlimited
+ */
+void ev_set_limit(int max)
+{
+    assert(max >= 0);
+    wlimit = max;
+}
+
+
+/*
+ * @func  fd_modify()
+ * @desc  update events of fd in backend
+ * @param fd     - file descriptor
+ *        events - events wait for
+ *        force  - register even if events not changed
+ */
+static void fd_modify(int fd, int events, int force)
+{
+    int old = fdtab[fd].events;
+
+    if ((old == events) && !force)
+    {
+        return;
+    }
+    fdtab[fd].events = events;
+
+#ifdef USE_EPOLL
+    struct epoll_event ev;
+    bzero(&ev, sizeof(ev));
+    ev.data.fd = fd;
+    ev.events = ((events & EV_READ) ? EPOLLIN : 0)
+                | ((events & EV_WRITE) ? EPOLLOUT : 0);
+    if (events == EV_NONE)
+    {
+        // fd may be closed already, ignore errors
+        epoll_ctl(epfd, EPOLL_CTL_DEL, fd, &ev);
+    }
+    else if (old == EV_NONE)
+    {
+        if ((epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) != 0)
+            && ((errno != EEXIST) || (epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev) != 0)))
+        {
+            ERROR("epoll_ctl");
+        }
+    }
+    else
+    {
+        // fd may be closed and reused since last registration
+        if ((epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev) != 0)
+            && ((errno != ENOENT) || (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) != 0)))
+        {
+            ERROR("epoll_ctl");
+        }
+    }
+#else
+    if (events & EV_READ)
+    {
+        FD_SET(fd, &rfds);
+    }
+    else
+    {
+        FD_CLR(fd, &rfds);
+    }
+    if (events & EV_WRITE)
+    {
+        FD_SET(fd, &wfds);
+    }
+    else
+    {
+        FD_CLR(fd, &wfds);
+    }
+    if (fd > max_fd)
+    {
+        max_fd = fd;
+    }
+#endif
+}
+
+
+/*
+ * @func  fd_events()
+ * @desc  events wanted by all watchers on fd
+ */
+static int fd_events(int fd)
+{
+    int events = EV_NONE;
+    for (ev_io *w = fdtab[fd].head; w != NULL; w = w->next)
+    {
+        events |= w->event;
+    }
+    return events;
 }
 
 
@@ -107,19 +369,55 @@ void ev_io_init(ev_io *w, void (*cb)(struct ev_io *w), int fd, int event)
  * @func  ev_io_start()
  * @desc  start io watcher
  * @param w - watcher
+ * @ret   0 - if succeed
+ *        -1 - if too many watchers, or out of memory
  */
-void ev_io_start(ev_io *w)
+int ev_io_start(ev_io *w)
 {
-    for (int i = 0; i < WLIST_SIZE; i++)
+    assert(!w->active);
+
+    if ((wlimit > 0) && (wcount >= wlimit))
     {
-        if (wlist[i] == NULL)
+        return -1;
+    }
+#if !defined(USE_EPOLL) && !defined(__MINGW32__)
+    if (w->fd >= FD_SETSIZE)
+    {
+        LOG("fd exceeds FD_SETSIZE");
+        return -1;
+    }
+#endif
+
+    if (w->fd >= fdtab_size)
+    {
+        int size = (fdtab_size == 0) ? 64 : fdtab_size;
+        while (size <= w->fd)
+        {
+            size *= 2;
+        }
+        fdinfo_t *p = (fdinfo_t *)realloc(fdtab, sizeof(fdinfo_t) * size);
+        if (p == NULL)
         {
-            wlist[i] = w;
-            changed = 1;
-            return;
+            LOG("out of memory");
+            return -1;
         }
+        bzero(p + fdtab_size, sizeof(fdinfo_t) * (size - fdtab_size));
+        fdtab = p;
+        fdtab_size = size;
+    }
+
+    fdinfo_t *fdi = &(fdtab[w->fd]);
+    w->prev = NULL;
+    w->next = fdi->head;
+    if (fdi->head != NULL)
+    {
+        fdi->head->prev = w;
     }
-    assert("wlist full" == NULL);
+    fdi->head = w;
+    w->active = 1;
+    wcount++;
+    fd_modify(w->fd, fdi->events | w->event, 1);
+    return 0;
 }
 
 
@@ -130,111 +428,506 @@ void ev_io_start(ev_io *w)
  */
 void ev_io_stop(ev_io *w)
 {
-    for (int i = 0; i < WLIST_SIZE; i++)
+    if (!w->active)
+    {
+        assert("bad watcher" == NULL);
+        return;
+    }
+
+    fdinfo_t *fdi = &(fdtab[w->fd]);
+    if (w->prev != NULL)
+    {
+        w->prev->next = w->next;
+    }
+    else
+    {
+        fdi->head = w->next;
+    }
+    if (w->next != NULL)
+    {
+        w->next->prev = w->prev;
+    }
+    w->prev = NULL;
+    w->next = NULL;
+    w->active = 0;
+    wcount--;
+    if (w->pending)
+    {
+        // stopped by previous callback in the same iteration
+        pendings[w->pending - 1].w = NULL;
+        w->pending = 0;
+    }
+    fd_modify(w->fd, fd_events(w->fd), 0);
+}
+
+
+/*
+ * @func  timer_link()
+ * @desc  insert timer into timer wheel
+ */
+static void timer_link(ev_timer *w)
+{
+    uint64_t expire = (w->expire < wheel_now) ? wheel_now : w->expire;
+    uint64_t idx = expire - wheel_now;
+    ev_timer **slot;
+
+    if (idx < TW_SLOTS)
     {
-        if (wlist[i] == w)
+        slot = &(wheel[0][expire & TW_MASK]);
+    }
+    else
+    {
+        if (idx > TW_RANGE)
         {
-            wlist[i] = NULL;
-            changed = 1;
-            return;
+            // park in top level
+            expire = wheel_now + TW_RANGE;
+            idx = TW_RANGE;
         }
+        int level = 1;
+        while (idx >= (1ULL << (TW_BITS * (level + 1))))
+        {
+            level++;
+        }
+        slot = &(wheel[level][(expire >> (TW_BITS * level)) & TW_MASK]);
+    }
+
+    w->slot = slot;
+    w->prev = NULL;
+    w->next = *slot;
+    if (*slot != NULL)
+    {
+        (*slot)->prev = w;
+    }
+    *slot = w;
+}
+
+
+/*
+ * @func  timer_unlink()
+ * @desc  remove timer from timer wheel
+ */
+static void timer_unlink(ev_timer *w)
+{
+    if (w->prev != NULL)
+    {
+        w->prev->next = w->next;
+    }
+    else
+    {
+        *(w->slot) = w->next;
+    }
+    if (w->next != NULL)
+    {
+        w->next->prev = w->prev;
+    }
+    w->prev = NULL;
+    w->next = NULL;
+    w->slot = NULL;
+}
+
+
+/*
+ * @func  ev_timer_init()
+ * @desc  initialize timer
+ * @param w       - timer
+ *        cb      - callback
+ *        timeout - timeout in ms
+ *        repeat  - repeat interval in ms, 0 means one-shot
+ */
+void ev_timer_init(ev_timer *w, void (*cb)(struct ev_timer *w),
+                   unsigned int timeout, unsigned int repeat)
+{
+    assert(cb != NULL);
+
+    w->expire = 0;
+    w->timeout = timeout;
+    w->repeat = repeat;
+    w->cb = cb;
+    w->active = 0;
+    w->slot = NULL;
+    w->prev = NULL;
+    w->next = NULL;
+}
+
+
+/*
+ * @func  ev_timer_start()
+ * @desc  start timer, it expires timeout ms after current loop time
+ * @param w - timer
+ */
+void ev_timer_start(ev_timer *w)
+{
+    assert(!w->active);
+
+    w->expire = now + w->timeout;
+    w->active = 1;
+    tcount++;
+    timer_link(w);
+}
+
+
+/*
+ * @func  ev_timer_stop()
+ * @desc  stop timer, do nothing if timer is not active
+ * @param w - timer
+ */
+void ev_timer_stop(ev_timer *w)
+{
+    if (w->active)
+    {
+        timer_unlink(w);
+        w->active = 0;
+        tcount--;
+    }
+}
+
+
+/*
+ * @func  ev_timer_reset()
+ * @desc  restart timer, it expires timeout ms after current loop time
+ * @param w - timer
+ */
+void ev_timer_reset(ev_timer *w)
+{
+    ev_timer_stop(w);
+    ev_timer_start(w);
+}
+
+
+/*
+ * @func  timer_cascade()
+ * @desc  move timers in a slot of upper level into lower levels
+ * @ret   index of the slot
+ */
+static int timer_cascade(int level)
+{
+    int idx = (int)((wheel_now >> (TW_BITS * level)) & TW_MASK);
+    ev_timer *w = wheel[level][idx];
+    wheel[level][idx] = NULL;
+    while (w != NULL)
+    {
+        ev_timer *next = w->next;
+        timer_link(w);
+        w = next;
     }
-    assert("bad watcher" == NULL);
+    return idx;
 }
 
 
 /*
- * @func ev_poll()
- * @desc wait for events
- * @ret  count of triggered events
+ * @func  ev_timer_run()
+ * @desc  invoke expired timers
+ * @ret   count of invoked timers
  */
-static int ev_poll(void)
+static int ev_timer_run(void)
 {
-    fd_set rfds, wfds;
     int ev_cnt = 0;
-    int max_fd = -1;
 
-    FD_ZERO(&rfds);
-    FD_ZERO(&wfds);
+    if (tcount == 0)
+    {
+        wheel_now = now + 1;
+        return 0;
+    }
 
-    for (int i = 0; i < WLIST_SIZE; i++)
+    while (wheel_now <= now)
     {
-        if (wlist[i] != NULL)
+        int idx = (int)(wheel_now & TW_MASK);
+        if (idx == 0)
         {
-            if (wlist[i]->fd > max_fd)
+            for (int level = 1; (level < TW_LEVELS) && (timer_cascade(level) == 0); level++)
             {
-                max_fd = wlist[i]->fd;
             }
-            if (wlist[i]->event == EV_READ)
+        }
+
+        // detach the slot, timers started by callbacks go to later slots
+        ev_timer *expired = wheel[0][idx];
+        wheel[0][idx] = NULL;
+        for (ev_timer *w = expired; w != NULL; w = w->next)
+        {
+            w->slot = &expired;
+        }
+        wheel_now++;
+
+        while (expired != NULL)
+        {
+            ev_timer *w = expired;
+            timer_unlink(w);
+            w->active = 0;
+            tcount--;
+            if (w->repeat > 0)
             {
-                FD_SET(wlist[i]->fd, &rfds);
+                w->expire = now + w->repeat;
+                w->active = 1;
+                tcount++;
+                timer_link(w);
             }
-            else if (wlist[i]->event == EV_WRITE)
+            (w->cb)(w);
+            ev_cnt++;
+        }
+    }
+    return ev_cnt;
+}
+
+
+/*
+ * @func  ev_timeout()
+ * @desc  time to wait in poll
+ * @ret   timeout in ms
+ */
+static int ev_timeout(void)
+{
+    if (tcount == 0)
+    {
+        return 100;
+    }
+    uint64_t t = wheel_now;
+    // stop at next cascade, timers in upper levels may come to level 0
+    while ((wheel[0][t & TW_MASK] == NULL) && ((t & TW_MASK) != 0))
+    {
+        t++;
+    }
+    if (t <= now)
+    {
+        return 0;
+    }
+    return (t - now > 100) ? 100 : (int)(t - now);
+}
+
+
+/*
+ * @func  fd_feed()
+ * @desc  append watchers on fd to ready list
+ * @param fd      - file descriptor
+ *        revents - triggered events
+ */
+static void fd_feed(int fd, int revents)
+{
+    for (ev_io *w = fdtab[fd].head; w != NULL; w = w->next)
+    {
+        if (!(w->event & revents))
+        {
+            continue;
+        }
+        if (pendings_cnt == pendings_size)
+        {
+            int size = (pendings_size == 0) ? 64 : pendings_size * 2;
+            pending_t *p = (pending_t *)realloc(pendings, sizeof(pending_t) * size);
+            if (p == NULL)
             {
-                FD_SET(wlist[i]->fd, &wfds);
+                // leave it to next poll
+                LOG("out of memory");
+                return;
             }
+            pendings = p;
+            pendings_size = size;
         }
+        pendings[pendings_cnt].w = w;
+        pendings_cnt++;
+        w->pending = pendings_cnt;
     }
-    struct timeval timeout;
-    timeout.tv_sec = 0;
-    timeout.tv_usec = 100000;
-    int r = select(max_fd + 1, &rfds, &wfds, NULL, &timeout);
+}
+
+
+/*
+ * @func  ev_invoke_pending()
+ * @desc  invoke every watcher in ready list
+ * @memo  callbacks may start or stop any watcher, stopped watchers are
+ *        removed from ready list, started watchers wait for next poll
+ * @ret   count of invoked watchers
+ */
+static int ev_invoke_pending(void)
+{
+    int ev_cnt = 0;
+    for (int i = 0; i < pendings_cnt; i++)
+    {
+        ev_io *w = pendings[i].w;
+        if (w != NULL)
+        {
+            w->pending = 0;
+            (w->cb)(w);
+            ev_cnt++;
+        }
+    }
+    pendings_cnt = 0;
+    return ev_cnt;
+}
+
+
+/*
+ * @func  ev_poll()
+ * @desc  wait for events
+ * @param timeout - timeout in ms
+ * @ret   count of triggered events
+ */
+static int ev_poll(int timeout)
+{
+#ifdef USE_EPOLL
+    struct epoll_event evs[256];
+    int r = epoll_wait(epfd, evs, 256, timeout);
+    ev_update();
+    if (r < 0)
+    {
+        if (errno != EINTR)
+        {
+            ERROR("epoll_wait");
+        }
+        return 0;
+    }
+    for (int i = 0; i < r; i++)
+    {
+        int revents = EV_NONE;
+        if (evs[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+        {
+            revents |= EV_READ;
+        }
+        if (evs[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP))
+        {
+            revents |= EV_WRITE;
+        }
+        fd_feed(evs[i].data.fd, revents);
+    }
+#else
+    fd_set r_fds, w_fds;
+    memcpy(&r_fds, &rfds, sizeof(fd_set));
+    memcpy(&w_fds, &wfds, sizeof(fd_set));
+
+    struct timeval tv;
+    tv.tv_sec = timeout / 1000;
+    tv.tv_usec = (timeout % 1000) * 1000;
+    int r = select(max_fd + 1, &r_fds, &w_fds, NULL, &tv);
+    ev_update();
     if (r < 0)
     {
         if (errno != EINTR)
         {
             ERROR("select");
         }
+        return 0;
     }
-    else if (r > 0)
+    for (int fd = 0; (fd <= max_fd) && (r > 0); fd++)
     {
-        changed = 0;
-        for (int i = 0; i < WLIST_SIZE; i++)
+        int revents = EV_NONE;
+        if (FD_ISSET(fd, &r_fds))
         {
-            if ((wlist[i] != NULL) && (wlist[i]->event == EV_READ) && FD_ISSET(wlist[i]->fd, &rfds))
-            {
-                (wlist[i]->cb)(wlist[i]);
-                ev_cnt++;
-                if (changed)
-                {
-                    return ev_cnt;
-                }
-            }
-            if ((wlist[i] != NULL) && (wlist[i]->event == EV_WRITE) && FD_ISSET(wlist[i]->fd, &wfds))
-            {
-                (wlist[i]->cb)(wlist[i]);
-                ev_cnt++;
-                if (changed)
-                {
-                    return ev_cnt;
-                }
-            }
+            revents |= EV_READ;
+            r--;
+        }
+        if (FD_ISSET(fd, &w_fds))
+        {
+            revents |= EV_WRITE;
+            r--;
+        }
+        if (revents != EV_NONE)
+        {
+            fd_feed(fd, revents);
         }
     }
+#endif
+
+    int ev_cnt = ev_invoke_pending();
+    stat_polls++;
+    stat_events += ev_cnt;
     return ev_cnt;
 }
 
 
+/*
+ * @func  ev_prepare_init()
+ * @desc  initialize prepare watcher
+ * @param w  - watcher
+ *        cb - callback
+ */
+void ev_prepare_init(ev_prepare *w, void (*cb)(struct ev_prepare *w))
+{
+    w->cb = cb;
+    w->active = 0;
+    w->prev = NULL;
+    w->next = NULL;
+}
+
+
+/*
+ * @func  ev_prepare_start()
+ * @desc  start prepare watcher
+ * @param w - watcher
+ */
+void ev_prepare_start(ev_prepare *w)
+{
+    assert(!w->active);
+
+    w->active = 1;
+    w->prev = NULL;
+    w->next = prepares;
+    if (prepares != NULL)
+    {
+        prepares->prev = w;
+    }
+    prepares = w;
+}
+
+
+/*
+ * @func  ev_prepare_stop()
+ * @desc  stop prepare watcher, do nothing if watcher is not active
+ * @param w - watcher
+ */
+void ev_prepare_stop(ev_prepare *w)
+{
+    if (!w->active)
+    {
+        return;
+    }
+    if (w->prev != NULL)
+    {
+        w->prev->next = w->next;
+    }
+    else
+    {
+        prepares = w->next;
+    }
+    if (w->next != NULL)
+    {
+        w->next->prev = w->prev;
+    }
+    w->active = 0;
+}
+
+
 /*
  * @func ev_run()
  * @desc start event loop
  */
 void ev_run(void)
 {
+    run = 1;
     while (run)
     {
-        ev_poll();
-        struct timeval t;
-        gettimeofday(&t, NULL);
-        if ((1000000 * (t.tv_sec - tv.tv_sec) + t.tv_usec - tv.tv_usec) > 1000000)
+        for (ev_prepare *w = prepares; w != NULL; )
         {
-            tv = t;
-            (twcb)();
+            // 回调中可能停止 w
+            ev_prepare *next = w->next;
+            (w->cb)(w);
+            w = next;
         }
+        ev_poll(ev_timeout());
+        stat_events += ev_timer_run();
     }
 }
 
 
+/*
+ * @func  ev_stat()
+ * @desc  get statistics of event loop
+ * @param poll_cnt  - count of poll calls
+ *        event_cnt - count of invoked watchers
+ */
+void ev_stat(unsigned long *poll_cnt, unsigned long *event_cnt)
+{
+    *poll_cnt = stat_polls;
+    *event_cnt = stat_events;
+}
+
+
 /*
  * @func ev_stop()
  * @desc stop event loop
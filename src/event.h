@@ -20,6 +20,16 @@
 #ifndef EVENT_H
 #define EVENT_H
 
+#include <stdint.h>
+
+
+/*
+ * @desc storage class of event loop state, every thread runs its own loop
+ */
+#ifndef THREAD_LOCAL
+#  define THREAD_LOCAL __thread
+#endif
+
 
 /*
  * @const
@@ -43,17 +53,75 @@ typedef struct ev_io
     int event;
     void (*cb)(struct ev_io *w);
     void *data;
+    int active;
+    int pending;
+    struct ev_io *prev;
+    struct ev_io *next;
 } ev_io;
 
 
+/*
+ * @func ev_is_active()
+ * @desc is watcher or timer started
+ */
+#define ev_is_active(w) ((w)->active)
+
+
+/*
+ * @type ev_timer
+ * @desc timer watcher
+ */
+typedef struct ev_timer
+{
+    uint64_t expire;
+    unsigned int timeout;
+    unsigned int repeat;
+    void (*cb)(struct ev_timer *w);
+    void *data;
+    int active;
+    struct ev_timer **slot;
+    struct ev_timer *prev;
+    struct ev_timer *next;
+} ev_timer;
+
+
+/*
+ * @type ev_tstamp
+ * @desc timestamp, in us of monotonic clock
+ */
+typedef uint64_t ev_tstamp;
+
+
 /*
  * @func  ev_init()
  * @desc  initialize event loop
- * @param cb - timeout callback
  * @ret   0 - if succeed
  *        !0 - if failed
  */
-extern int ev_init(void (*cb)(void));
+extern int ev_init(void);
+
+
+/*
+ * @type ev_prepare
+ * @desc prepare watcher, invoked every loop iteration before polling
+ */
+typedef struct ev_prepare
+{
+    void (*cb)(struct ev_prepare *w);
+    void *data;
+    int active;
+    struct ev_prepare *prev;
+    struct ev_prepare *next;
+} ev_prepare;
+
+
+/*
+ * @func  ev_now()
+ * @desc  get time of current loop iteration
+ * @memo  updated once per poll, not affected by changes of wall clock
+ * @ret   timestamp in us
+ */
+extern ev_tstamp ev_now(void);
 
 
 /*
@@ -67,12 +135,22 @@ extern int ev_init(void (*cb)(void));
 extern void ev_io_init(ev_io *w, void (*cb)(struct ev_io *w), int fd, int event);
 
 
+/*
+ * @func  ev_set_limit()
+ * @desc  set max count of active io watchers
+ * @param max - max count, 0 means unlimited
+ */
+extern void ev_set_limit(int max);
+
+
 /*
  * @func  ev_io_start()
  * @desc  start io watcher
  * @param w - watcher
+ * @ret   0 - if succeed
+ *        -1 - if too many watchers, or out of memory
  */
-extern void ev_io_start(ev_io *w);
+extern int ev_io_start(ev_io *w);
 
 
 /*
@@ -83,6 +161,67 @@ extern void ev_io_start(ev_io *w);
 extern void ev_io_stop(ev_io *w);
 
 
+/*
+ * @func  ev_timer_init()
+ * @desc  initialize timer
+ * @param w       - timer
+ *        cb      - callback
+ *        timeout - timeout in ms
+ *        repeat  - repeat interval in ms, 0 means one-shot
+ */
+extern void ev_timer_init(ev_timer *w, void (*cb)(struct ev_timer *w),
+                          unsigned int timeout, unsigned int repeat);
+
+
+/*
+ * @func  ev_timer_start()
+ * @desc  start timer, it expires timeout ms after current loop time
+ * @param w - timer
+ */
+extern void ev_timer_start(ev_timer *w);
+
+
+/*
+ * @func  ev_timer_stop()
+ * @desc  stop timer, do nothing if timer is not active
+ * @param w - timer
+ */
+extern void ev_timer_stop(ev_timer *w);
+
+
+/*
+ * @func  ev_timer_reset()
+ * @desc  restart timer, it expires timeout ms after current loop time
+ * @param w - timer
+ */
+extern void ev_timer_reset(ev_timer *w);
+
+
+/*
+ * @func  ev_prepare_init()
+ * @desc  initialize prepare watcher
+ * @param w  - watcher
+ *        cb - callback
+ */
+extern void ev_prepare_init(ev_prepare *w, void (*cb)(struct ev_prepare *w));
+
+
+/*
+ * @func  ev_prepare_start()
+ * @desc  start prepare watcher
+ * @param w - watcher
+ */
+extern void ev_prepare_start(ev_prepare *w);
+
+
+/*
+ * @func  ev_prepare_stop()
+ * @desc  stop prepare watcher, do nothing if watcher is not active
+ * @param w - watcher
+ */
+extern void ev_prepare_stop(ev_prepare *w);
+
+
 /*
  * @func ev_run()
  * @desc start event loop
@@ -90,6 +229,15 @@ extern void ev_io_stop(ev_io *w);
 extern void ev_run(void);
 
 
+/*
+ * @func  ev_stat()
+ * @desc  get statistics of event loop
+ * @param poll_cnt  - count of poll calls
+ *        event_cnt - count of invoked watchers
+ */
+extern void ev_stat(unsigned long *poll_cnt, unsigned long *event_cnt);
+
+
 /*
  * @func ev_stop()
  * @desc stop event loop
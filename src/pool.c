@@ -0,0 +1,99 @@
+/*
+ * pool.c - fixed-size object pool
+ *
+ * Copyright (C) 2014 - 2015, Xiaoxiao <i@xiaoxiao.im>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "log.h"
+#include "pool.h"
+
+
+/*
+ * @desc size of each slab, in bytes
+ */
+#define SLAB_SIZE 65536
+
+
+/*
+ * @desc alignment of objects
+ */
+#define POOL_ALIGN 16
+
+
+/*
+ * @func  pool_grow()
+ * @desc  carve a new slab into free objects
+ */
+static int pool_grow(pool_t *pool)
+{
+    size_t size = (pool->size + POOL_ALIGN - 1) & ~(size_t)(POOL_ALIGN - 1);
+    size_t count = SLAB_SIZE / size;
+    if (count < 8)
+    {
+        count = 8;
+    }
+
+    uint8_t *slab = (uint8_t *)malloc(size * count);
+    if (slab == NULL)
+    {
+        LOG("out of memory");
+        return -1;
+    }
+    pool->slabs++;
+
+    // 按地址顺序串起来
+    for (size_t i = count; i > 0; i--)
+    {
+        void **obj = (void **)(slab + size * (i - 1));
+        *obj = pool->free;
+        pool->free = obj;
+    }
+    return 0;
+}
+
+
+/*
+ * @func  pool_alloc()
+ * @desc  get an object from pool
+ */
+void *pool_alloc(pool_t *pool)
+{
+    if ((pool->free == NULL) && (pool_grow(pool) != 0))
+    {
+        return NULL;
+    }
+    void **obj = (void **)pool->free;
+    pool->free = *obj;
+    pool->allocs++;
+    return obj;
+}
+
+
+/*
+ * @func  pool_free()
+ * @desc  put an object back to pool
+ */
+void pool_free(pool_t *pool, void *ptr)
+{
+    if (ptr != NULL)
+    {
+        *(void **)ptr = pool->free;
+        pool->free = ptr;
+    }
+}
@@ -0,0 +1,65 @@
+/*
+ * pool.h - fixed-size object pool
+ *
+ * Copyright (C) 2014 - 2015, Xiaoxiao <i@xiaoxiao.im>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef POOL_H
+#define POOL_H
+
+#include <stddef.h>
+
+
+/*
+ * @type pool_t
+ * @desc pool of objects of the same size, objects are carved from slabs
+ *       and kept on a free list, slabs are never returned to malloc
+ * @memo a pool is not thread safe, declare it THREAD_LOCAL
+ */
+typedef struct
+{
+    size_t size;
+    void *free;
+    unsigned long slabs;
+    unsigned long allocs;
+} pool_t;
+
+
+/*
+ * @func POOL_INIT()
+ * @desc static initializer of pool
+ * @param size - size of each object
+ */
+#define POOL_INIT(size) { (size), NULL, 0, 0 }
+
+
+/*
+ * @func  pool_alloc()
+ * @desc  get an object from pool
+ * @ret   pointer to object, or NULL if out of memory
+ */
+extern void *pool_alloc(pool_t *pool);
+
+
+/*
+ * @func  pool_free()
+ * @desc  put an object back to pool
+ * @param ptr - object got from pool_alloc(), or NULL
+ */
+extern void pool_free(pool_t *pool, void *ptr);
+
+
+#endif // POOL_H
@@ -17,18 +17,266 @@
  * along with this program. If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <assert.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef __MINGW32__
+#  include "win.h"
+#endif
+
+#include "async_connect.h"
 #include "dns.h"
+#include "event.h"
+#include "log.h"
+#include "pool.h"
 #include "query.h"
 #include "utils.h"
 
 
 /*
- * @var  qlist
- * @desc query list
+ * @var  qtable
+ * @desc in-flight queries, indexed by upstream ID
+ */
+#define QTABLE_SIZE 65536
+static THREAD_LOCAL query_t * qtable[QTABLE_SIZE];
+
+
+/*
+ * @var  qpool
+ * @desc pools of query_t, by size of name and question name
+ */
+#define QPOOL_COUNT 3
+static THREAD_LOCAL pool_t qpool[QPOOL_COUNT] =
+{
+    POOL_INIT(sizeof(query_t) + 64),
+    POOL_INIT(sizeof(query_t) + 128),
+    POOL_INIT(sizeof(query_t) + QUERY_NAMESZ * 2)
+};
+
+
+/*
+ * @desc role of query in coalescing
+ */
+enum
+{
+    ROLE_NONE = 0,
+    ROLE_LEADER,
+    ROLE_WAITER
+};
+
+
+/*
+ * @var  qindex
+ * @desc in-flight queries which others are coalesced into, indexed by
+ *       hash of name and type
+ */
+#define QINDEX_SIZE 4096
+static THREAD_LOCAL query_t * qindex[QINDEX_SIZE];
+
+
+/*
+ * @var  qcount
+ * @desc count of in-flight queries
+ */
+static THREAD_LOCAL int qcount;
+
+
+/*
+ * @var  freeids
+ * @desc unused upstream IDs, in no particular order
+ */
+static THREAD_LOCAL uint16_t freeids[QTABLE_SIZE - 1];
+static THREAD_LOCAL int nfree = -1;
+
+
+/*
+ * @var  qlimit
+ * @desc max count of in-flight queries, ID 0 is not used
+ */
+static THREAD_LOCAL int qlimit = QTABLE_SIZE - 1;
+
+
+/*
+ * @var  overloads
+ * @desc count of queries rejected on overload
+ */
+static THREAD_LOCAL unsigned long overloads;
+
+
+/*
+ * @var  overload_logged
+ * @desc time of last overload warning, to log at most every 10s
+ */
+static THREAD_LOCAL ev_tstamp overload_logged;
+
+
+/*
+ * @var  timeout_hook
+ * @desc callback of query timeout
  */
-#define QLIST_SIZE 128
-static query_t * qlist[QLIST_SIZE];
+static THREAD_LOCAL void (*timeout_hook)(query_t *query);
+
+
+static void timeout_cb(ev_timer *w);
+
+
+/*
+ * @func  query_init()
+ * @desc  initialize query list
+ * @param cb - called when query->timer expires, instead of deleting the query
+ */
+void query_init(void (*cb)(query_t *query))
+{
+    timeout_hook = cb;
+}
+
+
+/*
+ * @func  query_set_limit()
+ * @desc  set max count of in-flight queries
+ */
+void query_set_limit(int max)
+{
+    assert((max > 0) && (max < QTABLE_SIZE));
+    qlimit = max;
+}
+
+
+/*
+ * @func  query_stat()
+ * @desc  get statistics of query list
+ */
+void query_stat(int *inflight, unsigned long *overload_cnt)
+{
+    if (inflight != NULL)
+    {
+        *inflight = qcount;
+    }
+    if (overload_cnt != NULL)
+    {
+        *overload_cnt = overloads;
+    }
+}
+
+
+/*
+ * @func  query_new()
+ * @desc  allocate DNS query
+ */
+query_t *query_new(const char *name, const void *qname)
+{
+    size_t len = strlen(name) + 1;
+    if (len > QUERY_NAMESZ)
+    {
+        LOG("name too long");
+        return NULL;
+    }
+
+    // 问题中的域名，未压缩且不超过 QUERY_NAMESZ 才保存
+    size_t qlen = 0;
+    if (qname != NULL)
+    {
+        const uint8_t *p = (const uint8_t *)qname;
+        while ((qlen < QUERY_NAMESZ) && (p[qlen] != 0) && ((p[qlen] & 0xc0) == 0))
+        {
+            qlen += p[qlen] + 1;
+        }
+        qlen = ((qlen < QUERY_NAMESZ) && (p[qlen] == 0)) ? qlen + 1 : 0;
+    }
+
+    // 按域名长度选择 pool
+    size_t tail = len + qlen;
+    int size = (tail <= 64) ? 0 : ((tail <= 128) ? 1 : 2);
+    query_t *query = (query_t *)pool_alloc(&qpool[size]);
+    if (query != NULL)
+    {
+        query->size = (uint8_t)size;
+        query->role = ROLE_NONE;
+        query->qcase = (qlen > 0);
+        memcpy(query->name, name, len);
+        if (qlen > 0)
+        {
+            memcpy(query->name + len, qname, qlen);
+        }
+    }
+    return query;
+}
+
+
+/*
+ * @func  query_qname()
+ * @desc  get question name of client kept by query_new()
+ */
+const uint8_t *query_qname(const query_t *query)
+{
+    if (!query->qcase)
+    {
+        return NULL;
+    }
+    return (const uint8_t *)query->name + strlen(query->name) + 1;
+}
+
+
+/*
+ * @func  query_free()
+ * @desc  free DNS query not added by query_add()
+ */
+void query_free(query_t *query)
+{
+    if (query->role == ROLE_WAITER)
+    {
+        qcount--;
+    }
+    pool_free(&qpool[query->size], query);
+}
+
+
+/*
+ * @func  id_alloc()
+ * @desc  pick a random unused upstream ID in O(1)
+ * @memo  caller makes sure there is an unused ID
+ */
+static uint16_t id_alloc(void)
+{
+    if (nfree < 0)
+    {
+        // ID 0 不使用
+        for (int i = 0; i < QTABLE_SIZE - 1; i++)
+        {
+            freeids[i] = (uint16_t)(i + 1);
+        }
+        nfree = QTABLE_SIZE - 1;
+    }
+    assert(nfree > 0);
+
+    // 随机取一个，用最后一个填补空位
+    int i = (int)rand_uniform((uint32_t)nfree);
+    uint16_t id = freeids[i];
+    freeids[i] = freeids[--nfree];
+    return id;
+}
+
+
+/*
+ * @func  id_free()
+ * @desc  recycle upstream ID
+ */
+static void id_free(uint16_t id)
+{
+    freeids[nfree++] = id;
+}
+
+
+/*
+ * @func  qhash()
+ * @desc  keyed hash of name and type
+ */
+static unsigned int qhash(const char *name, int type)
+{
+    return (unsigned int)hash_name(name, (uint32_t)type) & (QINDEX_SIZE - 1);
+}
 
 
 /*
@@ -37,16 +285,80 @@ static query_t * qlist[QLIST_SIZE];
  */
 int query_add(query_t *query)
 {
-    query->ttl = 10;
+    if (qcount >= qlimit)
+    {
+        overloads++;
+        if ((overload_logged == 0) || (ev_now() - overload_logged >= 10000000))
+        {
+            overload_logged = ev_now();
+            LOG("too many queries in flight, answering SERVFAIL");
+        }
+        return -1;
+    }
     query->qid = query->id;
-    for (int i = 0; i < QLIST_SIZE; i++)
+    query->id = id_alloc();
+    query->stage = 0;
+    query->retries = 0;
+    query->role = ROLE_NONE;
+    query->conn = NULL;
+    query->waiters = NULL;
+    query->next = NULL;
+    qtable[query->id] = query;
+    qcount++;
+    ev_timer_init(&(query->timer), timeout_cb, QUERY_TIMEOUT, 0);
+    query->timer.data = (void *)query;
+    ev_timer_start(&(query->timer));
+    return 0;
+}
+
+
+/*
+ * @func  query_newid()
+ * @desc  move DNS query to a new upstream ID
+ */
+void query_newid(query_t *query)
+{
+    assert(qtable[query->id] == query);
+
+    if (nfree == 0)
     {
-        if (qlist[i] == NULL)
+        return;
+    }
+    uint16_t id = id_alloc();
+    qtable[query->id] = NULL;
+    id_free(query->id);
+    qtable[id] = query;
+    query->id = id;
+}
+
+
+/*
+ * @func  query_coalesce()
+ * @desc  attach query to an in-flight query with the same name and type
+ */
+int query_coalesce(query_t *query)
+{
+    assert(qtable[query->id] == query);
+
+    unsigned int h = qhash(query->name, query->type);
+    for (query_t *leader = qindex[h]; leader != NULL; leader = leader->next)
+    {
+        if ((leader->type == query->type) && (strcmp(leader->name, query->name) == 0))
         {
-            qlist[i] = query;
+            // 不再单独超时，也不占用 ID
+            ev_timer_stop(&(query->timer));
+            qtable[query->id] = NULL;
+            id_free(query->id);
+            query->id = 0;
+            query->role = ROLE_WAITER;
+            query->next = leader->waiters;
+            leader->waiters = query;
             return 0;
         }
     }
+    query->role = ROLE_LEADER;
+    query->next = qindex[h];
+    qindex[h] = query;
     return -1;
 }
 
@@ -58,14 +370,7 @@ int query_add(query_t *query)
  */
 query_t *query_search(uint16_t id)
 {
-    for (int i = 0; i < QLIST_SIZE; i++)
-    {
-        if ((qlist[i] != NULL) && (qlist[i]->id == id))
-        {
-            return qlist[i];
-        }
-    }
-    return NULL;
+    return qtable[id];
 }
 
 
@@ -76,35 +381,60 @@ query_t *query_search(uint16_t id)
  */
 int query_delete(uint16_t id)
 {
-    for (int i = 0; i < QLIST_SIZE; i++)
+    query_t *query = qtable[id];
+    if (query == NULL)
     {
-        if ((qlist[i] != NULL) && (qlist[i]->id == id))
+        return -1;
+    }
+    if (query->role == ROLE_LEADER)
+    {
+        query_t **p = &(qindex[qhash(query->name, query->type)]);
+        while (*p != query)
         {
-            free(qlist[i]);
-            qlist[i] = NULL;
-            return 0;
+            p = &((*p)->next);
         }
+        *p = query->next;
     }
-    return -1;
+    while (query->waiters != NULL)
+    {
+        // 未被回复的 waiter
+        query_t *waiter = query->waiters;
+        query->waiters = waiter->next;
+        if (waiter->protocol == ns_tcp)
+        {
+            close(waiter->sock);
+        }
+        query_free(waiter);
+    }
+    if (query->conn != NULL)
+    {
+        // 否则连接的回调会找到复用这个 ID 的其他 query
+        async_connect_cancel(query->conn);
+    }
+    ev_timer_stop(&(query->timer));
+    pool_free(&qpool[query->size], query);
+    qtable[id] = NULL;
+    id_free(id);
+    qcount--;
+    return 0;
 }
 
 
 /*
- * @func query_tick()
- * @desc delete old queries periodically
+ * @func timeout_cb()
+ * @desc delete query not replied in time
  */
-void query_tick(void)
+static void timeout_cb(ev_timer *w)
 {
-    for (int i = 0; i < QLIST_SIZE; i++)
+    query_t *query = (query_t *)(w->data);
+    if (timeout_hook != NULL)
     {
-        if (qlist[i] != NULL)
-        {
-            qlist[i]->ttl--;
-            if (qlist[i]->ttl == 0)
-            {
-                free(qlist[i]);
-                qlist[i] = NULL;
-            }
-        }
+        timeout_hook(query);
+        return;
+    }
+    if (query->protocol == ns_tcp)
+    {
+        close(query->sock);
     }
+    query_delete(query->id);
 }
@@ -25,38 +25,145 @@
 #ifdef __MINGW32__
 #  include "win.h"
 #else
+#  include <netinet/in.h>
 #  include <sys/socket.h>
 #endif
 
 
 #include "dns.h"
+#include "event.h"
+
+
+/*
+ * @desc timeout of DNS query, in ms
+ */
+#define QUERY_TIMEOUT 10000
+
+
+/*
+ * @desc max size of domain name in query_t, including '\0'
+ */
+#define QUERY_NAMESZ 256
 
 
 /*
  * @type query_t
  * @desc DNS query
+ * @memo name is stored in a variable-length tail, allocate with query_new()
+ *       name is in lower case, if client's question name has upper case
+ *       letters, it is kept after name in wire format, see query_qname()
  */
-typedef struct
+typedef struct query_t
 {
     uint16_t id;
     uint16_t qid;
-    int ttl;
+    uint8_t stage;
+    uint8_t retries;
+    uint8_t protocol;
+    uint8_t size;           // size class of pool, used by query.c
+    uint8_t role;           // leader or waiter of coalesced queries, used by query.c
+    uint8_t qcase;          // client's question name is kept after name
+    int type;
     int sock;
-    int protocol;
-    struct sockaddr_storage addr;
     socklen_t addrlen;
-    int type;
-    char name[NS_NAMESZ];
+    union
+    {
+        struct sockaddr sa;
+        struct sockaddr_in sin;
+        struct sockaddr_in6 sin6;
+    } addr;
+    ev_timer timer;
+    void *conn;                 // pending async_connect(), cancelled by query_delete()
+    struct query_t *waiters;    // identical queries coalesced into this one
+    struct query_t *next;       // next in hash chain or waiter list
+    char name[];
 } query_t;
 
 
+/*
+ * @func  query_init()
+ * @desc  initialize query list
+ * @param cb - called when query->timer expires, instead of deleting the query
+ */
+extern void query_init(void (*cb)(query_t *query));
+
+
+/*
+ * @func  query_new()
+ * @desc  allocate DNS query from pool of current thread
+ * @param name  - domain name in lower case, copied to query->name
+ *        qname - question name of client in wire format, copied if not NULL
+ * @ret   pointer to query, or NULL if name is too long or out of memory
+ */
+extern query_t *query_new(const char *name, const void *qname);
+
+
+/*
+ * @func  query_qname()
+ * @desc  get question name of client kept by query_new()
+ * @ret   question name in wire format, or NULL if not kept
+ */
+extern const uint8_t *query_qname(const query_t *query);
+
+
+/*
+ * @func  query_free()
+ * @desc  free DNS query not added by query_add(), or a waiter taken off
+ *        leader->waiters, query_delete() frees added queries
+ */
+extern void query_free(query_t *query);
+
+
+/*
+ * @func  query_set_limit()
+ * @desc  set max count of in-flight queries
+ * @param max - 1 to 65535
+ */
+extern void query_set_limit(int max);
+
+
+/*
+ * @func  query_stat()
+ * @desc  get statistics of query list
+ * @param inflight  - count of in-flight queries, may be NULL
+ *        overload_cnt - count of queries rejected by query_add(), may be NULL
+ */
+extern void query_stat(int *inflight, unsigned long *overload_cnt);
+
+
 /*
  * @func query_add()
  * @desc add new DNS query
+ * @memo query->id is saved to query->qid and replaced by a new upstream ID,
+ *       the query is deleted if not replied in QUERY_TIMEOUT ms, unless a
+ *       timeout callback is set by query_init()
+ * @ret  0 - if succeed
+ *       -1 - if too many queries in flight, the query should be answered
+ *            SERVFAIL at once
  */
 extern int query_add(query_t *query);
 
 
+/*
+ * @func  query_newid()
+ * @desc  move DNS query to a new upstream ID, so late replies to the old
+ *        ID are ignored
+ * @param query - DNS query added by query_add()
+ */
+extern void query_newid(query_t *query);
+
+
+/*
+ * @func  query_coalesce()
+ * @desc  attach query to an in-flight query with the same name and type
+ * @param query - DNS query added by query_add()
+ * @ret   0 - if attached, query is moved to leader->waiters, answer and
+ *            query_free() waiters before query_delete() of leader
+ *        -1 - if no such query, this query becomes the one to attach to
+ */
+extern int query_coalesce(query_t *query);
+
+
 /*
  * @func  query_search()
  * @desc  search DNS query from query list
@@ -68,16 +175,11 @@ extern query_t *query_search(uint16_t id);
 /*
  * @func  query_delete()
  * @desc  delete DNS query from query list
+ * @memo  waiters left are freed too, their TCP sockets are closed, pending
+ *        connection to upstream is cancelled
  * @param id - query id
  */
 extern int query_delete(uint16_t id);
 
 
-/*
- * @func query_tick()
- * @desc delete old queries periodically
- */
-extern void query_tick(void);
-
-
 #endif // QUERY_H
@@ -25,6 +25,16 @@
 #include <string.h>
 #include <unistd.h>
 
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#if defined(HAVE_PTHREAD_H) && !defined(__MINGW32__)
+#  define USE_THREAD
+#  include <poll.h>
+#  include <pthread.h>
+#endif
+
 #ifdef __MINGW32__
 #  include "win.h"
 #else
@@ -38,11 +48,14 @@
 #include "conf.h"
 #include "dns.h"
 #include "dnsmsg.h"
+#include "domains.h"
 #include "event.h"
 #include "log.h"
 #include "query.h"
 #include "sans.h"
+#include "uring.h"
 #include "utils.h"
+#include "verdict.h"
 
 
 /*
@@ -63,15 +76,99 @@ static int nspresolver;
  */
 static int socks5;
 
+/*
+ * @var  timeout
+ * @desc time to wait for the first reply from upstream server, in ms
+ */
+static int timeout;
+
+/*
+ * @var  retries
+ * @desc times to resend a query before failing over
+ */
+static int retries;
+
+
+/*
+ * @desc stage of query
+ *       STAGE_TEST   - detecting whether domain is blocked, via test_server
+ *       STAGE_CN     - resolving via cn_server
+ *       STAGE_SERVER - resolving via server
+ */
+enum
+{
+    STAGE_TEST = 0,
+    STAGE_CN,
+    STAGE_SERVER
+};
+
+
+/*
+ * @var  max_watchers
+ * @desc max count of watchers in event loop of each worker
+ */
+static int max_watchers;
+
+
+/*
+ * @var  max_queries
+ * @desc max count of in-flight queries of each worker
+ */
+static int max_queries;
+
 
 /*
- * @desc socket file descriptor
+ * @var  cache_size
+ * @desc memory limit of DNS cache, shared evenly by workers
  */
-static int sock_udp;
-static int sock_tcp;
-static int sock_server;
-static int sock_cn;
-static int sock_test;
+static long cache_size;
+
+
+/*
+ * @var  verdict_file
+ * @desc file to save verdicts, empty if not saved
+ */
+static char verdict_file[128];
+
+
+/*
+ * @type worker_t
+ * @desc worker, runs its own event loop with its own sockets
+ */
+typedef struct
+{
+    int sock_udp;
+    int sock_tcp;
+    int sock_server;
+    int sock_cn;
+    int sock_test;
+#ifdef USE_THREAD
+    pthread_t tid;
+#endif
+} worker_t;
+
+
+/*
+ * @var  workers
+ * @desc all workers, workers[0] runs in main thread
+ */
+static worker_t *workers;
+static int nworkers;
+
+/*
+ * @var  self
+ * @desc worker of current thread
+ */
+static THREAD_LOCAL worker_t *self;
+
+
+#ifndef __MINGW32__
+/*
+ * @var  stop_pipe
+ * @desc written by sans_stop() to stop all workers
+ */
+static int stop_pipe[2] = {-1, -1};
+#endif
 
 
 /*
@@ -84,12 +181,30 @@ static struct
 } test_server, cn_server, server;
 
 
-static void tick_cb(void);
+#ifdef USE_THREAD
+/*
+ * @var  save_tid
+ * @desc thread to save verdicts periodically
+ */
+static pthread_t save_tid;
+#endif
+
+
+static int worker_open(worker_t *w, const conf_t *conf);
+static int worker_run(worker_t *w);
+static void stop_cb(ev_io *w);
 static void accept_cb(ev_io *w);
 static void query_cb(uint16_t id);
 static void test_cb(void *msg, int msglen);
 static void connect_cb(int sock, void *data);
 static void reply_cb(void *msg, int msglen);
+static void upstream_send(query_t *query, int stage);
+static void retry_cb(query_t *query);
+static void reply_client(query_t *query, void *msg, int msglen);
+static void save_verdicts(void);
+#ifndef USE_THREAD
+static void save_cb(ev_timer *w);
+#endif
 
 
 /*
@@ -114,12 +229,174 @@ int sans_init(const conf_t *conf)
 
     verbose = conf->verbose;
     nspresolver = conf->nspresolver;
+    timeout = conf->timeout;
+    retries = conf->retries;
+    max_watchers = conf->max_watchers;
+    max_queries = conf->max_queries;
+    cache_size = conf->cache_size;
 
     struct addrinfo hints;
     struct addrinfo *res;
 
-    // 初始化 event loop
-    ev_init(tick_cb);
+    // 解析 test_server 地址
+    bzero(&hints, sizeof(struct addrinfo));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    hints.ai_protocol = IPPROTO_UDP;
+    if (getaddrinfo(conf->test_server.addr, conf->test_server.port, &hints, &res) != 0)
+    {
+        ERROR("getaddrinfo");
+        return -1;
+    }
+    memcpy(&test_server.addr, res->ai_addr, res->ai_addrlen);
+    test_server.addrlen = res->ai_addrlen;
+    freeaddrinfo(res);
+
+    // 解析 cn_server 地址
+    bzero(&hints, sizeof(struct addrinfo));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    hints.ai_protocol = IPPROTO_UDP;
+    if (getaddrinfo(conf->cn_server.addr, conf->cn_server.port, &hints, &res) != 0)
+    {
+        ERROR("getaddrinfo");
+        return -1;
+    }
+    memcpy(&cn_server.addr, res->ai_addr, res->ai_addrlen);
+    cn_server.addrlen = res->ai_addrlen;
+    freeaddrinfo(res);
+
+    // 解析 server 地址
+    bzero(&hints, sizeof(struct addrinfo));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    hints.ai_protocol = IPPROTO_UDP;
+    if (getaddrinfo(conf->server.addr, conf->server.port, &hints, &res) != 0)
+    {
+        ERROR("getaddrinfo");
+        return -1;
+    }
+    memcpy(&server.addr, res->ai_addr, res->ai_addrlen);
+    server.addrlen = res->ai_addrlen;
+    freeaddrinfo(res);
+
+    // worker 数量，默认与 CPU 核数相同
+#ifdef USE_THREAD
+    nworkers = conf->workers;
+    if (nworkers == 0)
+    {
+        long n = sysconf(_SC_NPROCESSORS_ONLN);
+        nworkers = (n > 0) ? (int)n : 1;
+    }
+#  ifndef SO_REUSEPORT
+    nworkers = 1;
+#  endif
+#else
+    nworkers = 1;
+#endif
+    workers = (worker_t *)calloc(nworkers, sizeof(worker_t));
+    if (workers == NULL)
+    {
+        LOG("out of memory");
+        return -1;
+    }
+
+    // 每个 worker 有独立的监听 socket 和 remote socket，必须在 drop root
+    // privilege 之前 bind
+    for (int i = 0; i < nworkers; i++)
+    {
+        if (worker_open(&workers[i], conf) != 0)
+        {
+            return -1;
+        }
+    }
+
+#ifndef __MINGW32__
+    // 用于通知所有 worker 退出
+    if (pipe(stop_pipe) != 0)
+    {
+        ERROR("pipe");
+        return -1;
+    }
+    setnonblock(stop_pipe[0]);
+    setnonblock(stop_pipe[1]);
+#endif
+
+    // 哈希表的密钥，防止针对性的碰撞攻击
+    hash_seed();
+
+    // 载入域名列表
+    if ((conf->blocked_list[0] != '\0') || (conf->cn_list[0] != '\0'))
+    {
+        if (domains_load((conf->blocked_list[0] != '\0') ? conf->blocked_list : NULL,
+                         (conf->cn_list[0] != '\0') ? conf->cn_list : NULL) != 0)
+        {
+            LOG("failed to load domain lists");
+            return -1;
+        }
+        size_t count, bytes;
+        domains_stat(&count, &bytes);
+        LOG("loaded %lu domains, %lu bytes", (unsigned long)count, (unsigned long)bytes);
+    }
+
+    // 载入上次保存的污染结论，失败时不影响启动
+    strcpy(verdict_file, conf->verdict_file);
+    if (verdict_file[0] != '\0')
+    {
+        size_t count;
+        if (verdict_load(verdict_file, &count) != 0)
+        {
+            LOG("failed to load verdicts, starting without them");
+        }
+        else if (count > 0)
+        {
+            LOG("loaded %lu verdicts from %s", (unsigned long)count, verdict_file);
+        }
+    }
+
+    // 初始化 SOCKS5
+    if (conf->socks5.addr[0] == '\0')
+    {
+        socks5 = 0;
+    }
+    else
+    {
+        if (socks5_init(conf->socks5.addr, conf->socks5.port) == 0)
+        {
+            socks5 = 1;
+        }
+        else
+        {
+            socks5 = 0;
+        }
+    }
+
+    // drop root privilege
+    if (conf->user[0] != '\0')
+    {
+        if (runas(conf->user) != 0)
+        {
+            ERROR("runas");
+        }
+    }
+
+    LOG("starting sans at %s:%s with %d worker%s", conf->listen.addr,
+        conf->listen.port, nworkers, (nworkers > 1) ? "s" : "");
+
+    return 0;
+}
+
+
+/*
+ * @func  worker_open()
+ * @desc  open listening sockets and remote sockets of worker
+ * @param w    - worker
+ *        conf - config
+ */
+static int worker_open(worker_t *w, const conf_t *conf)
+{
+    struct addrinfo hints;
+    struct addrinfo *res;
 
     // 初始化本地监听 UDP socket
     bzero(&hints, sizeof(struct addrinfo));
@@ -132,15 +409,22 @@ int sans_init(const conf_t *conf)
         ERROR("getaddrinfo");
         return -1;
     }
-    sock_udp = socket(res->ai_family, SOCK_DGRAM, IPPROTO_UDP);
-    if (sock_udp < 0)
+    w->sock_udp = socket(res->ai_family, SOCK_DGRAM, IPPROTO_UDP);
+    if (w->sock_udp < 0)
     {
         ERROR("socket");
         freeaddrinfo(res);
         return -1;
     }
-    setnonblock(sock_udp);
-    if (bind(sock_udp, res->ai_addr, (int)(res->ai_addrlen)) != 0)
+    setnonblock(w->sock_udp);
+#ifdef SO_REUSEPORT
+    // 多个 worker 监听同一端口，由内核分配客户端
+    if (nworkers > 1)
+    {
+        setreuseport(w->sock_udp);
+    }
+#endif
+    if (bind(w->sock_udp, res->ai_addr, (int)(res->ai_addrlen)) != 0)
     {
         ERROR("bind");
         freeaddrinfo(res);
@@ -159,196 +443,360 @@ int sans_init(const conf_t *conf)
         ERROR("getaddrinfo");
         return -1;
     }
-    sock_tcp = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
-    if (sock_tcp < 0)
+    w->sock_tcp = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    if (w->sock_tcp < 0)
     {
         ERROR("socket");
         freeaddrinfo(res);
         return -1;
     }
-    setreuseaddr(sock_tcp);
-    if (bind(sock_tcp, res->ai_addr, (int)(res->ai_addrlen)) != 0)
+    setreuseaddr(w->sock_tcp);
+#ifdef SO_REUSEPORT
+    if (nworkers > 1)
+    {
+        setreuseport(w->sock_tcp);
+    }
+#endif
+    if (bind(w->sock_tcp, res->ai_addr, (int)(res->ai_addrlen)) != 0)
     {
         ERROR("bind");
         freeaddrinfo(res);
         return -1;
     }
     freeaddrinfo(res);
-    if (listen(sock_tcp, SOMAXCONN) != 0)
+    if (listen(w->sock_tcp, SOMAXCONN) != 0)
     {
         ERROR("listen");
         return -1;
     }
-    setnonblock(sock_tcp);
+    setnonblock(w->sock_tcp);
 #ifdef SO_NOSIGPIPE
-    setnosigpipe(sock_tcp);
+    setnosigpipe(w->sock_tcp);
 #endif
 
-    // 解析 test_server 地址
-    bzero(&hints, sizeof(struct addrinfo));
-    hints.ai_family = AF_UNSPEC;
-    hints.ai_socktype = SOCK_DGRAM;
-    hints.ai_protocol = IPPROTO_UDP;
-    if (getaddrinfo(conf->test_server.addr, conf->test_server.port, &hints, &res) != 0)
-    {
-        ERROR("getaddrinfo");
-        return -1;
-    }
-    memcpy(&test_server.addr, res->ai_addr, res->ai_addrlen);
-    test_server.addrlen = res->ai_addrlen;
-    freeaddrinfo(res);
-
-    // 解析 cn_server 地址
-    bzero(&hints, sizeof(struct addrinfo));
-    hints.ai_family = AF_UNSPEC;
-    hints.ai_socktype = SOCK_DGRAM;
-    hints.ai_protocol = IPPROTO_UDP;
-    if (getaddrinfo(conf->cn_server.addr, conf->cn_server.port, &hints, &res) != 0)
-    {
-        ERROR("getaddrinfo");
-        return -1;
-    }
-    memcpy(&cn_server.addr, res->ai_addr, res->ai_addrlen);
-    cn_server.addrlen = res->ai_addrlen;
-    freeaddrinfo(res);
-
-    // 解析 server 地址
-    bzero(&hints, sizeof(struct addrinfo));
-    hints.ai_family = AF_UNSPEC;
-    hints.ai_socktype = SOCK_DGRAM;
-    hints.ai_protocol = IPPROTO_UDP;
-    if (getaddrinfo(conf->server.addr, conf->server.port, &hints, &res) != 0)
-    {
-        ERROR("getaddrinfo");
-        return -1;
-    }
-    memcpy(&server.addr, res->ai_addr, res->ai_addrlen);
-    server.addrlen = res->ai_addrlen;
-    freeaddrinfo(res);
-
     // 初始化 remote UDP socket
-    sock_test = socket(test_server.addr.ss_family, SOCK_DGRAM, IPPROTO_UDP);
-    if (sock_test < 0)
+    w->sock_test = socket(test_server.addr.ss_family, SOCK_DGRAM, IPPROTO_UDP);
+    if (w->sock_test < 0)
     {
         ERROR("socket");
         return -1;
     }
-    setnonblock(sock_test);
-    sock_cn = socket(cn_server.addr.ss_family, SOCK_DGRAM, IPPROTO_UDP);
-    if (sock_cn < 0)
+    setnonblock(w->sock_test);
+    w->sock_cn = socket(cn_server.addr.ss_family, SOCK_DGRAM, IPPROTO_UDP);
+    if (w->sock_cn < 0)
     {
         ERROR("socket");
         return -1;
     }
-    setnonblock(sock_cn);
-    sock_server = socket(server.addr.ss_family, SOCK_DGRAM, IPPROTO_UDP);
-    if (sock_server < 0)
+    setnonblock(w->sock_cn);
+    w->sock_server = socket(server.addr.ss_family, SOCK_DGRAM, IPPROTO_UDP);
+    if (w->sock_server < 0)
     {
         ERROR("socket");
         return -1;
     }
-    setnonblock(sock_server);
+    setnonblock(w->sock_server);
 
 #ifdef __MINGW32__
     // fix weird bug with winsock
     const unsigned int SIO_UDP_CONNRESET = 0x9800000cU;
     int no_connset = 0;
     int wsa_ret;
-    WSAIoctl(sock_udp, SIO_UDP_CONNRESET, &no_connset, sizeof(no_connset),
+    WSAIoctl(w->sock_udp, SIO_UDP_CONNRESET, &no_connset, sizeof(no_connset),
              NULL, 0, &wsa_ret, NULL, NULL);
-    WSAIoctl(sock_tcp, SIO_UDP_CONNRESET, &no_connset, sizeof(no_connset),
+    WSAIoctl(w->sock_tcp, SIO_UDP_CONNRESET, &no_connset, sizeof(no_connset),
              NULL, 0, &wsa_ret, NULL, NULL);
-    WSAIoctl(sock_server, SIO_UDP_CONNRESET, &no_connset, sizeof(no_connset),
+    WSAIoctl(w->sock_server, SIO_UDP_CONNRESET, &no_connset, sizeof(no_connset),
              NULL, 0, &wsa_ret, NULL, NULL);
-    WSAIoctl(sock_cn, SIO_UDP_CONNRESET, &no_connset, sizeof(no_connset),
+    WSAIoctl(w->sock_cn, SIO_UDP_CONNRESET, &no_connset, sizeof(no_connset),
              NULL, 0, &wsa_ret, NULL, NULL);
-    WSAIoctl(sock_test, SIO_UDP_CONNRESET, &no_connset, sizeof(no_connset),
+    WSAIoctl(w->sock_test, SIO_UDP_CONNRESET, &no_connset, sizeof(no_connset),
              NULL, 0, &wsa_ret, NULL, NULL);
 #endif
 
-    // 初始化 SOCKS5
-    if (conf->socks5.addr[0] == '\0')
+    return 0;
+}
+
+
+#ifdef USE_THREAD
+/*
+ * @func worker_thread()
+ * @desc entry of worker thread
+ */
+static void *worker_thread(void *arg)
+{
+    return (void *)(intptr_t)worker_run((worker_t *)arg);
+}
+
+
+/*
+ * @func save_thread()
+ * @desc save verdicts periodically until sans_stop(), so that no worker
+ *       stops answering while the snapshot is built and written
+ */
+static void *save_thread(void *arg)
+{
+    (void)arg;
+
+    struct pollfd pfd;
+    pfd.fd = stop_pipe[0];
+    pfd.events = POLLIN;
+    for (;;)
     {
-        socks5 = 0;
+        int n = poll(&pfd, 1, VERDICT_SAVE_INTERVAL * 1000);
+        if (n > 0)
+        {
+            // sans_stop() 写入了 stop_pipe
+            break;
+        }
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            ERROR("poll");
+            break;
+        }
+        save_verdicts();
     }
-    else
+    return NULL;
+}
+#endif
+
+
+/*
+ * @func sans_run()
+ */
+int sans_run(void)
+{
+    int ret = EXIT_SUCCESS;
+
+#ifdef USE_THREAD
+    // workers[0] 在主线程中运行
+    int started = 1;
+    for (; started < nworkers; started++)
     {
-        if (socks5_init(conf->socks5.addr, conf->socks5.port) == 0)
+        if (pthread_create(&(workers[started].tid), NULL, worker_thread,
+                           &workers[started]) != 0)
         {
-            socks5 = 1;
+            LOG("failed to start worker");
+            ret = EXIT_FAILURE;
+            sans_stop();
+            break;
+        }
+    }
+
+    // 定期保存污染结论，不占用 worker 的事件循环
+    int saving = 0;
+    if ((verdict_file[0] != '\0') && (ret == EXIT_SUCCESS))
+    {
+        if (pthread_create(&save_tid, NULL, save_thread, NULL) == 0)
+        {
+            saving = 1;
         }
         else
         {
-            socks5 = 0;
+            LOG("failed to start saving verdicts");
         }
     }
+#endif
 
-    // drop root privilege
-    if (conf->user[0] != '\0')
+    if (worker_run(&workers[0]) != EXIT_SUCCESS)
     {
-        if (runas(conf->user) != 0)
+        ret = EXIT_FAILURE;
+    }
+
+#ifdef USE_THREAD
+    for (int i = 1; i < started; i++)
+    {
+        void *retval;
+        pthread_join(workers[i].tid, &retval);
+        if ((intptr_t)retval != EXIT_SUCCESS)
         {
-            ERROR("runas");
+            ret = EXIT_FAILURE;
         }
     }
+    if (saving)
+    {
+        pthread_join(save_tid, NULL);
+    }
+#endif
 
-    LOG("starting sans at %s:%s", conf->listen.addr, conf->listen.port);
+    // 所有 worker 都已退出，保存最终的污染结论
+    if ((verdict_file[0] != '\0') && (verdict_save(verdict_file) != 0))
+    {
+        LOG("failed to save verdicts");
+    }
 
-    return 0;
+    // 清理
+#ifndef __MINGW32__
+    close(stop_pipe[0]);
+    close(stop_pipe[1]);
+#endif
+    free(workers);
+#ifdef __MINGW32__
+    WSACleanup();
+#endif
+    LOG("exit");
+
+    return ret;
 }
 
 
 /*
- * @func sans_run()
+ * @func  worker_run()
+ * @desc  run event loop of worker until sans_stop()
+ * @param w - worker
  */
-int sans_run(void)
+static int worker_run(worker_t *w)
 {
+    int ret = EXIT_SUCCESS;
+
+    self = w;
+
+    // 初始化 event loop
+    if ((ev_init() != 0) || (verdict_thread_init() != 0))
+    {
+        sans_stop();
+        return EXIT_FAILURE;
+    }
+    ev_set_limit(max_watchers);
+    query_init(retry_cb);
+    query_set_limit(max_queries);
+    cache_set_limit((size_t)cache_size / nworkers);
+    if ((uring_init() == 0) && (w == &workers[0]))
+    {
+        LOG("using io_uring for UDP sockets");
+    }
+
+#ifndef USE_THREAD
+    // 没有线程时，由唯一的 worker 定期保存污染结论
+    ev_timer w_save;
+    ev_timer_init(&w_save, save_cb, VERDICT_SAVE_INTERVAL * 1000,
+                  VERDICT_SAVE_INTERVAL * 1000);
+    if (verdict_file[0] != '\0')
+    {
+        ev_timer_start(&w_save);
+    }
+#endif
+
     // 处理 TCP 连接请求
     ev_io w_tcp;
-    ev_io_init(&w_tcp, accept_cb, sock_tcp, EV_READ);
-    ev_io_start(&w_tcp);
+    ev_io_init(&w_tcp, accept_cb, w->sock_tcp, EV_READ);
+#ifndef __MINGW32__
+    ev_io w_stop;
+    ev_io_init(&w_stop, stop_cb, stop_pipe[0], EV_READ);
+    if (ev_io_start(&w_stop) != 0)
+    {
+        ret = EXIT_FAILURE;
+    }
+#endif
+    if ((ret != EXIT_SUCCESS)
+        || (ev_io_start(&w_tcp) != 0)
+        || (query_recv(w->sock_udp, ns_udp, query_cb) != 0)
+        || (reply_recv(w->sock_test, ns_udp, test_cb) != 0)
+        || (reply_recv(w->sock_cn, ns_udp, reply_cb) != 0)
+        || (reply_recv(w->sock_server, ns_udp, reply_cb) != 0))
+    {
+        LOG("failed to start event loop");
+        sans_stop();
+        ret = EXIT_FAILURE;
+    }
+    else
+    {
+        // 开始事件循环
+        ev_run();
 
-    query_recv(sock_udp, ns_udp, query_cb);
-    reply_recv(sock_test, ns_udp, test_cb);
-    reply_recv(sock_cn, ns_udp, reply_cb);
-    reply_recv(sock_server, ns_udp, reply_cb);
+        unsigned long overloads;
+        query_stat(NULL, &overloads);
+        if (overloads > 0)
+        {
+            LOG("%lu queries answered SERVFAIL on overload", overloads);
+        }
 
-    // 开始事件循环
-    ev_run();
+        size_t used;
+        unsigned long evictions;
+        cache_stat(&used, &evictions);
+        if (verbose || (evictions > 0))
+        {
+            LOG("cache: %lu bytes used, %lu replies evicted",
+                (unsigned long)used, evictions);
+        }
+    }
 
-    // 清理
-    close(sock_tcp);
-    close(sock_udp);
-    close(sock_test);
-    close(sock_cn);
-    close(sock_server);
-#ifdef __MINGW32__
-    WSACleanup();
+#ifndef USE_THREAD
+    ev_timer_stop(&w_save);
 #endif
-    LOG("exit");
+    uring_exit();
+    verdict_thread_exit();
+    close(w->sock_tcp);
+    close(w->sock_udp);
+    close(w->sock_test);
+    close(w->sock_cn);
+    close(w->sock_server);
 
-    return EXIT_SUCCESS;
+    return ret;
 }
 
 
 /*
  * @func sans_stop()
+ * @desc stop all workers, safe to call in signal handler
  */
 void sans_stop(void)
 {
+#ifdef __MINGW32__
     ev_stop();
+#else
+    // 不读出，所有 worker 都会收到 EV_READ
+    ssize_t n = write(stop_pipe[1], "", 1);
+    (void)n;
+#endif
 }
 
 
+#ifndef __MINGW32__
 /*
- * @func tick_cb()
- * @desc tick every seconds
+ * @func stop_cb()
+ * @desc stop event loop of current worker
  */
-static void tick_cb(void)
+static void stop_cb(ev_io *w)
 {
-    query_tick();
-    cache_tick();
+    (void)w;
+    ev_stop();
 }
+#endif
+
+
+/*
+ * @func save_verdicts()
+ * @desc save verdicts to verdict_file
+ */
+static void save_verdicts(void)
+{
+    if (verdict_save(verdict_file) != 0)
+    {
+        LOG("failed to save verdicts");
+    }
+    else if (verbose)
+    {
+        LOG("verdicts saved to %s", verdict_file);
+    }
+}
+
+
+#ifndef USE_THREAD
+/*
+ * @func save_cb()
+ * @desc save verdicts periodically, runs in the only worker
+ */
+static void save_cb(ev_timer *w)
+{
+    (void)w;
+    save_verdicts();
+}
+#endif
 
 
 /*
@@ -370,7 +818,11 @@ static void accept_cb(ev_io *w)
     setnosigpipe(sock);
 #endif
 
-    query_recv(sock, ns_tcp, query_cb);
+    if (query_recv(sock, ns_tcp, query_cb) != 0)
+    {
+        // 连接数过多
+        close(sock);
+    }
 }
 
 
@@ -385,53 +837,53 @@ static void query_cb(uint16_t id)
 
     if (verbose)
     {
-        LOG("query [%u] [%s] [%s]", query->id, ns_type_str(query->type), query->name);
+        LOG("query [%u] [%s] [%s]", query->qid, ns_type_str(query->type), query->name);
     }
 
-    // 使用新 ID
-    query->id = ns_newid();
+    // 命中缓存，直接应答
+    uint8_t msg[NS_PACKETSZ];
+    int msglen = cache_search(query->name, query->type, msg, NS_PACKETSZ);
+    if (msglen > 0)
+    {
+        if (verbose)
+        {
+            LOG("cached [%u] [%s] [%s]", query->qid, ns_type_str(query->type), query->name);
+        }
+        reply_client(query, msg, msglen);
+        return;
+    }
+
+    // 相同的查询正在进行中，等待其结果
+    if (query_coalesce(query) == 0)
+    {
+        return;
+    }
 
-    // 在 cache 中查找域名是否被污染
-    cache_t *cache = cache_search(query->name, ns_t_block);
+    // 查找域名是否被污染，先查预置的域名列表
+    int blocked = domains_search(query->name);
+    if (blocked < 0)
+    {
+        blocked = verdict_search(query->name);
+    }
 
-    if (cache == NULL)
+    if (blocked < 0)
     {
         // 查询 SOA 记录，以判断域名是否被污染
         if (verbose)
         {
             LOG("detect [%s]", query->name);
         }
-        uint8_t msg[NS_PACKETSZ];
-        int msglen = ns_mkquery(msg, NS_PACKETSZ, query->name, ns_t_soa);
-        ns_setid(msg, query->id);
-        query_send(sock_test, ns_udp, msg, msglen,
-                   (struct sockaddr *)&test_server.addr, test_server.addrlen);
+        upstream_send(query, STAGE_TEST);
     }
-    else if (*(ns_block *)(cache->data))
+    else if (blocked)
     {
         // 被污染的域名
-        if (nspresolver)
-        {
-            uint8_t msg[NS_PACKETSZ];
-            int msglen = ns_mkquery(msg, NS_PACKETSZ, query->name, query->type);
-            ns_setid(msg, query->id);
-            query_send(sock_server, ns_udp, msg, msglen,
-                       (struct sockaddr *)&server.addr, server.addrlen);
-        }
-        else
-        {
-            async_connect((struct sockaddr *)&(server.addr), server.addrlen,
-                        connect_cb, socks5, (void *)(uintptr_t)(query->id));
-        }
+        upstream_send(query, STAGE_SERVER);
     }
     else
     {
         // 域名没被污染
-        uint8_t msg[NS_PACKETSZ];
-        int msglen = ns_mkquery(msg, NS_PACKETSZ, query->name, query->type);
-        ns_setid(msg, query->id);
-        query_send(sock_cn, ns_udp, msg, msglen,
-                   (struct sockaddr *)&cn_server.addr, cn_server.addrlen);
+        upstream_send(query, STAGE_CN);
     }
 }
 
@@ -443,14 +895,11 @@ static void query_cb(uint16_t id)
 static void test_cb(void *msg, int msglen)
 {
     query_t *query = query_search(ns_getid(msg));
-    if (query == NULL)
+    if ((query == NULL) || (query->stage != STAGE_TEST))
     {
         return;
     }
 
-    // 使用新 ID
-    query->id = ns_newid();
-
     char name[NS_NAMESZ];
     int type = ns_t_invalid;
     if (ns_parse_reply(msg, msglen, name, &type) != 0)
@@ -459,15 +908,8 @@ static void test_cb(void *msg, int msglen)
         return;
     }
 
-    cache_t *cache = (cache_t *)malloc(sizeof(cache_t) + sizeof(ns_block));
-    if (cache == NULL)
-    {
-        LOG("out of memory");
-        return;
-    }
-    strcpy(cache->name, name);
-    cache->ttl = 518400U;
-    cache->type = ns_t_block;
+    // 使用新 ID
+    query_newid(query);
 
     if (type == ns_t_a)
     {
@@ -476,22 +918,13 @@ static void test_cb(void *msg, int msglen)
         {
             LOG("[%s] is blocked", name);
         }
-        if (nspresolver)
+        // 污染按域名整体判断，子域名共用同一结论
+        const char *zone = ns_registrable(query->name);
+        if (zone != NULL)
         {
-            *(ns_block *)(cache->data) = 1;
-            uint8_t msg2[NS_PACKETSZ];
-            int msglen2 = ns_mkquery(msg2, NS_PACKETSZ, query->name, query->type);
-            ns_setid(msg2, query->id);
-            query_send(sock_server, ns_udp, msg2, msglen2,
-                       (struct sockaddr *)&server.addr,
-                       server.addrlen);
-        }
-        else
-        {
-            *(ns_block *)(cache->data) = 1;
-            async_connect((struct sockaddr *)&(server.addr), server.addrlen,
-                        connect_cb, socks5, (void *)(uintptr_t)(query->id));
+            verdict_insert(zone, 1);
         }
+        upstream_send(query, STAGE_SERVER);
     }
     else
     {
@@ -500,15 +933,14 @@ static void test_cb(void *msg, int msglen)
         {
             LOG("[%s] is not blocked", name);
         }
-        *(ns_block *)(cache->data) = 0;
-        uint8_t msg2[NS_PACKETSZ];
-        int msglen2 = ns_mkquery(msg2, NS_PACKETSZ, query->name, query->type);
-        ns_setid(msg2, query->id);
-        query_send(sock_cn, ns_udp, msg2, msglen2,
-                   (struct sockaddr *)&cn_server.addr,
-                   cn_server.addrlen);
-    }
-    cache_insert(cache);
+        // 不能记在 com 这样的后缀上，否则其下所有域名都会沿用
+        const char *zone = ns_registrable(query->name);
+        if (zone != NULL)
+        {
+            verdict_insert(zone, 0);
+        }
+        upstream_send(query, STAGE_CN);
+    }
 }
 
 
@@ -516,25 +948,39 @@ static void test_cb(void *msg, int msglen)
  * @func  connect_cb()
  * @desc  TCP/SOCKS5 connect callback
  * @param sock - fd
- *        data - query ID
+ *        data - query, connection is cancelled if it is deleted before
  */
 static void connect_cb(int sock, void *data)
 {
-    query_t *query = query_search((uint16_t)(uintptr_t)(data));
-
-    assert(query != NULL);
+    query_t *query = (query_t *)data;
 
+    // 连接已结束，query_delete() 不能再取消
+    query->conn = NULL;
     if (sock < 0)
     {
-        query_delete(query->id);
+        uint8_t msg[NS_PACKETSZ];
+        int msglen = ns_mkreply(msg, NS_PACKETSZ, query->name, query->type,
+                                ns_r_servfail);
+        reply_client(query, msg, msglen);
         return;
     }
 
     uint8_t msg[NS_PACKETSZ];
     int msglen = ns_mkquery(msg, NS_PACKETSZ, query->name, query->type);
     ns_setid(msg, query->id);
-    query_send(sock, ns_tcp, msg, msglen, NULL, 0);
-    reply_recv(sock, ns_tcp, reply_cb);
+    if (reply_recv(sock, ns_tcp, reply_cb) != 0)
+    {
+        close(sock);
+        msglen = ns_mkreply(msg, NS_PACKETSZ, query->name, query->type,
+                            ns_r_servfail);
+        reply_client(query, msg, msglen);
+        return;
+    }
+    if (query_send(sock, ns_tcp, msg, msglen, NULL, 0) != 0)
+    {
+        // reply watcher will close sock
+        shutdown(sock, SHUT_RDWR);
+    }
 }
 
 
@@ -558,16 +1004,163 @@ static void reply_cb(void *msg, int msglen)
     }
 
     query_t *query = query_search(ns_getid(msg));
-    if (query == NULL)
+    if ((query == NULL) || (query->stage == STAGE_TEST))
     {
         return;
     }
 
-    ns_setid(msg, query->qid);
-    if (query->sock > 0)
+    uint32_t ttl;
+    if (ns_reply_ttl(msg, msglen, query->name, query->type, &ttl) == 0)
+    {
+        cache_insert(query->name, query->type, msg, msglen, ttl);
+    }
+
+    reply_client(query, msg, msglen);
+}
+
+
+/*
+ * @func  upstream_send()
+ * @desc  send query to upstream server of stage, and wait for reply
+ * @param query - DNS query
+ *        stage - STAGE_TEST, STAGE_CN or STAGE_SERVER
+ */
+static void upstream_send(query_t *query, int stage)
+{
+    if (query->stage != stage)
+    {
+        query->stage = stage;
+        query->retries = 0;
+    }
+
+    uint8_t msg[NS_PACKETSZ];
+    int msglen;
+    switch (stage)
+    {
+    case STAGE_TEST:
+        msglen = ns_mkquery(msg, NS_PACKETSZ, query->name, ns_t_soa);
+        ns_setid(msg, query->id);
+        query_send(self->sock_test, ns_udp, msg, msglen,
+                   (struct sockaddr *)&test_server.addr, test_server.addrlen);
+        break;
+    case STAGE_CN:
+        msglen = ns_mkquery(msg, NS_PACKETSZ, query->name, query->type);
+        ns_setid(msg, query->id);
+        query_send(self->sock_cn, ns_udp, msg, msglen,
+                   (struct sockaddr *)&cn_server.addr, cn_server.addrlen);
+        break;
+    default:
+        if (!nspresolver)
+        {
+            // TCP 不会丢包，不重发，只等待全部重试时间
+            query->retries = retries;
+            query->timer.timeout = (unsigned int)timeout * ((2U << retries) - 1);
+            ev_timer_reset(&(query->timer));
+            // 连接失败时 connect_cb() 会同步回调并释放 query，之后不能再访问它
+            void *conn = async_connect((struct sockaddr *)&(server.addr),
+                                       server.addrlen, connect_cb, socks5,
+                                       (void *)query);
+            if (conn != NULL)
+            {
+                query->conn = conn;
+            }
+            return;
+        }
+        msglen = ns_mkquery(msg, NS_PACKETSZ, query->name, query->type);
+        ns_setid(msg, query->id);
+        query_send(self->sock_server, ns_udp, msg, msglen,
+                   (struct sockaddr *)&server.addr, server.addrlen);
+        break;
+    }
+
+    // 指数退避
+    query->timer.timeout = (unsigned int)timeout << query->retries;
+    ev_timer_reset(&(query->timer));
+}
+
+
+/*
+ * @func  retry_cb()
+ * @desc  resend query not replied in time, or fail over to server,
+ *        reply SERVFAIL at last
+ * @param query - DNS query
+ */
+static void retry_cb(query_t *query)
+{
+    if (query->retries < retries)
+    {
+        query->retries++;
+        if (verbose)
+        {
+            LOG("retry [%u] [%s] [%s]", query->id, ns_type_str(query->type), query->name);
+        }
+        upstream_send(query, query->stage);
+    }
+    else if (query->stage != STAGE_SERVER)
+    {
+        // test_server 或 cn_server 无响应，改用 server
+        if (verbose)
+        {
+            LOG("failover [%u] [%s] [%s]", query->id, ns_type_str(query->type), query->name);
+        }
+        query_newid(query);
+        upstream_send(query, STAGE_SERVER);
+    }
+    else
+    {
+        if (verbose)
+        {
+            LOG("servfail [%u] [%s] [%s]", query->id, ns_type_str(query->type), query->name);
+        }
+        uint8_t msg[NS_PACKETSZ];
+        int msglen = ns_mkreply(msg, NS_PACKETSZ, query->name, query->type,
+                                ns_r_servfail);
+        reply_client(query, msg, msglen);
+    }
+}
+
+
+/*
+ * @func  reply_one()
+ * @desc  send reply to client of query
+ */
+static void reply_one(query_t *query, void *msg, int msglen)
+{
+    if (msglen > 0)
+    {
+        ns_setid(msg, query->qid);
+        ns_setqcase(msg, msglen, query_qname(query));
+        if ((reply_send(query->sock, query->protocol, msg, msglen,
+                        (struct sockaddr *)&(query->addr), query->addrlen) != 0)
+            && (query->protocol == ns_tcp))
+        {
+            close(query->sock);
+        }
+    }
+    else if (query->protocol == ns_tcp)
+    {
+        close(query->sock);
+    }
+}
+
+
+/*
+ * @func  reply_client()
+ * @desc  send reply to client, and clients of coalesced queries, then
+ *        delete query
+ * @param query  - DNS query
+ *        msg    - reply
+ *        msglen - length of reply
+ */
+static void reply_client(query_t *query, void *msg, int msglen)
+{
+    reply_one(query, msg, msglen);
+    while (query->waiters != NULL)
     {
-        reply_send(query->sock, query->protocol, msg, msglen,
-                   (struct sockaddr *)&(query->addr), query->addrlen);
+        query_t *waiter = query->waiters;
+        query->waiters = waiter->next;
+        reply_one(waiter, msg, msglen);
+        query_free(waiter);
     }
     query_delete(query->id);
 }
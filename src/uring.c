@@ -0,0 +1,851 @@
+/*
+ * uring.c - io_uring engine for UDP sockets
+ *
+ * Copyright (C) 2014 - 2015, Xiaoxiao <i@xiaoxiao.im>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#if defined(HAVE_LINUX_IO_URING_H) && HAVE_DECL_IORING_RECV_MULTISHOT \
+    && HAVE_DECL_IORING_REGISTER_PBUF_RING && !defined(DISABLE_IO_URING)
+#  define USE_IO_URING
+#endif
+
+#ifdef USE_IO_URING
+#  include <errno.h>
+#  include <stdint.h>
+#  include <stdlib.h>
+#  include <string.h>
+#  include <linux/io_uring.h>
+#  include <netinet/in.h>
+#  include <sys/mman.h>
+#  include <sys/syscall.h>
+#  include <unistd.h>
+#endif
+
+#include "dns.h"
+#include "event.h"
+#include "log.h"
+#include "pool.h"
+#include "uring.h"
+
+
+#ifdef USE_IO_URING
+
+/*
+ * @desc size of rings and buffers
+ */
+#define SQ_ENTRIES 256
+#define CQ_ENTRIES 4096
+#define BUF_COUNT 1024
+#define BUF_SIZE (sizeof(struct io_uring_recvmsg_out) \
+                  + sizeof(struct sockaddr_storage) + NS_PACKETSZ)
+#define BUF_GROUP 0
+
+#define LOAD(p) __atomic_load_n(&(p), __ATOMIC_ACQUIRE)
+#define STORE(p, v) __atomic_store_n(&(p), (v), __ATOMIC_RELEASE)
+
+
+/*
+ * @type op_t
+ * @desc submitted operation, address of it is user_data of SQE
+ */
+typedef struct
+{
+    int opcode;
+    int sock;
+    struct msghdr mh;
+} op_t;
+
+
+/*
+ * @type recv_op_t
+ * @desc multishot recvmsg operation
+ */
+typedef struct recv_op_t
+{
+    op_t op;
+    void (*cb)(void *data, int sock, void *msg, int msglen,
+               const struct sockaddr *addr, socklen_t addrlen);
+    void *data;
+    ev_io *fallback;
+    struct recv_op_t *next;
+} recv_op_t;
+
+
+/*
+ * @type send_op_t
+ * @desc sendmsg operation
+ */
+typedef struct
+{
+    op_t op;
+    struct iovec iov;
+    struct sockaddr_storage addr;
+    uint8_t msg[];
+} send_op_t;
+
+
+/*
+ * @var  ring
+ * @desc io_uring of current thread
+ */
+static THREAD_LOCAL struct
+{
+    int fd;
+    // submission queue
+    void *sq_ptr;
+    size_t sq_size;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_flags;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned sq_local;          // tail of queued SQEs
+    unsigned sq_submitted;      // tail of submitted SQEs
+    struct io_uring_sqe *sqes;
+    // completion queue
+    void *cq_ptr;
+    size_t cq_size;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+    // provided buffers
+    struct io_uring_buf_ring *br;
+    unsigned short br_tail;
+    uint8_t *bufs;
+    // watchers
+    ev_io w;
+    ev_prepare w_prepare;
+    recv_op_t *recvs;
+    int failed;                 // recvmsg failed, sockets are read by fallback watchers
+} ring = {.fd = -1};
+
+
+/*
+ * @var  send_pool
+ * @desc pool of sendmsg operations
+ */
+static THREAD_LOCAL pool_t send_pool = POOL_INIT(sizeof(send_op_t) + NS_PACKETSZ);
+
+
+static void uring_cb(ev_io *w);
+static void prepare_cb(ev_prepare *w);
+static int recv_arm(recv_op_t *op);
+static int probe_recv(void);
+
+
+/*
+ * @func io_uring_setup()
+ * @func io_uring_enter()
+ * @func io_uring_register()
+ * @desc io_uring syscalls
+ */
+static int io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                          unsigned flags)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+                        flags, NULL, 0);
+}
+
+static int io_uring_register(int fd, unsigned opcode, void *arg,
+                             unsigned nr_args)
+{
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+
+/*
+ * @func  buf_recycle()
+ * @desc  give buffer back to kernel
+ * @param bid - buffer ID
+ */
+static void buf_recycle(unsigned short bid)
+{
+    struct io_uring_buf *buf = &(ring.br->bufs[ring.br_tail & (BUF_COUNT - 1)]);
+    buf->addr = (uint64_t)(uintptr_t)(ring.bufs + (size_t)bid * BUF_SIZE);
+    buf->len = BUF_SIZE;
+    buf->bid = bid;
+    ring.br_tail++;
+    STORE(ring.br->tail, ring.br_tail);
+}
+
+
+/*
+ * @func  uring_init()
+ * @desc  set up io_uring of current thread
+ */
+int uring_init(void)
+{
+    struct io_uring_params p;
+    bzero(&p, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = CQ_ENTRIES;
+    ring.fd = io_uring_setup(SQ_ENTRIES, &p);
+    if (ring.fd < 0)
+    {
+        ring.fd = -1;
+        return -1;
+    }
+
+    // 映射 SQ/CQ
+    ring.sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring.cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (ring.cq_size > ring.sq_size)
+        {
+            ring.sq_size = ring.cq_size;
+        }
+        ring.cq_size = 0;
+    }
+    ring.sq_ptr = mmap(NULL, ring.sq_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+    if (ring.sq_ptr == MAP_FAILED)
+    {
+        ring.sq_ptr = NULL;
+        uring_exit();
+        return -1;
+    }
+    if (ring.cq_size == 0)
+    {
+        ring.cq_ptr = ring.sq_ptr;
+    }
+    else
+    {
+        ring.cq_ptr = mmap(NULL, ring.cq_size, PROT_READ | PROT_WRITE,
+                           MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_CQ_RING);
+        if (ring.cq_ptr == MAP_FAILED)
+        {
+            ring.cq_ptr = NULL;
+            uring_exit();
+            return -1;
+        }
+    }
+    ring.sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+                     PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     ring.fd, IORING_OFF_SQES);
+    if (ring.sqes == MAP_FAILED)
+    {
+        ring.sqes = NULL;
+        uring_exit();
+        return -1;
+    }
+    ring.sq_head = (unsigned *)((uint8_t *)ring.sq_ptr + p.sq_off.head);
+    ring.sq_tail = (unsigned *)((uint8_t *)ring.sq_ptr + p.sq_off.tail);
+    ring.sq_flags = (unsigned *)((uint8_t *)ring.sq_ptr + p.sq_off.flags);
+    ring.sq_mask = *(unsigned *)((uint8_t *)ring.sq_ptr + p.sq_off.ring_mask);
+    ring.sq_entries = p.sq_entries;
+    ring.sq_local = *ring.sq_tail;
+    ring.sq_submitted = ring.sq_local;
+    unsigned *array = (unsigned *)((uint8_t *)ring.sq_ptr + p.sq_off.array);
+    for (unsigned i = 0; i < p.sq_entries; i++)
+    {
+        array[i] = i;
+    }
+    ring.cq_head = (unsigned *)((uint8_t *)ring.cq_ptr + p.cq_off.head);
+    ring.cq_tail = (unsigned *)((uint8_t *)ring.cq_ptr + p.cq_off.tail);
+    ring.cq_mask = *(unsigned *)((uint8_t *)ring.cq_ptr + p.cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe *)((uint8_t *)ring.cq_ptr + p.cq_off.cqes);
+
+    // 注册 multishot recvmsg 使用的 buffer ring
+    ring.br = mmap(NULL, BUF_COUNT * sizeof(struct io_uring_buf),
+                   PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring.br == MAP_FAILED)
+    {
+        ring.br = NULL;
+        uring_exit();
+        return -1;
+    }
+    struct io_uring_buf_reg reg;
+    bzero(&reg, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)ring.br;
+    reg.ring_entries = BUF_COUNT;
+    reg.bgid = BUF_GROUP;
+    if (io_uring_register(ring.fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0)
+    {
+        // 内核版本过低
+        munmap(ring.br, BUF_COUNT * sizeof(struct io_uring_buf));
+        ring.br = NULL;
+        uring_exit();
+        return -1;
+    }
+    ring.bufs = (uint8_t *)malloc(BUF_COUNT * BUF_SIZE);
+    if (ring.bufs == NULL)
+    {
+        LOG("out of memory");
+        uring_exit();
+        return -1;
+    }
+    ring.br_tail = 0;
+    for (unsigned short i = 0; i < BUF_COUNT; i++)
+    {
+        buf_recycle(i);
+    }
+
+    // 注册 buffer ring 只需要 5.19，multishot recvmsg 需要 6.0
+    if (probe_recv() != 0)
+    {
+        uring_exit();
+        return -1;
+    }
+
+    ev_io_init(&(ring.w), uring_cb, ring.fd, EV_READ);
+    if (ev_io_start(&(ring.w)) != 0)
+    {
+        uring_exit();
+        return -1;
+    }
+    ev_prepare_init(&(ring.w_prepare), prepare_cb);
+    ev_prepare_start(&(ring.w_prepare));
+    return 0;
+}
+
+
+/*
+ * @func  uring_exit()
+ * @desc  tear down io_uring of current thread
+ */
+void uring_exit(void)
+{
+    if (ring.fd < 0)
+    {
+        return;
+    }
+    if (ev_is_active(&(ring.w)))
+    {
+        ev_io_stop(&(ring.w));
+    }
+    ev_prepare_stop(&(ring.w_prepare));
+    // 关闭 ring 后内核不再引用 buffer
+    close(ring.fd);
+    ring.fd = -1;
+    while (ring.recvs != NULL)
+    {
+        recv_op_t *op = ring.recvs;
+        ring.recvs = op->next;
+        free(op);
+    }
+    if (ring.br != NULL)
+    {
+        munmap(ring.br, BUF_COUNT * sizeof(struct io_uring_buf));
+        ring.br = NULL;
+    }
+    free(ring.bufs);
+    ring.bufs = NULL;
+    if (ring.sqes != NULL)
+    {
+        munmap(ring.sqes, ring.sq_entries * sizeof(struct io_uring_sqe));
+        ring.sqes = NULL;
+    }
+    if ((ring.cq_ptr != NULL) && (ring.cq_ptr != ring.sq_ptr))
+    {
+        munmap(ring.cq_ptr, ring.cq_size);
+    }
+    ring.cq_ptr = NULL;
+    if (ring.sq_ptr != NULL)
+    {
+        munmap(ring.sq_ptr, ring.sq_size);
+        ring.sq_ptr = NULL;
+    }
+    ring.failed = 0;
+}
+
+
+/*
+ * @func  uring_enabled()
+ * @desc  is io_uring of current thread set up
+ */
+int uring_enabled(void)
+{
+    return (ring.fd >= 0) && !ring.failed;
+}
+
+
+/*
+ * @func  submit()
+ * @desc  submit queued SQEs in one syscall
+ * @memo  never handles completion events, it may be called from callbacks
+ *        of uring_cb()
+ */
+static void submit(void)
+{
+    while (ring.sq_submitted != ring.sq_local)
+    {
+        STORE(*ring.sq_tail, ring.sq_local);
+        int n = io_uring_enter(ring.fd, ring.sq_local - ring.sq_submitted, 0, 0);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            if ((errno == EBUSY) || (errno == EAGAIN))
+            {
+                // CQ 已满。不能在这里处理完成事件：submit() 可能是在
+                // uring_cb() 的回调中调用的，重入会重复处理同一批 CQE。
+                // 留在 SQ 中，等 uring_cb() 取完之后由 prepare_cb() 提交
+                return;
+            }
+            ERROR("io_uring_enter");
+            return;
+        }
+        ring.sq_submitted += (unsigned)n;
+    }
+}
+
+
+/*
+ * @func  get_sqe()
+ * @desc  get a free SQE, submit queued SQEs if submission queue is full
+ * @ret   SQE, or NULL
+ */
+static struct io_uring_sqe *get_sqe(void)
+{
+    if (ring.sq_local - LOAD(*ring.sq_head) >= ring.sq_entries)
+    {
+        submit();
+        if (ring.sq_local - LOAD(*ring.sq_head) >= ring.sq_entries)
+        {
+            return NULL;
+        }
+    }
+    struct io_uring_sqe *sqe = &(ring.sqes[ring.sq_local & ring.sq_mask]);
+    bzero(sqe, sizeof(struct io_uring_sqe));
+    ring.sq_local++;
+    return sqe;
+}
+
+
+/*
+ * @func  wait_cqe()
+ * @desc  take one completion event, wait for it if CQ is empty
+ * @memo  only used before uring_cb() is watching the ring
+ */
+static int wait_cqe(struct io_uring_cqe *cqe)
+{
+    for (;;)
+    {
+        unsigned head = *ring.cq_head;
+        if (head != LOAD(*ring.cq_tail))
+        {
+            *cqe = ring.cqes[head & ring.cq_mask];
+            STORE(*ring.cq_head, head + 1);
+            return 0;
+        }
+        if ((io_uring_enter(ring.fd, 0, 1, IORING_ENTER_GETEVENTS) < 0)
+            && (errno != EINTR))
+        {
+            ERROR("io_uring_enter");
+            return -1;
+        }
+    }
+}
+
+
+/*
+ * @func  probe_recv()
+ * @desc  check if kernel supports multishot recvmsg
+ * @ret   0 - if supported
+ *        -1 - if not, older kernel fails it at once without IORING_CQE_F_MORE
+ */
+static int probe_recv(void)
+{
+    int sock = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (sock < 0)
+    {
+        ERROR("socket");
+        return -1;
+    }
+    struct sockaddr_in addr;
+    socklen_t addrlen = sizeof(addr);
+    bzero(&addr, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    uint8_t byte = 0;
+    if ((bind(sock, (struct sockaddr *)&addr, addrlen) != 0)
+        || (getsockname(sock, (struct sockaddr *)&addr, &addrlen) != 0)
+        || (sendto(sock, &byte, 1, 0, (struct sockaddr *)&addr, addrlen) != 1))
+    {
+        ERROR("probe io_uring");
+        close(sock);
+        return -1;
+    }
+
+    // socket 中已有数据报，提交后立即得到第一个 CQE
+    recv_op_t op;
+    bzero(&op, sizeof(op));
+    op.op.opcode = IORING_OP_RECVMSG;
+    op.op.sock = sock;
+    op.op.mh.msg_namelen = sizeof(struct sockaddr_storage);
+    struct io_uring_cqe cqe;
+    if (recv_arm(&op) != 0)
+    {
+        close(sock);
+        return -1;
+    }
+    submit();
+    if ((ring.sq_submitted != ring.sq_local) || (wait_cqe(&cqe) != 0))
+    {
+        close(sock);
+        return -1;
+    }
+    int supported = (cqe.res >= 0) && (cqe.flags & IORING_CQE_F_MORE);
+
+    // 取消仍在等待的 recvmsg，直到收到它的最后一个 CQE
+    int cancelled = 0;
+    for (;;)
+    {
+        if (cqe.user_data == (uint64_t)(uintptr_t)&op)
+        {
+            if (cqe.flags & IORING_CQE_F_BUFFER)
+            {
+                buf_recycle((unsigned short)(cqe.flags >> IORING_CQE_BUFFER_SHIFT));
+            }
+            if (!(cqe.flags & IORING_CQE_F_MORE))
+            {
+                break;
+            }
+        }
+        if (!cancelled)
+        {
+            struct io_uring_sqe *sqe = get_sqe();
+            if (sqe == NULL)
+            {
+                close(sock);
+                return -1;
+            }
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->fd = -1;
+            sqe->addr = (uint64_t)(uintptr_t)&op;
+            sqe->user_data = 0;
+            submit();
+            cancelled = 1;
+        }
+        if (wait_cqe(&cqe) != 0)
+        {
+            close(sock);
+            return -1;
+        }
+    }
+    close(sock);
+
+    if (!supported)
+    {
+        LOG("multishot recvmsg is not supported by kernel");
+        return -1;
+    }
+    return 0;
+}
+
+
+/*
+ * @func  uring_fail()
+ * @desc  stop receiving with io_uring, fall back to watchers of sockets
+ * @memo  send completions are still handled until uring_exit()
+ */
+static void uring_fail(void)
+{
+    if (ring.failed)
+    {
+        return;
+    }
+    LOG("io_uring failed, falling back to poll for UDP sockets");
+    ring.failed = 1;
+    for (recv_op_t *op = ring.recvs; op != NULL; op = op->next)
+    {
+        // 取消仍在等待的 recvmsg，已完成的返回 -ENOENT
+        struct io_uring_sqe *sqe = get_sqe();
+        if (sqe != NULL)
+        {
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->fd = -1;
+            sqe->addr = (uint64_t)(uintptr_t)op;
+            sqe->user_data = 0;
+        }
+        if (ev_io_start(op->fallback) != 0)
+        {
+            LOG("failed to receive from socket %d", op->op.sock);
+        }
+    }
+}
+
+
+/*
+ * @func  recv_arm()
+ * @desc  queue multishot recvmsg
+ */
+static int recv_arm(recv_op_t *op)
+{
+    struct io_uring_sqe *sqe = get_sqe();
+    if (sqe == NULL)
+    {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = op->op.sock;
+    sqe->addr = (uint64_t)(uintptr_t)&(op->op.mh);
+    sqe->len = 1;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = BUF_GROUP;
+    sqe->user_data = (uint64_t)(uintptr_t)op;
+    return 0;
+}
+
+
+/*
+ * @func  uring_recv()
+ * @desc  keep receiving datagrams from UDP socket with multishot recvmsg
+ */
+int uring_recv(int sock,
+               void (*cb)(void *data, int sock, void *msg, int msglen,
+                          const struct sockaddr *addr, socklen_t addrlen),
+               void *data, ev_io *fallback)
+{
+    recv_op_t *op = (recv_op_t *)malloc(sizeof(recv_op_t));
+    if (op == NULL)
+    {
+        LOG("out of memory");
+        return -1;
+    }
+    bzero(op, sizeof(recv_op_t));
+    op->op.opcode = IORING_OP_RECVMSG;
+    op->op.sock = sock;
+    op->op.mh.msg_namelen = sizeof(struct sockaddr_storage);
+    op->cb = cb;
+    op->data = data;
+    op->fallback = fallback;
+    if (recv_arm(op) != 0)
+    {
+        free(op);
+        return -1;
+    }
+    op->next = ring.recvs;
+    ring.recvs = op;
+    return 0;
+}
+
+
+/*
+ * @func  uring_sendto()
+ * @desc  send datagram asynchronously, msg is copied
+ */
+int uring_sendto(int sock, const void *msg, int msglen,
+                 const struct sockaddr *addr, socklen_t addrlen)
+{
+    if (msglen > NS_PACKETSZ)
+    {
+        LOG("message too long");
+        return -1;
+    }
+    send_op_t *op = (send_op_t *)pool_alloc(&send_pool);
+    if (op == NULL)
+    {
+        return -1;
+    }
+    struct io_uring_sqe *sqe = get_sqe();
+    if (sqe == NULL)
+    {
+        pool_free(&send_pool, op);
+        return -1;
+    }
+    memcpy(op->msg, msg, msglen);
+    memcpy(&(op->addr), addr, addrlen);
+    op->iov.iov_base = op->msg;
+    op->iov.iov_len = msglen;
+    bzero(&(op->op.mh), sizeof(struct msghdr));
+    op->op.mh.msg_name = &(op->addr);
+    op->op.mh.msg_namelen = addrlen;
+    op->op.mh.msg_iov = &(op->iov);
+    op->op.mh.msg_iovlen = 1;
+    op->op.opcode = IORING_OP_SENDMSG;
+    op->op.sock = sock;
+
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = sock;
+    sqe->addr = (uint64_t)(uintptr_t)&(op->op.mh);
+    sqe->len = 1;
+    sqe->user_data = (uint64_t)(uintptr_t)op;
+    return 0;
+}
+
+
+/*
+ * @func  recv_complete()
+ * @desc  handle completion of multishot recvmsg
+ */
+static void recv_complete(recv_op_t *op, int res, unsigned flags)
+{
+    if (flags & IORING_CQE_F_BUFFER)
+    {
+        unsigned short bid = (unsigned short)(flags >> IORING_CQE_BUFFER_SHIFT);
+        uint8_t *buf = ring.bufs + (size_t)bid * BUF_SIZE;
+        struct io_uring_recvmsg_out *out = (struct io_uring_recvmsg_out *)buf;
+        size_t hdrlen = sizeof(struct io_uring_recvmsg_out) + op->op.mh.msg_namelen;
+        if ((res >= (int)hdrlen) && (out->payloadlen > 0))
+        {
+            int msglen = res - (int)hdrlen;
+            if ((unsigned)msglen > out->payloadlen)
+            {
+                msglen = (int)out->payloadlen;
+            }
+            socklen_t addrlen = out->namelen;
+            if (addrlen > op->op.mh.msg_namelen)
+            {
+                addrlen = op->op.mh.msg_namelen;
+            }
+            (op->cb)(op->data, op->op.sock, buf + hdrlen, msglen,
+                     (struct sockaddr *)(buf + sizeof(struct io_uring_recvmsg_out)),
+                     addrlen);
+        }
+        buf_recycle(bid);
+    }
+    else if ((res < 0) && (res != -ENOBUFS) && !ring.failed)
+    {
+        errno = -res;
+        ERROR("recvmsg");
+    }
+
+    if (!(flags & IORING_CQE_F_MORE) && (ring.fd >= 0) && !ring.failed)
+    {
+        // multishot 因 buffer 用完等原因结束，重新提交；
+        // 其他错误重新提交也会立即失败，改用 socket 的 watcher
+        if (((res < 0) && (res != -ENOBUFS)) || (recv_arm(op) != 0))
+        {
+            uring_fail();
+        }
+    }
+}
+
+
+/*
+ * @func  uring_cb()
+ * @desc  handle completion events
+ */
+static void uring_cb(ev_io *w)
+{
+    (void)w;
+
+    for (;;)
+    {
+        unsigned head = *ring.cq_head;
+        unsigned tail = LOAD(*ring.cq_tail);
+        if (head == tail)
+        {
+            if (LOAD(*ring.sq_flags) & IORING_SQ_CQ_OVERFLOW)
+            {
+                // 取回溢出的完成事件
+                io_uring_enter(ring.fd, 0, 0, IORING_ENTER_GETEVENTS);
+                continue;
+            }
+            break;
+        }
+        for (; head != tail; head++)
+        {
+            struct io_uring_cqe *cqe = &(ring.cqes[head & ring.cq_mask]);
+            op_t *op = (op_t *)(uintptr_t)(cqe->user_data);
+            int res = cqe->res;
+            unsigned flags = cqe->flags;
+            STORE(*ring.cq_head, head + 1);
+
+            if (op == NULL)
+            {
+                // IORING_OP_ASYNC_CANCEL
+                continue;
+            }
+            if (op->opcode == IORING_OP_RECVMSG)
+            {
+                recv_complete((recv_op_t *)op, res, flags);
+            }
+            else
+            {
+                if (res < 0)
+                {
+                    errno = -res;
+                    ERROR("sendmsg");
+                }
+                pool_free(&send_pool, op);
+            }
+        }
+    }
+}
+
+
+/*
+ * @func  prepare_cb()
+ * @desc  submit queued SQEs before polling
+ */
+static void prepare_cb(ev_prepare *w)
+{
+    (void)w;
+    submit();
+}
+
+
+#else
+
+
+/*
+ * io_uring 不可用，dnsmsg.c 使用 recvfrom()/sendto()
+ */
+int uring_init(void)
+{
+    return -1;
+}
+
+void uring_exit(void)
+{
+}
+
+int uring_enabled(void)
+{
+    return 0;
+}
+
+int uring_recv(int sock,
+               void (*cb)(void *data, int sock, void *msg, int msglen,
+                          const struct sockaddr *addr, socklen_t addrlen),
+               void *data, ev_io *fallback)
+{
+    (void)sock;
+    (void)cb;
+    (void)data;
+    (void)fallback;
+    return -1;
+}
+
+int uring_sendto(int sock, const void *msg, int msglen,
+                 const struct sockaddr *addr, socklen_t addrlen)
+{
+    (void)sock;
+    (void)msg;
+    (void)msglen;
+    (void)addr;
+    (void)addrlen;
+    return -1;
+}
+
+
+#endif
@@ -0,0 +1,82 @@
+/*
+ * uring.h - io_uring engine for UDP sockets
+ *
+ * Copyright (C) 2014 - 2015, Xiaoxiao <i@xiaoxiao.im>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef URING_H
+#define URING_H
+
+#ifdef __MINGW32__
+#  include "win.h"
+#else
+#  include <sys/socket.h>
+#endif
+
+#include "event.h"
+
+
+/*
+ * @func  uring_init()
+ * @desc  set up io_uring of current thread, call it after ev_init()
+ * @ret   0 - if succeed
+ *        -1 - if io_uring is not available, use recvfrom()/sendto() instead
+ */
+extern int uring_init(void);
+
+
+/*
+ * @func  uring_exit()
+ * @desc  tear down io_uring of current thread
+ */
+extern void uring_exit(void);
+
+
+/*
+ * @func  uring_enabled()
+ * @desc  is io_uring of current thread set up
+ */
+extern int uring_enabled(void);
+
+
+/*
+ * @func  uring_recv()
+ * @desc  keep receiving datagrams from UDP socket with multishot recvmsg
+ * @param sock     - UDP socket
+ *        cb       - callback for every datagram, msg is only valid in callback
+ *        data     - additional data passed to cb
+ *        fallback - watcher of sock, started if io_uring fails later
+ * @ret   0 - if succeed
+ *        -1 - if failed
+ */
+extern int uring_recv(int sock,
+                      void (*cb)(void *data, int sock, void *msg, int msglen,
+                                 const struct sockaddr *addr, socklen_t addrlen),
+                      void *data, ev_io *fallback);
+
+
+/*
+ * @func  uring_sendto()
+ * @desc  send datagram asynchronously, msg is copied
+ * @memo  queued sends are submitted in one syscall every loop iteration
+ * @ret   0 - if succeed
+ *        -1 - if failed
+ */
+extern int uring_sendto(int sock, const void *msg, int msglen,
+                        const struct sockaddr *addr, socklen_t addrlen);
+
+
+#endif // URING_H
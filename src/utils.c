@@ -17,9 +17,14 @@
  * along with this program. If not, see <http://www.gnu.org/licenses/>.
  */
 
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/time.h>
 #include <time.h>
 
@@ -32,28 +37,262 @@
 #  include <grp.h>
 #  include <pwd.h>
 #  include <netdb.h>
-#  include <string.h>
 #  include <sys/socket.h>
 #  include <sys/stat.h>
 #  include <unistd.h>
 #endif
 
+#if defined(HAVE_GETRANDOM) && defined(HAVE_SYS_RANDOM_H)
+#  include <sys/random.h>
+#endif
+
+#include "event.h"
 #include "utils.h"
 
 
+/*
+ * @var  chacha
+ * @desc ChaCha20 state of current thread, rekeyed from kernel every
+ *       CHACHA_REKEY blocks
+ */
+#define CHACHA_REKEY 16384
+static THREAD_LOCAL struct
+{
+    uint32_t state[16];
+    uint32_t block[16];
+    int used;
+    int blocks;
+} chacha;
+
+
+#define ROTL(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+#define QR(a, b, c, d) \
+    do \
+    { \
+        a += b; d ^= a; d = ROTL(d, 16); \
+        c += d; b ^= c; b = ROTL(b, 12); \
+        a += b; d ^= a; d = ROTL(d, 8); \
+        c += d; b ^= c; b = ROTL(b, 7); \
+    } while (0)
+
+
+/*
+ * @func  chacha_block()
+ * @desc  generate next 64 bytes of ChaCha20 keystream
+ */
+static void chacha_block(void)
+{
+    uint32_t *x = chacha.block;
+
+    memcpy(x, chacha.state, sizeof(chacha.state));
+    for (int i = 0; i < 10; i++)
+    {
+        QR(x[0], x[4], x[8], x[12]);
+        QR(x[1], x[5], x[9], x[13]);
+        QR(x[2], x[6], x[10], x[14]);
+        QR(x[3], x[7], x[11], x[15]);
+        QR(x[0], x[5], x[10], x[15]);
+        QR(x[1], x[6], x[11], x[12]);
+        QR(x[2], x[7], x[8], x[13]);
+        QR(x[3], x[4], x[9], x[14]);
+    }
+    for (int i = 0; i < 16; i++)
+    {
+        x[i] += chacha.state[i];
+    }
+    if (++chacha.state[12] == 0)
+    {
+        chacha.state[13]++;
+    }
+    chacha.used = 0;
+    chacha.blocks++;
+}
+
+
+/*
+ * @func  chacha_seed()
+ * @desc  set key and nonce from kernel entropy
+ */
+static void chacha_seed(void)
+{
+    uint32_t seed[12];
+    int ok = 0;
+
+#if defined(HAVE_GETRANDOM) && defined(HAVE_SYS_RANDOM_H)
+    ok = (getrandom(seed, sizeof(seed), 0) == (ssize_t)sizeof(seed));
+#endif
+#ifndef __MINGW32__
+    if (!ok)
+    {
+        FILE *f = fopen("/dev/urandom", "rb");
+        if (f != NULL)
+        {
+            ok = (fread(seed, sizeof(seed), 1, f) == 1);
+            fclose(f);
+        }
+    }
+#endif
+    if (!ok)
+    {
+        // 没有熵源时退化为时间种子
+        struct timeval tv;
+        gettimeofday(&tv, NULL);
+        for (int i = 0; i < 12; i++)
+        {
+            seed[i] = (uint32_t)tv.tv_usec * 2654435761U + (uint32_t)tv.tv_sec + i;
+        }
+    }
+
+    // "expand 32-byte k"
+    chacha.state[0] = 0x61707865;
+    chacha.state[1] = 0x3320646e;
+    chacha.state[2] = 0x79622d32;
+    chacha.state[3] = 0x6b206574;
+    memcpy(&chacha.state[4], seed, sizeof(seed));
+    chacha.blocks = 0;
+    chacha_block();
+}
+
+
+/*
+ * @func rand_uint32()
+ * @desc computes a cryptographically secure random uint32
+ */
+static uint32_t rand_uint32(void)
+{
+    if ((chacha.blocks == 0) || (chacha.blocks >= CHACHA_REKEY))
+    {
+        chacha_seed();
+    }
+    else if (chacha.used >= 16)
+    {
+        chacha_block();
+    }
+    return chacha.block[chacha.used++];
+}
+
+
 /*
  * @func rand_uint16()
- * @desc computes a pseudo-random uint16
+ * @desc computes a cryptographically secure random uint16
  */
 uint16_t rand_uint16(void)
 {
-    static int n = 0;
-    if (n == 0)
+    return (uint16_t)(rand_uint32() & 0xffff);
+}
+
+
+/*
+ * @func  rand_uniform()
+ * @desc  computes a cryptographically secure random number in [0, upper)
+ */
+uint32_t rand_uniform(uint32_t upper)
+{
+    // 拒绝采样，避免取模偏差
+    uint32_t min = (uint32_t)(-upper) % upper;
+    uint32_t r;
+    do
+    {
+        r = rand_uint32();
+    } while (r < min);
+    return r % upper;
+}
+
+
+/*
+ * @var  sipkey
+ * @desc key of hash_mem(), shared by all threads
+ */
+static uint64_t sipkey[2];
+
+
+/*
+ * @func hash_seed()
+ * @desc randomize key of hash_mem()
+ */
+void hash_seed(void)
+{
+    sipkey[0] = ((uint64_t)rand_uint32() << 32) | rand_uint32();
+    sipkey[1] = ((uint64_t)rand_uint32() << 32) | rand_uint32();
+}
+
+
+/*
+ * @func lower8()
+ * @desc convert ASCII letters in 8 bytes to lower case
+ */
+static uint64_t lower8(uint64_t w)
+{
+    const uint64_t ones = 0x0101010101010101ULL;
+    uint64_t b = w & (ones * 0x7f);
+    // 字节在 'A' 到 'Z' 之间且最高位为 0 时，mask 对应字节为 0x80
+    uint64_t mask = (b + ones * (0x80 - 'A')) & ~(b + ones * (0x80 - 'Z' - 1))
+                    & ~w & (ones * 0x80);
+    return w | (mask >> 2);
+}
+
+
+#define ROTL64(x, b) (((x) << (b)) | ((x) >> (64 - (b))))
+#define SIPROUND do { \
+    v0 += v1; v1 = ROTL64(v1, 13); v1 ^= v0; v0 = ROTL64(v0, 32); \
+    v2 += v3; v3 = ROTL64(v3, 16); v3 ^= v2; \
+    v0 += v3; v3 = ROTL64(v3, 21); v3 ^= v0; \
+    v2 += v1; v1 = ROTL64(v1, 17); v1 ^= v2; v2 = ROTL64(v2, 32); \
+} while (0)
+
+
+/*
+ * @func  hash_mem()
+ * @desc  SipHash-1-3 of part of domain name and an extra value
+ * @memo  8 bytes are processed at a time
+ */
+uint64_t hash_mem(const char *name, size_t len, uint64_t extra)
+{
+    uint64_t v0 = sipkey[0] ^ 0x736f6d6570736575ULL;
+    uint64_t v1 = sipkey[1] ^ 0x646f72616e646f6dULL;
+    uint64_t v2 = sipkey[0] ^ 0x6c7967656e657261ULL;
+    uint64_t v3 = sipkey[1] ^ 0x7465646279746573ULL;
+    uint64_t m;
+
+    const uint8_t *p = (const uint8_t *)name;
+    const uint8_t *end = p + (len & ~(size_t)7);
+    for (; p < end; p += 8)
     {
-        srand((unsigned)time(NULL));
-        n = 100;
+        memcpy(&m, p, 8);
+        m = lower8(m);
+        v3 ^= m;
+        SIPROUND;
+        v0 ^= m;
     }
-    return (uint16_t)(rand() & 0xffff);
+
+    // 剩余不足 8 字节，与长度一起组成最后一块
+    m = 0;
+    memcpy(&m, p, len & 7);
+    m = lower8(m) | ((uint64_t)len << 56);
+    v3 ^= m;
+    SIPROUND;
+    v0 ^= m;
+
+    m = extra;
+    v3 ^= m;
+    SIPROUND;
+    v0 ^= m;
+
+    v2 ^= 0xff;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    return v0 ^ v1 ^ v2 ^ v3;
+}
+
+
+/*
+ * @func  hash_name()
+ * @desc  keyed hash of domain name and an extra value
+ */
+uint64_t hash_name(const char *name, uint64_t extra)
+{
+    return hash_mem(name, strlen(name), extra);
 }
 
 
@@ -120,6 +359,23 @@ int setreuseaddr(int fd)
 }
 
 
+/*
+ * @func setreuseport()
+ * @desc set SO_REUSEPORT of socket
+ */
+#ifdef SO_REUSEPORT
+int setreuseport(int fd)
+{
+    int reuseport = 1;
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &reuseport, sizeof(int)) != 0)
+    {
+        return -1;
+    }
+    return 0;
+}
+#endif
+
+
 /*
  * @func setkeepalive()
  * @desc set SO_KEEPALIVE of socket
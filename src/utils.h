@@ -20,16 +20,54 @@
 #ifndef UTILS_H
 #define UTILS_H
 
+#include <stddef.h>
 #include <stdint.h>
 
 
 /*
  * @func rand_uint16()
- * @desc computes a pseudo-random uint16
+ * @desc computes a cryptographically secure random uint16
  */
 extern uint16_t rand_uint16(void);
 
 
+/*
+ * @func  rand_uniform()
+ * @desc  computes a cryptographically secure random number, uniformly
+ *        distributed in [0, upper)
+ * @param upper - upper bound, greater than 0
+ */
+extern uint32_t rand_uniform(uint32_t upper);
+
+
+/*
+ * @func  hash_seed()
+ * @desc  randomize key of hash_mem() and hash_name(), so that collisions
+ *        can not be predicted by others
+ * @memo  call it once before starting threads
+ */
+extern void hash_seed(void);
+
+
+/*
+ * @func  hash_mem()
+ * @desc  keyed hash of part of domain name, ASCII case insensitive
+ * @param name  - domain name, or a label of it
+ *        len   - length of name
+ *        extra - extra value hashed with name
+ */
+extern uint64_t hash_mem(const char *name, size_t len, uint64_t extra);
+
+
+/*
+ * @func  hash_name()
+ * @desc  keyed hash of domain name, ASCII case insensitive
+ * @param name  - domain name
+ *        extra - extra value hashed with name, e.g. query type
+ */
+extern uint64_t hash_name(const char *name, uint64_t extra);
+
+
 /*
  * @func setnonblock()
  * @desc set fd in nonblock mode
@@ -51,6 +89,15 @@ extern int settimeout(int fd);
 extern int setreuseaddr(int fd);
 
 
+/*
+ * @func setreuseport()
+ * @desc set SO_REUSEPORT of socket
+ */
+#ifdef SO_REUSEPORT
+extern int setreuseport(int fd);
+#endif
+
+
 /*
  * @func setkeepalive()
  * @desc set SO_KEEPALIVE of socket
@@ -0,0 +1,735 @@
+/*
+ * verdict.c - pollution verdicts shared by all workers
+ *
+ * Copyright (C) 2014 - 2015, Xiaoxiao <i@xiaoxiao.im>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#ifdef HAVE_SYS_MMAN_H
+#  include <sys/mman.h>
+#endif
+
+#if defined(HAVE_PTHREAD_H) && !defined(__MINGW32__)
+#  define USE_THREAD
+#  include <pthread.h>
+#endif
+
+#include "dtable.h"
+#include "event.h"
+#include "log.h"
+#include "utils.h"
+#include "verdict.h"
+
+
+/*
+ * 读者不加锁 (RCU)：条目发布后不再修改，写者用 release 语义替换或摘除链表
+ * 节点，被摘除的节点等所有读者都经过一次静止状态 (quiescent state，即事件
+ * 循环的一次回调之间) 后才释放。写者之间用互斥锁串行化。
+ */
+#define LOAD(p) __atomic_load_n(&(p), __ATOMIC_ACQUIRE)
+#define STORE(p, v) __atomic_store_n(&(p), (v), __ATOMIC_RELEASE)
+
+#ifdef USE_THREAD
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+#  define LOCK() pthread_mutex_lock(&lock)
+#  define TRYLOCK() (pthread_mutex_trylock(&lock) == 0)
+#  define UNLOCK() pthread_mutex_unlock(&lock)
+#else
+#  define LOCK()
+#  define TRYLOCK() 1
+#  define UNLOCK()
+#endif
+
+
+/*
+ * @type node_t
+ * @desc a label in trie of domain names, whose root is the empty name, and
+ *       children of "com" are like "example" of "example.com"
+ * @memo children are found through the hash table by (parent, label), so
+ *       a node of any width costs one probe. label and parent never change
+ *       once published, value is updated atomically
+ */
+typedef struct node_t
+{
+    struct node_t *next;        // next item in bucket
+    struct node_t *retired;     // next item of retired list
+    struct node_t *parent;      // NULL for top level labels
+    uint64_t epoch;             // epoch when retired
+    uint64_t value;             // expire << 1 | blocked, 0 if no verdict
+    uint32_t hash;
+    int nkids;                  // count of children, protected by lock
+    uint8_t len;
+    char label[];
+} node_t;
+
+
+/*
+ * @type reader_t
+ * @desc registered reader thread
+ */
+typedef struct reader_t
+{
+    uint64_t epoch;             // epoch seen at last quiescent state, 0 if offline
+    struct reader_t *next;
+} reader_t;
+
+
+/*
+ * @var  buckets
+ * @desc hash table of trie nodes
+ */
+#define BUCKETS 65536
+static node_t *buckets[BUCKETS];
+
+
+/*
+ * @var  epoch
+ * @desc increased every time an item is retired
+ */
+static uint64_t epoch = 1;
+
+
+/*
+ * @var  retired
+ * @desc items removed from hash table but not freed yet, protected by lock
+ */
+static node_t *retired;
+static int retired_cnt;
+
+
+/*
+ * @var  readers
+ * @desc registered readers, protected by lock
+ */
+static reader_t *readers;
+
+
+/*
+ * @var  self
+ * @desc reader of current thread
+ */
+static THREAD_LOCAL reader_t *self;
+
+
+/*
+ * @var  timer
+ * @desc timer to report quiescent state and expire verdicts
+ */
+static THREAD_LOCAL ev_timer timer;
+
+
+/*
+ * @type snapshot_t
+ * @desc header of snapshot file, followed by index of count entries,
+ *       padded to 8 bytes, and blob of size bytes
+ * @memo the file is a dtable_t with 8 bytes value of expire << 1 | blocked,
+ *       expire is in wall clock time
+ */
+#define SNAPSHOT_MAGIC "sansvd1"
+typedef struct
+{
+    char magic[8];
+    uint32_t order;             // 0x01020304 in byte order of writer
+    uint32_t count;
+    uint64_t size;
+    uint64_t saved;             // time when written
+} snapshot_t;
+
+
+/*
+ * @var  snapshot
+ * @desc verdicts loaded from snapshot file, read only after loading
+ */
+static dtable_t snapshot = {NULL, 0, 0, NULL, 0, sizeof(uint64_t)};
+
+
+/*
+ * @var  sweep_pos
+ * @desc next bucket to check for expired verdicts, protected by lock
+ */
+#define SWEEP_BUCKETS 1024
+static int sweep_pos;
+
+
+static void verdict_tick(ev_timer *w);
+
+
+/*
+ * @func hash()
+ * @desc keyed hash of label and its parent
+ */
+static uint32_t hash(const char *label, size_t len, const node_t *parent)
+{
+    return (uint32_t)hash_mem(label, len, (uint64_t)(uintptr_t)parent);
+}
+
+
+/*
+ * @func  child()
+ * @desc  find child node of parent
+ * @param label - label of child, not '\0' terminated
+ *        len   - length of label
+ */
+static node_t *child(const node_t *parent, const char *label, size_t len)
+{
+    uint32_t h = hash(label, len, parent);
+    for (node_t *node = LOAD(buckets[h % BUCKETS]); node != NULL; node = LOAD(node->next))
+    {
+        if ((node->hash == h) && (node->parent == parent) && (node->len == len)
+            && (memcmp(node->label, label, len) == 0))
+        {
+            return node;
+        }
+    }
+    return NULL;
+}
+
+
+/*
+ * @func  prev_label()
+ * @desc  find label before end in name
+ * @ret   start of label, or NULL if there is no more label
+ */
+static const char *prev_label(const char *name, const char *end)
+{
+    if (end <= name)
+    {
+        return NULL;
+    }
+    const char *start = end;
+    while ((start > name) && (*(start - 1) != '.'))
+    {
+        start--;
+    }
+    return start;
+}
+
+
+/*
+ * @func  verdict_thread_init()
+ * @desc  register current thread as a reader
+ */
+int verdict_thread_init(void)
+{
+    reader_t *reader = (reader_t *)malloc(sizeof(reader_t));
+    if (reader == NULL)
+    {
+        LOG("out of memory");
+        return -1;
+    }
+    LOCK();
+    reader->epoch = LOAD(epoch);
+    reader->next = readers;
+    readers = reader;
+    UNLOCK();
+    self = reader;
+
+    ev_timer_init(&timer, verdict_tick, 1000, 1000);
+    ev_timer_start(&timer);
+    return 0;
+}
+
+
+/*
+ * @func  verdict_thread_exit()
+ * @desc  unregister current thread
+ */
+void verdict_thread_exit(void)
+{
+    if (self == NULL)
+    {
+        return;
+    }
+    ev_timer_stop(&timer);
+    LOCK();
+    for (reader_t **p = &readers; *p != NULL; p = &((*p)->next))
+    {
+        if (*p == self)
+        {
+            *p = self->next;
+            break;
+        }
+    }
+    UNLOCK();
+    free(self);
+    self = NULL;
+}
+
+
+/*
+ * @func  reclaim()
+ * @desc  free retired items which no reader can see, call with lock held
+ */
+static void reclaim(void)
+{
+    uint64_t min = LOAD(epoch);
+    for (reader_t *reader = readers; reader != NULL; reader = reader->next)
+    {
+        uint64_t e = LOAD(reader->epoch);
+        if ((e != 0) && (e < min))
+        {
+            min = e;
+        }
+    }
+
+    // 读者在 epoch 增加之后经过静止状态，就不会再引用之前摘除的节点
+    node_t **p = &retired;
+    while (*p != NULL)
+    {
+        node_t *node = *p;
+        if (node->epoch < min)
+        {
+            *p = node->retired;
+            STORE(retired_cnt, retired_cnt - 1);
+            free(node);
+        }
+        else
+        {
+            p = &(node->retired);
+        }
+    }
+}
+
+
+/*
+ * @func  retire()
+ * @desc  free node later, after it is unlinked, call with lock held
+ */
+static void retire(node_t *node)
+{
+    node->epoch = __atomic_fetch_add(&epoch, 1, __ATOMIC_ACQ_REL);
+    node->retired = retired;
+    retired = node;
+    STORE(retired_cnt, retired_cnt + 1);
+}
+
+
+/*
+ * @func  verdict_quiescent()
+ * @desc  report that current thread holds no verdict references
+ */
+void verdict_quiescent(void)
+{
+    if (self != NULL)
+    {
+        STORE(self->epoch, LOAD(epoch));
+    }
+    if ((LOAD(retired_cnt) > 0) && TRYLOCK())
+    {
+        reclaim();
+        UNLOCK();
+    }
+}
+
+
+/*
+ * @func  verdict_search()
+ * @desc  search verdict of domain, lock free
+ * @param name - domain name
+ * @ret   1 - blocked
+ *        0 - not blocked
+ *        -1 - unknown
+ * @memo  verdict of the longest suffix of name is used, verdicts of
+ *        snapshot are used only if there is none in hash table
+ */
+int verdict_search(const char *name)
+{
+    uint64_t now = (uint64_t)time(NULL);
+    int blocked = -1;
+
+    // 从最后一个 label 开始，沿 trie 向下走，一次遍历找到最长后缀
+    node_t *node = NULL;
+    const char *end = name + strlen(name);
+    const char *start;
+    while ((start = prev_label(name, end)) != NULL)
+    {
+        node = child(node, start, end - start);
+        if (node == NULL)
+        {
+            break;
+        }
+        uint64_t value = LOAD(node->value);
+        if ((value >> 1) > now)
+        {
+            blocked = (int)(value & 1);
+        }
+        end = start - 1;
+    }
+
+    // 运行中没有结论的，使用上次保存的结论
+    if ((blocked < 0) && (snapshot.count > 0))
+    {
+        uint32_t match[DTABLE_MAX_MATCH];
+        for (int i = dtable_match(&snapshot, name, match) - 1; i >= 0; i--)
+        {
+            uint64_t value;
+            memcpy(&value, DTABLE_VALUE(&snapshot, match[i]), sizeof(value));
+            if ((value >> 1) > now)
+            {
+                blocked = (int)(value & 1);
+                break;
+            }
+        }
+    }
+    return blocked;
+}
+
+
+/*
+ * @func  verdict_insert()
+ * @desc  insert or replace verdict of domain and its subdomains
+ * @param name    - domain name
+ *        blocked - blocked or not
+ */
+int verdict_insert(const char *name, int blocked)
+{
+    uint64_t value = (((uint64_t)time(NULL) + VERDICT_TTL) << 1) | (blocked ? 1 : 0);
+    node_t *node = NULL;
+    const char *end = name + strlen(name);
+    const char *start;
+
+    LOCK();
+    while ((start = prev_label(name, end)) != NULL)
+    {
+        size_t len = end - start;
+        if ((len == 0) || (len > 63))
+        {
+            UNLOCK();
+            return -1;
+        }
+        node_t *next = child(node, start, len);
+        if (next == NULL)
+        {
+            next = (node_t *)malloc(sizeof(node_t) + len);
+            if (next == NULL)
+            {
+                UNLOCK();
+                LOG("out of memory");
+                return -1;
+            }
+            next->retired = NULL;
+            next->parent = node;
+            next->epoch = 0;
+            next->value = 0;
+            next->hash = hash(start, len, node);
+            next->nkids = 0;
+            next->len = (uint8_t)len;
+            memcpy(next->label, start, len);
+            next->next = LOAD(buckets[next->hash % BUCKETS]);
+            STORE(buckets[next->hash % BUCKETS], next);
+            if (node != NULL)
+            {
+                node->nkids++;
+            }
+        }
+        node = next;
+        end = start - 1;
+    }
+    if (node != NULL)
+    {
+        STORE(node->value, value);
+    }
+    UNLOCK();
+    return (node != NULL) ? 0 : -1;
+}
+
+
+/*
+ * @func  sweep()
+ * @desc  remove expired verdicts in part of hash table, and nodes without
+ *        verdict or children, call with lock held
+ * @memo  a parent emptied this way is removed when its bucket is swept
+ */
+static void sweep(void)
+{
+    uint64_t now = (uint64_t)time(NULL);
+    for (int i = 0; i < SWEEP_BUCKETS; i++)
+    {
+        node_t **p = &(buckets[sweep_pos]);
+        while (*p != NULL)
+        {
+            node_t *node = *p;
+            if ((node->value != 0) && ((node->value >> 1) <= now))
+            {
+                STORE(node->value, 0);
+            }
+            if ((node->value == 0) && (node->nkids == 0))
+            {
+                STORE(*p, node->next);
+                if (node->parent != NULL)
+                {
+                    node->parent->nkids--;
+                }
+                retire(node);
+            }
+            else
+            {
+                p = &(node->next);
+            }
+        }
+        sweep_pos = (sweep_pos + 1) % BUCKETS;
+    }
+}
+
+
+/*
+ * @func  verdict_tick()
+ * @desc  report quiescent state, expire verdicts
+ */
+static void verdict_tick(ev_timer *w)
+{
+    (void)w;
+
+    // 在事件循环的回调中，不持有任何条目
+    verdict_quiescent();
+    if (TRYLOCK())
+    {
+        sweep();
+        UNLOCK();
+    }
+}
+
+
+/*
+ * @func  verdict_load()
+ * @desc  load verdicts saved by verdict_save()
+ * @memo  the file is mapped and searched in place, entries are not parsed
+ */
+int verdict_load(const char *path, size_t *count)
+{
+    *count = 0;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        // 第一次运行，还没有快照
+        if (errno == ENOENT)
+        {
+            return 0;
+        }
+        ERROR(path);
+        return -1;
+    }
+    struct stat st;
+    if ((fstat(fd, &st) != 0) || (st.st_size < (off_t)sizeof(snapshot_t))
+        || ((uint64_t)st.st_size > SIZE_MAX))
+    {
+        close(fd);
+        LOG("bad snapshot: %s", path);
+        return -1;
+    }
+    size_t len = (size_t)st.st_size;
+#ifdef HAVE_SYS_MMAN_H
+    void *map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED)
+    {
+        close(fd);
+        ERROR("mmap");
+        return -1;
+    }
+#else
+    void *map = malloc(len);
+    if ((map == NULL) || (read(fd, map, len) != (ssize_t)len))
+    {
+        free(map);
+        close(fd);
+        LOG("failed to read snapshot: %s", path);
+        return -1;
+    }
+#endif
+    close(fd);
+
+    // 检查文件头和长度，条目无需逐个解析
+    // 先用文件长度限制 count 和 size，32 位系统上计算长度才不会溢出
+    const snapshot_t *hdr = (const snapshot_t *)map;
+    size_t avail = len - sizeof(snapshot_t);
+    size_t index_len = 0;
+    int ok = (memcmp(hdr->magic, SNAPSHOT_MAGIC, sizeof(hdr->magic)) == 0)
+             && (hdr->order == 0x01020304)
+             && (hdr->count <= avail / sizeof(uint32_t))
+             && (hdr->size <= avail)
+             && (hdr->size < UINT32_MAX);
+    if (ok)
+    {
+        index_len = ((size_t)hdr->count * sizeof(uint32_t) + 7) & ~(size_t)7;
+        ok = (index_len <= avail) && (hdr->size == avail - index_len);
+    }
+    char *blob = (char *)map + sizeof(snapshot_t) + index_len;
+    const uint32_t *index = (const uint32_t *)((const char *)map + sizeof(snapshot_t));
+    ok = ok && ((hdr->count == 0) || (blob[hdr->size - 1] == '\0'));
+    for (uint32_t i = 0; ok && (i < hdr->count); i++)
+    {
+        ok = ((uint64_t)index[i] + sizeof(uint64_t) < hdr->size);
+    }
+    if (!ok)
+    {
+#ifdef HAVE_SYS_MMAN_H
+        munmap(map, len);
+#else
+        free(map);
+#endif
+        LOG("bad snapshot: %s", path);
+        return -1;
+    }
+
+    snapshot.blob = blob;
+    snapshot.size = hdr->size;
+    snapshot.cap = 0;
+    snapshot.index = index;
+    snapshot.count = hdr->count;
+    *count = hdr->count;
+    return 0;
+}
+
+
+/*
+ * @func  add_node()
+ * @desc  add verdict of node to table, call with lock held
+ */
+static int add_node(dtable_t *table, const node_t *node)
+{
+    // 从根到 node 拼出反转的域名
+    const node_t *path[NS_NAMESZ / 2];
+    int depth = 0;
+    size_t len = 0;
+    for (const node_t *p = node; p != NULL; p = p->parent)
+    {
+        if (depth >= (int)(sizeof(path) / sizeof(path[0])))
+        {
+            return 0;
+        }
+        path[depth++] = p;
+        len += p->len + 1;
+    }
+    if (len > NS_NAMESZ)
+    {
+        return 0;
+    }
+    char key[NS_NAMESZ];
+    char *k = key;
+    while (depth > 0)
+    {
+        const node_t *p = path[--depth];
+        memcpy(k, p->label, p->len);
+        k += p->len;
+        *k++ = (depth > 0) ? '.' : '\0';
+    }
+    return dtable_add_key(table, key, &(node->value));
+}
+
+
+/*
+ * @func  verdict_save()
+ * @desc  save unexpired verdicts to file
+ */
+int verdict_save(const char *path)
+{
+    uint64_t now = (uint64_t)time(NULL);
+    dtable_t table;
+    dtable_init(&table, sizeof(uint64_t));
+
+    // 新的结论在前，去重时保留
+    // 分段持锁，写者最多等待复制一段，排序和写文件都在锁外
+    int ret = 0;
+    int i = 0;
+    while ((ret == 0) && (i < BUCKETS))
+    {
+        LOCK();
+        for (int end = i + SWEEP_BUCKETS; (ret == 0) && (i < end); i++)
+        {
+            for (node_t *node = buckets[i]; (ret == 0) && (node != NULL); node = node->next)
+            {
+                if ((node->value >> 1) > now)
+                {
+                    ret = add_node(&table, node);
+                }
+            }
+        }
+        UNLOCK();
+    }
+    for (size_t j = 0; (ret == 0) && (j < snapshot.count); j++)
+    {
+        uint64_t value;
+        memcpy(&value, DTABLE_VALUE(&snapshot, snapshot.index[j]), sizeof(value));
+        if ((value >> 1) > now)
+        {
+            ret = dtable_add_key(&table, DTABLE_KEY(&snapshot, snapshot.index[j]), &value);
+        }
+    }
+    if ((ret != 0) || (dtable_build(&table) != 0))
+    {
+        dtable_free(&table);
+        return -1;
+    }
+
+    // 写入临时文件后改名，不会留下写了一半的快照
+    snapshot_t hdr;
+    bzero(&hdr, sizeof(hdr));
+    memcpy(hdr.magic, SNAPSHOT_MAGIC, sizeof(hdr.magic));
+    hdr.order = 0x01020304;
+    hdr.count = (uint32_t)table.count;
+    hdr.size = table.size;
+    hdr.saved = now;
+    static const char pad[8];
+    size_t pad_len = (8 - table.count * sizeof(uint32_t) % 8) % 8;
+
+    char tmp[PATH_MAX];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    FILE *f = fopen(tmp, "wb");
+    if (f == NULL)
+    {
+        ERROR(tmp);
+        dtable_free(&table);
+        return -1;
+    }
+    ret = ((fwrite(&hdr, sizeof(hdr), 1, f) != 1)
+           || (fwrite(table.index, sizeof(uint32_t), table.count, f) != table.count)
+           || (fwrite(pad, 1, pad_len, f) != pad_len)
+           || (fwrite(table.blob, 1, table.size, f) != table.size)) ? -1 : 0;
+#ifndef __MINGW32__
+    // 改名前落盘，否则断电后可能留下空的快照
+    if ((ret == 0) && ((fflush(f) != 0) || (fsync(fileno(f)) != 0)))
+    {
+        ret = -1;
+    }
+#endif
+    if (fclose(f) != 0)
+    {
+        ret = -1;
+    }
+    dtable_free(&table);
+    if ((ret != 0) || (rename(tmp, path) != 0))
+    {
+        ERROR(path);
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,106 @@
+/*
+ * verdict.h - pollution verdicts shared by all workers
+ *
+ * Copyright (C) 2014 - 2015, Xiaoxiao <i@xiaoxiao.im>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef VERDICT_H
+#define VERDICT_H
+
+#include <stddef.h>
+
+
+/*
+ * @desc time to keep a verdict, in seconds
+ */
+#define VERDICT_TTL 518400
+
+
+/*
+ * @desc interval to save verdicts, in seconds
+ */
+#define VERDICT_SAVE_INTERVAL 600
+
+
+/*
+ * @func  verdict_thread_init()
+ * @desc  register current thread as a reader
+ * @memo  the thread reports quiescent state from a timer of its event loop,
+ *        call it after ev_init()
+ */
+extern int verdict_thread_init(void);
+
+
+/*
+ * @func  verdict_thread_exit()
+ * @desc  unregister current thread
+ */
+extern void verdict_thread_exit(void);
+
+
+/*
+ * @func  verdict_quiescent()
+ * @desc  report that current thread holds no verdict references, so
+ *        retired items may be freed
+ */
+extern void verdict_quiescent(void);
+
+
+/*
+ * @func  verdict_search()
+ * @desc  search verdict of domain, lock free
+ * @param name - domain name
+ * @ret   1 - blocked
+ *        0 - not blocked
+ *        -1 - unknown
+ * @memo  verdict of the longest suffix of name is used, so a verdict of
+ *        "example.com" also applies to "www.example.com"
+ */
+extern int verdict_search(const char *name);
+
+
+/*
+ * @func  verdict_insert()
+ * @desc  insert or replace verdict of domain and its subdomains
+ * @param name    - domain name
+ *        blocked - blocked or not
+ */
+extern int verdict_insert(const char *name, int blocked);
+
+
+/*
+ * @func  verdict_load()
+ * @desc  load verdicts saved by verdict_save()
+ * @param path  - snapshot file
+ *        count - count of verdicts loaded
+ * @ret   0 if loaded or there is no such file, -1 on error
+ * @memo  call it before any reader thread is started, verdicts in hash
+ *        table override loaded ones
+ */
+extern int verdict_load(const char *path, size_t *count);
+
+
+/*
+ * @func  verdict_save()
+ * @desc  save unexpired verdicts, including loaded ones, to file
+ * @param path - snapshot file, replaced atomically
+ * @memo  it may be called from any thread, writers wait only while part
+ *        of the table is copied, readers are not blocked
+ */
+extern int verdict_save(const char *path);
+
+
+#endif // VERDICT_H
@@ -0,0 +1,123 @@
+/*
+ * bench_cache.c - benchmark of DNS cache
+ *
+ * Copyright (C) 2014 - 2015, Xiaoxiao <i@xiaoxiao.im>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "cache.h"
+#include "dns.h"
+#include "event.h"
+
+
+static uint64_t us(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+
+/*
+ * @func bench()
+ * @desc insert n names, then look up every one of them and n missing names
+ */
+static int bench(int n)
+{
+    uint8_t msg[64];
+    uint8_t buf[NS_PACKETSZ];
+    char name[32];
+    int failed = 0;
+
+    int msglen = ns_mkreply(msg, sizeof(msg), "www.example.com", ns_t_a,
+                            ns_r_noerror);
+
+    uint64_t t0 = us();
+    for (int i = 0; i < n; i++)
+    {
+        sprintf(name, "%d.example.com", i);
+        if (cache_insert(name, ns_t_a, msg, msglen, 3600) != 0)
+        {
+            failed = 1;
+        }
+    }
+    uint64_t t1 = us();
+    for (int i = 0; i < n; i++)
+    {
+        sprintf(name, "%d.example.com", (int)((i * 2654435761U) % n));
+        if (cache_search(name, ns_t_a, buf, sizeof(buf)) != msglen)
+        {
+            failed = 1;
+        }
+    }
+    uint64_t t2 = us();
+    for (int i = 0; i < n; i++)
+    {
+        sprintf(name, "%d.example.org", i);
+        if (cache_search(name, ns_t_a, buf, sizeof(buf)) >= 0)
+        {
+            failed = 1;
+        }
+    }
+    uint64_t t3 = us();
+    for (int i = 0; i < n; i++)
+    {
+        sprintf(name, "%d.example.com", i);
+        if (cache_delete(name, ns_t_a) != 0)
+        {
+            failed = 1;
+        }
+    }
+    uint64_t t4 = us();
+
+    printf("%8d items: insert %6.0f ns, hit %6.0f ns, miss %6.0f ns, "
+           "delete %6.0f ns\n", n,
+           (t1 - t0) * 1000.0 / n, (t2 - t1) * 1000.0 / n,
+           (t3 - t2) * 1000.0 / n, (t4 - t3) * 1000.0 / n);
+
+    size_t used;
+    cache_stat(&used, NULL);
+    if (used != 0)
+    {
+        failed = 1;
+    }
+    return failed;
+}
+
+
+int main(int argc, char **argv)
+{
+    if (ev_init() != 0)
+    {
+        return EXIT_FAILURE;
+    }
+    cache_set_limit((size_t)1 << 30);
+
+    // 默认不测 1M，避免 make check 占用太多内存和时间
+    int big = (argc > 1) && (strcmp(argv[1], "-f") == 0);
+    if ((bench(1000) != 0) || (bench(100000) != 0)
+        || (big && (bench(1000000) != 0)))
+    {
+        printf("bench failed\n");
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
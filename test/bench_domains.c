@@ -0,0 +1,159 @@
+/*
+ * bench_domains.c - benchmark of preloaded domain lists
+ *
+ * Copyright (C) 2014 - 2015, Xiaoxiao <i@xiaoxiao.im>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "domains.h"
+
+
+#define CHECK(expr) \
+    do \
+    { \
+        if (!(expr)) \
+        { \
+            printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #expr); \
+            failed = 1; \
+        } \
+    } while (0)
+
+static int failed;
+
+
+static uint64_t us(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+
+/*
+ * @func mklist()
+ * @desc write a list of n domains in mixed formats
+ */
+static int mklist(char *path, int n, const char *fmt, const char *extra)
+{
+    int fd = mkstemp(path);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    FILE *f = fdopen(fd, "w");
+    fprintf(f, "# comment\n[AutoProxy 0.2.9]\n!comment\n@@||exception.com\n");
+    fprintf(f, "|http://url.com/path\n*.wildcard.com\n%s\n", extra);
+    for (int i = 0; i < n; i++)
+    {
+        switch (i % 4)
+        {
+        case 0:
+            fprintf(f, fmt, "", i, "\n");
+            break;
+        case 1:
+            fprintf(f, fmt, "server=/", i, "/114.114.114.114\n");
+            break;
+        case 2:
+            fprintf(f, fmt, "||", i, "^\n");
+            break;
+        default:
+            fprintf(f, fmt, ".", i, "\n");
+            break;
+        }
+    }
+    fclose(f);
+    return 0;
+}
+
+
+int main(int argc, char **argv)
+{
+    int n = (argc > 1) ? atoi(argv[1]) : 100000;
+    char blocked_list[] = "/tmp/sans_blocked_XXXXXX";
+    char cn_list[] = "/tmp/sans_cn_XXXXXX";
+
+    if ((mklist(blocked_list, n, "%sblocked%d.com%s", "Both.NET") != 0)
+        || (mklist(cn_list, n, "%sdomestic%d.com.cn%s", "both.net\nopen.blocked1.com") != 0))
+    {
+        printf("failed to write lists\n");
+        return EXIT_FAILURE;
+    }
+
+    uint64_t t0 = us();
+    int r = domains_load(blocked_list, cn_list);
+    uint64_t t1 = us();
+    unlink(blocked_list);
+    unlink(cn_list);
+    if (r != 0)
+    {
+        printf("failed to load lists\n");
+        return EXIT_FAILURE;
+    }
+
+    size_t count, bytes;
+    domains_stat(&count, &bytes);
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    printf("%d + %d lines: %lu domains, %lu bytes, load %.1f ms, max RSS %ld KB\n",
+           n, n, (unsigned long)count, (unsigned long)bytes,
+           (t1 - t0) / 1000.0, ru.ru_maxrss);
+
+    CHECK(count == (size_t)n * 2 + 2);
+    CHECK(domains_search("blocked1.com") == 1);
+    CHECK(domains_search("www.blocked2.com") == 1);
+    CHECK(domains_search("a.b.blocked3.com") == 1);
+    CHECK(domains_search("open.blocked1.com") == 0);
+    CHECK(domains_search("x.open.blocked1.com") == 0);
+    CHECK(domains_search("domestic4.com.cn") == 0);
+    CHECK(domains_search("both.net") == 1);
+    CHECK(domains_search("xblocked1.com") == -1);
+    CHECK(domains_search("blocked1.com.example") == -1);
+    CHECK(domains_search("com") == -1);
+    CHECK(domains_search("exception.com") == -1);
+    CHECK(domains_search("wildcard.com") == -1);
+    CHECK(domains_search("url.com") == -1);
+
+    // 查找：一半命中，一半不在列表中
+    char name[64];
+    int hits = 0;
+    uint64_t t2 = us();
+    for (int i = 0; i < n; i++)
+    {
+        int k = (int)((i * 2654435761U) % n);
+        snprintf(name, sizeof(name), (i & 1) ? "www.blocked%d.com" : "www.unknown%d.com", k);
+        hits += (domains_search(name) == 1);
+    }
+    uint64_t t3 = us();
+    printf("lookup %.0f ns\n", (t3 - t2) * 1000.0 / n);
+    CHECK(hits == n / 2);
+
+    domains_free();
+    CHECK(domains_search("blocked1.com") == -1);
+
+    if (failed)
+    {
+        printf("bench failed\n");
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
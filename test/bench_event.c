@@ -0,0 +1,147 @@
+/*
+ * bench_event.c - benchmark of event loop dispatch
+ *
+ * Copyright (C) 2014 - 2015, Xiaoxiao <i@xiaoxiao.im>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "event.h"
+
+
+/*
+ * @type conn_t
+ * @desc fake connection, read a request then write a reply, like dnsmsg.c
+ */
+typedef struct
+{
+    int peer;
+    ev_io w_read;
+    ev_io w_write;
+} conn_t;
+
+
+static int conns;
+static int done;
+
+
+static void write_cb(ev_io *w)
+{
+    char c = 'r';
+    ev_io_stop(w);
+    if (write(w->fd, &c, 1) != 1)
+    {
+        perror("write");
+    }
+    if (++done == conns)
+    {
+        ev_stop();
+    }
+}
+
+
+static void read_cb(ev_io *w)
+{
+    conn_t *conn = (conn_t *)(w->data);
+    char c;
+    // callbacks change watchers, as every callback in dnsmsg.c does
+    ev_io_stop(w);
+    if (read(w->fd, &c, 1) != 1)
+    {
+        perror("read");
+    }
+    ev_io_start(&(conn->w_write));
+}
+
+
+int main(int argc, char **argv)
+{
+    conns = (argc > 1) ? atoi(argv[1]) : 500;
+    int rounds = (argc > 2) ? atoi(argv[2]) : 20;
+
+    if (ev_init() != 0)
+    {
+        return EXIT_FAILURE;
+    }
+    ev_set_limit(0);
+
+    conn_t *conn = (conn_t *)calloc(conns, sizeof(conn_t));
+    if (conn == NULL)
+    {
+        return EXIT_FAILURE;
+    }
+    for (int i = 0; i < conns; i++)
+    {
+        int fds[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0)
+        {
+            perror("socketpair");
+            return EXIT_FAILURE;
+        }
+        conn[i].peer = fds[1];
+        ev_io_init(&(conn[i].w_read), read_cb, fds[0], EV_READ);
+        ev_io_init(&(conn[i].w_write), write_cb, fds[0], EV_WRITE);
+        conn[i].w_read.data = &(conn[i]);
+        conn[i].w_write.data = &(conn[i]);
+    }
+
+    struct timeval t1, t2;
+    gettimeofday(&t1, NULL);
+    for (int r = 0; r < rounds; r++)
+    {
+        done = 0;
+        for (int i = 0; i < conns; i++)
+        {
+            char c = 'q';
+            ev_io_start(&(conn[i].w_read));
+            if (write(conn[i].peer, &c, 1) != 1)
+            {
+                perror("write");
+                return EXIT_FAILURE;
+            }
+        }
+        ev_run();
+        for (int i = 0; i < conns; i++)
+        {
+            char c;
+            if (read(conn[i].peer, &c, 1) != 1)
+            {
+                perror("read");
+                return EXIT_FAILURE;
+            }
+        }
+    }
+    gettimeofday(&t2, NULL);
+
+    unsigned long polls, events;
+    ev_stat(&polls, &events);
+    double us = 1000000.0 * (t2.tv_sec - t1.tv_sec) + t2.tv_usec - t1.tv_usec;
+    printf("connections: %d, rounds: %d\n", conns, rounds);
+    printf("wakeups: %lu, events: %lu, events per wakeup: %.1f\n",
+           polls, events, (double)events / polls);
+    printf("time per event: %.2f us\n", us / events);
+
+    if (events != 2UL * conns * rounds)
+    {
+        printf("lost events\n");
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
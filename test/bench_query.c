@@ -0,0 +1,156 @@
+/*
+ * bench_query.c - benchmark of in-flight query table
+ *
+ * Copyright (C) 2014 - 2015, Xiaoxiao <i@xiaoxiao.im>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "event.h"
+#include "query.h"
+
+
+#define LOOKUPS 1000000
+
+static uint16_t ids[65536];
+
+
+static double now_us(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return 1000000.0 * tv.tv_sec + tv.tv_usec;
+}
+
+
+/*
+ * @func bench()
+ * @desc add n queries, then look up, move and delete them
+ * @ret  0 - if every query is found
+ */
+static int bench(int n)
+{
+    for (int i = 0; i < n; i++)
+    {
+        query_t *query = query_new("www.example.com", NULL);
+        if (query == NULL)
+        {
+            return -1;
+        }
+        query->id = (uint16_t)i;
+        if (query_add(query) != 0)
+        {
+            query_free(query);
+            return -1;
+        }
+        ids[i] = query->id;
+    }
+
+    unsigned int seed = 1;
+    unsigned long found = 0;
+    double t1 = now_us();
+    for (int i = 0; i < LOOKUPS; i++)
+    {
+        query_t *query = query_search(ids[rand_r(&seed) % n]);
+        found += (query != NULL);
+    }
+    double t2 = now_us();
+    for (int i = 0; i < n; i++)
+    {
+        query_t *query = query_search(ids[i]);
+        query_newid(query);
+        ids[i] = query->id;
+    }
+    double t3 = now_us();
+    for (int i = 0; i < n; i++)
+    {
+        if (query_delete(ids[i]) != 0)
+        {
+            found = 0;
+        }
+    }
+    double t4 = now_us();
+
+    printf("in-flight: %5d, lookup: %.1f ns, new id: %.1f ns, delete: %.1f ns\n",
+           n, (t2 - t1) * 1000.0 / LOOKUPS, (t3 - t2) * 1000.0 / n,
+           (t4 - t3) * 1000.0 / n);
+    return (found == LOOKUPS) ? 0 : -1;
+}
+
+
+int main(void)
+{
+    if (ev_init() != 0)
+    {
+        return EXIT_FAILURE;
+    }
+    query_init(NULL);
+    printf("sizeof(query_t): %zu + name\n", sizeof(query_t));
+
+    // 最后一组占用 90% 的 ID
+    if ((bench(10) != 0) || (bench(1000) != 0) || (bench(30000) != 0)
+        || (bench(58982) != 0))
+    {
+        printf("query lost\n");
+        return EXIT_FAILURE;
+    }
+
+    // 相同的查询合并到第一个
+    int inflight;
+    unsigned long overloads;
+    query_t *q1 = query_new("www.example.com", NULL);
+    query_t *q2 = query_new("www.example.com", NULL);
+    if ((q1 == NULL) || (q2 == NULL))
+    {
+        return EXIT_FAILURE;
+    }
+    q1->id = q2->id = 1;
+    q1->type = q2->type = ns_t_a;
+    q1->protocol = q2->protocol = ns_udp;
+    if ((query_add(q1) != 0) || (query_add(q2) != 0)
+        || (query_coalesce(q1) == 0) || (query_coalesce(q2) != 0)
+        || (q1->waiters != q2) || (query_search(q2->id) != NULL))
+    {
+        printf("query not coalesced\n");
+        return EXIT_FAILURE;
+    }
+    query_delete(q1->id);
+    query_stat(&inflight, NULL);
+    if (inflight != 0)
+    {
+        printf("in-flight: %d after delete\n", inflight);
+        return EXIT_FAILURE;
+    }
+
+    // 超出上限的查询应被拒绝并计数
+    query_set_limit(10);
+    if ((bench(10) != 0) || (bench(11) == 0))
+    {
+        printf("query limit not applied\n");
+        return EXIT_FAILURE;
+    }
+    query_stat(&inflight, &overloads);
+    if ((inflight != 10) || (overloads != 1))
+    {
+        printf("in-flight: %d, overloads: %lu\n", inflight, overloads);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,280 @@
+/*
+ * bench_udp.c - syscalls per query of UDP message I/O
+ *
+ * Copyright (C) 2014 - 2015, Xiaoxiao <i@xiaoxiao.im>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#ifndef _GNU_SOURCE
+#  define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#if defined(__linux__) && defined(HAVE_RECVMMSG) && defined(HAVE_SENDMMSG)
+#  include <sys/syscall.h>
+#endif
+
+#if defined(SYS_recvfrom) && defined(SYS_sendto) \
+    && defined(SYS_recvmmsg) && defined(SYS_sendmmsg)
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "dns.h"
+#include "dnsmsg.h"
+#include "event.h"
+#include "query.h"
+#include "utils.h"
+
+
+#define BURST 64
+#define ROUNDS 200
+
+static unsigned long syscalls;
+static unsigned long mallocs;
+static int server;
+static int client;
+static int received;
+static int timed_out;
+
+
+/*
+ * 替换 libc 中的函数以统计 dnsmsg.c 的系统调用次数
+ */
+ssize_t recvfrom(int sockfd, void *buf, size_t len, int flags,
+                 struct sockaddr *src_addr, socklen_t *addrlen)
+{
+    syscalls++;
+    return syscall(SYS_recvfrom, sockfd, buf, len, flags, src_addr, addrlen);
+}
+
+ssize_t sendto(int sockfd, const void *buf, size_t len, int flags,
+               const struct sockaddr *dest_addr, socklen_t addrlen)
+{
+    syscalls++;
+    return syscall(SYS_sendto, sockfd, buf, len, flags, dest_addr, addrlen);
+}
+
+int recvmmsg(int sockfd, struct mmsghdr *msgvec, unsigned int vlen,
+             int flags, struct timespec *timeout)
+{
+    syscalls++;
+    return syscall(SYS_recvmmsg, sockfd, msgvec, vlen, flags, timeout);
+}
+
+int sendmmsg(int sockfd, struct mmsghdr *msgvec, unsigned int vlen, int flags)
+{
+    syscalls++;
+    return syscall(SYS_sendmmsg, sockfd, msgvec, vlen, flags);
+}
+
+
+#ifdef __GLIBC__
+/*
+ * 统计 malloc 次数
+ */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+void *malloc(size_t size)
+{
+    mallocs++;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+    mallocs++;
+    return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    mallocs++;
+    return __libc_realloc(ptr, size);
+}
+#endif
+
+
+/*
+ * @func query_cb()
+ * @desc answer every query at once
+ */
+static void query_cb(uint16_t id)
+{
+    uint8_t msg[NS_PACKETSZ];
+
+    query_t *query = query_search(id);
+    int msglen = ns_mkreply(msg, sizeof(msg), query->name, query->type, ns_r_noerror);
+    if (msglen > 0)
+    {
+        ns_setid(msg, query->qid);
+        reply_send(query->sock, query->protocol, msg, msglen,
+                   (struct sockaddr *)&(query->addr), query->addrlen);
+    }
+    query_delete(id);
+}
+
+
+static void client_cb(ev_io *w)
+{
+    uint8_t msg[NS_PACKETSZ];
+
+    while (recv(w->fd, msg, sizeof(msg), 0) > 0)
+    {
+        if (++received == BURST)
+        {
+            ev_stop();
+        }
+    }
+}
+
+
+static void timeout_cb(ev_timer *w)
+{
+    (void)w;
+    timed_out = 1;
+    ev_stop();
+}
+
+
+static double now_us(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return 1000000.0 * tv.tv_sec + tv.tv_usec;
+}
+
+
+/*
+ * @func bench()
+ * @desc send ROUNDS bursts of queries to server
+ * @ret  syscalls per query, including polls
+ */
+static double bench(int n)
+{
+    uint8_t msg[NS_PACKETSZ];
+    unsigned long polls1, polls2, events;
+    ev_timer w_timeout;
+
+    dnsmsg_set_batch(n);
+    ev_timer_init(&w_timeout, timeout_cb, 1000, 0);
+    syscalls = 0;
+    mallocs = 0;
+    ev_stat(&polls1, &events);
+    double t1 = now_us();
+    for (int round = 0; round < ROUNDS; round++)
+    {
+        for (int i = 0; i < BURST; i++)
+        {
+            char name[32];
+            snprintf(name, sizeof(name), "www%d.example.com", i);
+            int msglen = ns_mkquery(msg, sizeof(msg), name, ns_t_a);
+            ns_setid(msg, (uint16_t)(round * BURST + i));
+            if (send(client, msg, msglen, 0) != msglen)
+            {
+                return -1.0;
+            }
+        }
+        received = 0;
+        ev_timer_start(&w_timeout);
+        ev_run();
+        ev_timer_stop(&w_timeout);
+        if (timed_out)
+        {
+            printf("batch: %d, lost %d replies\n", n, BURST - received);
+            return -1.0;
+        }
+    }
+    double us = now_us() - t1;
+    ev_stat(&polls2, &events);
+
+    double queries = (double)ROUNDS * BURST;
+    double total = (syscalls + (polls2 - polls1)) / queries;
+    printf("batch: %2d, syscalls: %.3f/query (I/O %.3f, poll %.3f), "
+           "mallocs: %.3f/query, %.2f us/query\n",
+           n, total, syscalls / queries, (polls2 - polls1) / queries,
+           mallocs / queries, us / queries);
+    return total;
+}
+
+
+int main(void)
+{
+    struct sockaddr_in addr;
+    socklen_t addrlen = sizeof(addr);
+
+    if (ev_init() != 0)
+    {
+        return EXIT_FAILURE;
+    }
+    query_init(NULL);
+
+    bzero(&addr, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    server = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    client = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if ((server < 0) || (client < 0)
+        || (bind(server, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+        || (getsockname(server, (struct sockaddr *)&addr, &addrlen) != 0)
+        || (connect(client, (struct sockaddr *)&addr, addrlen) != 0))
+    {
+        perror("socket");
+        return EXIT_FAILURE;
+    }
+    setnonblock(server);
+    setnonblock(client);
+
+    ev_io w_client;
+    ev_io_init(&w_client, client_cb, client, EV_READ);
+    ev_io_start(&w_client);
+    if (query_recv(server, ns_udp, query_cb) != 0)
+    {
+        return EXIT_FAILURE;
+    }
+
+    double before = bench(1);
+    double after = bench(BURST);
+
+    close(client);
+    close(server);
+    if ((before < 0.0) || (after < 0.0) || (after >= before))
+    {
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+#else
+
+int main(void)
+{
+    printf("recvmmsg/sendmmsg not available\n");
+    return 77;
+}
+
+#endif
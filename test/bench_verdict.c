@@ -0,0 +1,165 @@
+/*
+ * bench_verdict.c - benchmark of shared verdict cache under contention
+ *
+ * Copyright (C) 2014 - 2015, Xiaoxiao <i@xiaoxiao.im>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "event.h"
+#include "verdict.h"
+
+
+#define NAMES 10000
+
+static char names[NAMES][32];
+static int stop;
+static int failed;
+
+
+/*
+ * @func reader()
+ * @desc look up preloaded names, like query_cb() in every worker
+ */
+static void *reader(void *arg)
+{
+    unsigned long *lookups = (unsigned long *)arg;
+    unsigned long n = 0;
+    unsigned int seed = (unsigned int)(uintptr_t)arg;
+
+    if ((ev_init() != 0) || (verdict_thread_init() != 0))
+    {
+        __atomic_store_n(&failed, 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    while (!__atomic_load_n(&stop, __ATOMIC_RELAXED))
+    {
+        for (int i = 0; i < 256; i++)
+        {
+            int k = rand_r(&seed) % NAMES;
+            if (verdict_search(names[k]) != (k & 1))
+            {
+                __atomic_store_n(&failed, 1, __ATOMIC_RELAXED);
+            }
+        }
+        n += 256;
+        verdict_quiescent();
+    }
+    verdict_thread_exit();
+    *lookups = n;
+    return NULL;
+}
+
+
+/*
+ * @func writer()
+ * @desc replace verdicts and insert new ones, like test_cb()
+ */
+static void *writer(void *arg)
+{
+    unsigned long *updates = (unsigned long *)arg;
+    unsigned long n = 0;
+    char name[32];
+
+    while (!__atomic_load_n(&stop, __ATOMIC_RELAXED))
+    {
+        int k = (int)(n % NAMES);
+        verdict_insert(names[k], k & 1);
+        snprintf(name, sizeof(name), "new%lu.example.org", n);
+        verdict_insert(name, 0);
+        n += 2;
+        usleep(10);
+    }
+    *updates = n;
+    return NULL;
+}
+
+
+static double now_us(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return 1000000.0 * tv.tv_sec + tv.tv_usec;
+}
+
+
+int main(int argc, char **argv)
+{
+    int max_threads = (argc > 1) ? atoi(argv[1]) : 4;
+    int ms = (argc > 2) ? atoi(argv[2]) : 200;
+
+    for (int i = 0; i < NAMES; i++)
+    {
+        snprintf(names[i], sizeof(names[i]), "www%d.example.com", i);
+        verdict_insert(names[i], i & 1);
+    }
+
+    // 子域名沿用最长后缀的结论
+    verdict_insert("blocked.net", 1);
+    verdict_insert("open.blocked.net", 0);
+    if ((verdict_search("blocked.net") != 1)
+        || (verdict_search("a.b.blocked.net") != 1)
+        || (verdict_search("x.open.blocked.net") != 0)
+        || (verdict_search("net") != -1)
+        || (verdict_search("unblocked.net") != -1)
+        || (verdict_search("example.com") != -1))
+    {
+        printf("wrong suffix verdict\n");
+        return EXIT_FAILURE;
+    }
+
+    for (int threads = 1; threads <= max_threads; threads++)
+    {
+        pthread_t tid[threads + 1];
+        unsigned long count[threads + 1];
+
+        __atomic_store_n(&stop, 0, __ATOMIC_RELAXED);
+        double t1 = now_us();
+        pthread_create(&tid[threads], NULL, writer, &count[threads]);
+        for (int i = 0; i < threads; i++)
+        {
+            pthread_create(&tid[i], NULL, reader, &count[i]);
+        }
+        usleep(ms * 1000);
+        __atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+        unsigned long lookups = 0;
+        for (int i = 0; i <= threads; i++)
+        {
+            pthread_join(tid[i], NULL);
+            if (i < threads)
+            {
+                lookups += count[i];
+            }
+        }
+        double us = now_us() - t1;
+
+        printf("threads: %d, lookups: %.1f M/s (%.1f M/s per thread), updates: %.0f k/s\n",
+               threads, lookups / us, lookups / us / threads,
+               count[threads] * 1000.0 / us);
+    }
+
+    if (failed)
+    {
+        printf("wrong verdict\n");
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,112 @@
+#!/usr/bin/env python3
+
+# open thousands of concurrent TCP queries against sans, with a local fake
+# upstream, and make sure every connection is either answered or closed
+
+import os
+import resource
+import selectors
+import signal
+import socket
+import struct
+import sys
+import tempfile
+import threading
+import time
+from subprocess import Popen
+
+
+CONNS = int(sys.argv[1]) if len(sys.argv) > 1 else 2000
+PORT = 5380
+
+
+def fake_upstream(socks):
+    # test_server answers SOA, cn_server answers A 1.2.3.4
+    sel = selectors.DefaultSelector()
+    for s in socks:
+        sel.register(s, selectors.EVENT_READ)
+    while True:
+        for key, _ in sel.select():
+            s = key.fileobj
+            msg, addr = s.recvfrom(4096)
+            end = msg.index(b'\0', 12) + 5
+            qtype = struct.unpack('!H', msg[end - 4:end - 2])[0]
+            hdr = msg[:2] + struct.pack('!HHHHH', 0x8180, 1, 1, 0, 0)
+            if qtype == 6:
+                rdata = b'\0\0' + struct.pack('!IIIII', 1, 2, 3, 4, 5)
+            else:
+                qtype, rdata = 1, bytes([1, 2, 3, 4])
+            rr = b'\xc0\x0c' + struct.pack('!HHIH', qtype, 1, 60, len(rdata)) + rdata
+            s.sendto(hdr + msg[12:end] + rr, addr)
+
+
+def mkquery(qid, name):
+    q = b''.join(bytes([len(l)]) + l.encode() for l in name.split('.'))
+    msg = struct.pack('!HHHHHH', qid, 0x0100, 1, 0, 0, 0) + q + b'\0\0\1\0\1'
+    return struct.pack('!H', len(msg)) + msg
+
+
+soft, hard = resource.getrlimit(resource.RLIMIT_NOFILE)
+if soft < CONNS + 256:
+    resource.setrlimit(resource.RLIMIT_NOFILE, (min(hard, CONNS + 256), hard))
+
+upstream = []
+for i in range(2):
+    s = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    s.bind(('127.0.0.1', 0))
+    upstream.append(s)
+threading.Thread(target=fake_upstream, args=(upstream,), daemon=True).start()
+
+conf = tempfile.NamedTemporaryFile('w', suffix='.conf', delete=False)
+conf.write('listen=127.0.0.1:%d\n' % PORT)
+conf.write('test_server=127.0.0.1:%d\n' % upstream[0].getsockname()[1])
+conf.write('cn_server=127.0.0.1:%d\n' % upstream[1].getsockname()[1])
+conf.write('server=127.0.0.1:%d\n' % upstream[1].getsockname()[1])
+conf.write('max_watchers=%d\n' % (CONNS * 2))
+conf.close()
+
+sans = Popen(['src/sans', '-c', conf.name], shell=False, bufsize=0, close_fds=True)
+time.sleep(1)
+
+clients = []
+for i in range(CONNS):
+    c = socket.create_connection(('127.0.0.1', PORT))
+    clients.append(c)
+for i, c in enumerate(clients):
+    c.sendall(mkquery(i, 'www%d.example.com' % i))
+
+answered = closed = 0
+sel = selectors.DefaultSelector()
+for i, c in enumerate(clients):
+    c.setblocking(False)
+    sel.register(c, selectors.EVENT_READ, [i, b''])
+deadline = time.time() + 30
+while answered + closed < CONNS and time.time() < deadline:
+    for key, _ in sel.select(1):
+        try:
+            data = key.fileobj.recv(4096)
+        except ConnectionError:
+            data = b''
+        key.data[1] += data
+        buf = key.data[1]
+        if len(buf) >= 4 and len(buf) >= struct.unpack('!H', buf[:2])[0] + 2:
+            assert struct.unpack('!H', buf[2:4])[0] == key.data[0]
+            answered += 1
+        elif data:
+            continue
+        else:
+            closed += 1
+        sel.unregister(key.fileobj)
+        key.fileobj.close()
+
+alive = sans.poll() is None
+print('connections: %d, answered: %d, closed: %d' % (CONNS, answered, closed))
+
+os.kill(sans.pid, signal.SIGINT)
+sans.wait()
+os.unlink(conf.name)
+
+if not alive or answered + closed != CONNS or answered == 0:
+    print('test failed')
+    sys.exit(1)
+print('test passed')
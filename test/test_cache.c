@@ -0,0 +1,307 @@
+/*
+ * test_cache.c - test of DNS answer cache
+ *
+ * Copyright (C) 2014 - 2015, Xiaoxiao <i@xiaoxiao.im>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cache.h"
+#include "dns.h"
+#include "event.h"
+#include "utils.h"
+
+
+static int failed;
+static ev_timer t_check;
+
+
+#define CHECK(cond) do { \
+    if (!(cond)) \
+    { \
+        printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+        failed = 1; \
+    } \
+} while (0)
+
+
+/*
+ * @func mkanswer()
+ * @desc make reply with A records of given TTLs, followed by an OPT record
+ */
+static int mkanswer(uint8_t *buf, const char *name, int rcode,
+                    const uint32_t *ttl, int count)
+{
+    int n = ns_mkreply(buf, NS_PACKETSZ, name, ns_t_a, rcode);
+    for (int i = 0; i < count; i++)
+    {
+        uint8_t rr[] = {0xc0, 0x0c, 0, 1, 0, 1,
+                        ttl[i] >> 24, ttl[i] >> 16, ttl[i] >> 8, ttl[i],
+                        0, 4, 10, 0, 0, (uint8_t)i};
+        memcpy(buf + n, rr, sizeof(rr));
+        n += sizeof(rr);
+    }
+    uint8_t opt[] = {0, 0, 41, 0x10, 0, 0, 0, 0x80, 0, 0, 0};
+    memcpy(buf + n, opt, sizeof(opt));
+    n += sizeof(opt);
+    ns_header *header = (ns_header *)buf;
+    header->ancount = htons(count);
+    header->arcount = htons(1);
+    return n;
+}
+
+
+/*
+ * @func mknegative()
+ * @desc make NXDOMAIN or NODATA reply with an SOA record in authority section
+ */
+static int mknegative(uint8_t *buf, const char *name, int rcode,
+                      uint32_t ttl, uint32_t minimum)
+{
+    int n = ns_mkreply(buf, NS_PACKETSZ, name, ns_t_a, rcode);
+    uint8_t soa[] = {0xc0, 0x0c, 0, 6, 0, 1,
+                     ttl >> 24, ttl >> 16, ttl >> 8, ttl,
+                     0, 22, 0, 0, 0, 0, 0, 1, 0, 0, 0, 2, 0, 0, 0, 3,
+                     0, 0, 0, 4,
+                     minimum >> 24, minimum >> 16, minimum >> 8, minimum};
+    memcpy(buf + n, soa, sizeof(soa));
+    n += sizeof(soa);
+    ((ns_header *)buf)->nscount = htons(1);
+    return n;
+}
+
+
+/*
+ * @func get_ttl()
+ * @desc get TTL of the i-th answer made by mkanswer()
+ */
+static uint32_t get_ttl(const uint8_t *msg, const char *name, int i)
+{
+    const uint8_t *p = msg + 12 + strlen(name) + 2 + 4 + 16 * i + 6;
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16)
+           | ((uint32_t)p[2] << 8) | p[3];
+}
+
+
+static void check_cb(ev_timer *w)
+{
+    (void)w;
+    uint8_t msg[NS_PACKETSZ];
+
+    // 1 秒后 TTL 减 1，OPT 的标志不变
+    int n = cache_search("www.example.com", ns_t_a, msg, NS_PACKETSZ);
+    CHECK(n > 0);
+    if (n > 0)
+    {
+        CHECK(get_ttl(msg, "www.example.com", 0) == 299);
+        CHECK(get_ttl(msg, "www.example.com", 1) == 59);
+        CHECK(memcmp(msg + n - 6, "\x00\x00\x80\x00", 4) == 0);
+    }
+
+    // TTL 为 1 的应答已过期
+    CHECK(cache_search("short.example.com", ns_t_a, msg, NS_PACKETSZ) < 0);
+
+    // 插入新条目时回收已过期的条目，不计入淘汰
+    CHECK(cache_insert("new.example.com", ns_t_a, msg, n, 60) == 0);
+    CHECK(cache_delete("expired.example.com", ns_t_a) != 0);
+    CHECK(cache_delete("new.example.com", ns_t_a) == 0);
+    unsigned long evictions;
+    cache_stat(NULL, &evictions);
+    CHECK(evictions == 0);
+
+    ev_stop();
+}
+
+
+/*
+ * @func test_evict()
+ * @desc fill cache beyond memory limit
+ */
+static void test_evict(void)
+{
+    uint8_t msg[NS_PACKETSZ];
+    uint8_t buf[NS_PACKETSZ];
+    char name[32];
+    const uint32_t ttls[] = {300};
+    int n = mkanswer(msg, "www.example.com", ns_r_noerror, ttls, 1);
+    size_t used;
+    unsigned long evictions;
+
+    cache_set_limit(100 * 256);
+    cache_stat(&used, NULL);
+    CHECK(used <= 100 * 256);
+
+    for (int i = 0; i < 1000; i++)
+    {
+        sprintf(name, "%d.example.com", i);
+        CHECK(cache_insert(name, ns_t_a, msg, n, 300) == 0);
+        // 频繁访问的条目不被淘汰
+        CHECK(cache_search("0.example.com", ns_t_a, buf, NS_PACKETSZ) == n);
+    }
+    cache_stat(&used, &evictions);
+    CHECK(used <= 100 * 256);
+    CHECK(used > 50 * 256);
+    CHECK(evictions > 800);
+    CHECK(cache_search("1.example.com", ns_t_a, buf, NS_PACKETSZ) < 0);
+    CHECK(cache_search("999.example.com", ns_t_a, buf, NS_PACKETSZ) == n);
+
+    // 关闭缓存
+    cache_set_limit(0);
+    cache_stat(&used, NULL);
+    CHECK(used == 0);
+    CHECK(cache_insert("www.example.com", ns_t_a, msg, n, 300) != 0);
+    CHECK(cache_search("0.example.com", ns_t_a, buf, NS_PACKETSZ) < 0);
+}
+
+
+/*
+ * @func test_hash()
+ * @desc hash of name is ASCII case insensitive
+ */
+static void test_hash(void)
+{
+    char name[64];
+    char lower[64];
+
+    srand(1);
+    for (int i = 0; i < 10000; i++)
+    {
+        int len = rand() % 40;
+        for (int j = 0; j < len; j++)
+        {
+            name[j] = (char)(1 + rand() % 255);
+            lower[j] = ((name[j] >= 'A') && (name[j] <= 'Z'))
+                       ? (char)(name[j] + 'a' - 'A') : name[j];
+        }
+        name[len] = lower[len] = '\0';
+        CHECK(hash_name(name, 1) == hash_name(lower, 1));
+        ns_tolower(name);
+        CHECK(strcmp(name, lower) == 0);
+    }
+    CHECK(hash_name("www.example.com", 1) != hash_name("www.example.com", 28));
+    CHECK(hash_name("www.example.com", 1) != hash_name("www.example.org", 1));
+}
+
+
+/*
+ * @func test_qcase()
+ * @desc restore letter case of question name for client
+ */
+static void test_qcase(void)
+{
+    uint8_t query[NS_PACKETSZ];
+    uint8_t reply[NS_PACKETSZ];
+    char name[] = "WwW.ExAmple.COM";
+
+    int n = ns_mkquery(query, NS_PACKETSZ, name, ns_t_a);
+    CHECK(ns_tolower(name) == 1);
+    CHECK(strcmp(name, "www.example.com") == 0);
+    CHECK(ns_tolower(name) == 0);
+
+    int m = ns_mkreply(reply, NS_PACKETSZ, name, ns_t_a, ns_r_noerror);
+    ns_setqcase(reply, m, query + sizeof(ns_header));
+    CHECK(memcmp(reply + sizeof(ns_header), query + sizeof(ns_header),
+                 n - sizeof(ns_header)) == 0);
+    ns_setqcase(reply, m, NULL);
+    CHECK(memcmp(reply + sizeof(ns_header), "\003www\007example\003com", 17) == 0);
+
+    // 不是同一个域名时不修改
+    n = ns_mkquery(query, NS_PACKETSZ, "WWW.EXAMPLE.ORG", ns_t_a);
+    ns_setqcase(reply, m, query + sizeof(ns_header));
+    CHECK(memcmp(reply + sizeof(ns_header), "\003www\007example\003com", 17) == 0);
+}
+
+
+int main(void)
+{
+    if (ev_init() != 0)
+    {
+        return EXIT_FAILURE;
+    }
+
+    uint8_t msg[NS_PACKETSZ];
+    uint8_t buf[NS_PACKETSZ];
+    uint32_t ttl;
+    const uint32_t ttls[] = {300, 60};
+    int n;
+
+    hash_seed();
+    test_hash();
+    test_qcase();
+
+    // 取应答中最小的 TTL
+    n = mkanswer(msg, "www.example.com", ns_r_noerror, ttls, 2);
+    CHECK(ns_reply_ttl(msg, n, "www.example.com", ns_t_a, &ttl) == 0);
+    CHECK(ttl == 60);
+
+    // 问题不一致、没有应答或出错的不缓存
+    CHECK(ns_reply_ttl(msg, n, "www.example.org", ns_t_a, &ttl) != 0);
+    CHECK(ns_reply_ttl(msg, n, "www.example.com", ns_t_aaaa, &ttl) != 0);
+    CHECK(ns_reply_ttl(msg, n - 1, "www.example.com", ns_t_a, &ttl) != 0);
+    int m = mkanswer(buf, "www.example.com", ns_r_noerror, ttls, 0);
+    CHECK(ns_reply_ttl(buf, m, "www.example.com", ns_t_a, &ttl) != 0);
+    m = mkanswer(buf, "www.example.com", ns_r_servfail, ttls, 2);
+    CHECK(ns_reply_ttl(buf, m, "www.example.com", ns_t_a, &ttl) != 0);
+
+    // 否定应答取 SOA 的 TTL 与 MINIMUM 中较小者
+    m = mknegative(buf, "nx.example.com", ns_r_nxdomain, 60, 30);
+    CHECK(ns_reply_ttl(buf, m, "nx.example.com", ns_t_a, &ttl) == 0);
+    CHECK(ttl == 30);
+    m = mknegative(buf, "nodata.example.com", ns_r_noerror, 20, 30);
+    CHECK(ns_reply_ttl(buf, m, "nodata.example.com", ns_t_a, &ttl) == 0);
+    CHECK(ttl == 20);
+    m = mknegative(buf, "nx.example.com", ns_r_nxdomain, 86400, 86400);
+    CHECK(ns_reply_ttl(buf, m, "nx.example.com", ns_t_a, &ttl) == 0);
+    CHECK(ttl == NS_MAXNEGTTL);
+    m = mknegative(buf, "nx.example.com", ns_r_nxdomain, 60, 30);
+    ((ns_header *)buf)->nscount = 0;
+    CHECK(ns_reply_ttl(buf, m - 34, "nx.example.com", ns_t_a, &ttl) != 0);
+
+    // 插入后立即可查到，且与原应答相同
+    CHECK(cache_insert("www.example.com", ns_t_a, msg, n, 60) == 0);
+    CHECK(cache_search("www.example.com", ns_t_a, buf, NS_PACKETSZ) == n);
+    CHECK(memcmp(buf, msg, n) == 0);
+    CHECK(cache_search("www.example.com", ns_t_aaaa, buf, NS_PACKETSZ) < 0);
+    CHECK(cache_search("www.example.com", ns_t_a, buf, n - 1) < 0);
+
+    // TTL 为 0 的不缓存
+    CHECK(cache_insert("zero.example.com", ns_t_a, msg, n, 0) != 0);
+    CHECK(cache_search("zero.example.com", ns_t_a, buf, NS_PACKETSZ) < 0);
+
+    // 同名条目被替换
+    CHECK(cache_insert("short.example.com", ns_t_a, msg, n, 300) == 0);
+    CHECK(cache_insert("short.example.com", ns_t_a, msg, n, 1) == 0);
+
+    CHECK(cache_insert("expired.example.com", ns_t_a, msg, n, 1) == 0);
+
+    // 删除
+    CHECK(cache_insert("del.example.com", ns_t_a, msg, n, 60) == 0);
+    CHECK(cache_delete("del.example.com", ns_t_a) == 0);
+    CHECK(cache_delete("del.example.com", ns_t_a) != 0);
+    CHECK(cache_search("del.example.com", ns_t_a, buf, NS_PACKETSZ) < 0);
+
+    ev_timer_init(&t_check, check_cb, 1100, 0);
+    ev_timer_start(&t_check);
+    ev_run();
+
+    test_evict();
+
+    printf("%s\n", failed ? "test failed" : "test passed");
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,182 @@
+/*
+ * test_timer.c - test of event loop timers
+ *
+ * Copyright (C) 2014 - 2015, Xiaoxiao <i@xiaoxiao.im>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+#include "event.h"
+
+
+#define TIMERS 2000
+
+static ev_timer timers[TIMERS];
+static int fired[TIMERS];
+static uint64_t start;
+static ev_tstamp start_us;
+static ev_tstamp last_us;
+static int failed;
+static int pending;
+static int repeats;
+static ev_timer t_repeat, t_reset, t_long, t_end;
+
+
+static uint64_t ms(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+
+static void timer_cb(ev_timer *w)
+{
+    int i = (int)(w - timers);
+    uint64_t elapsed = ms() - start;
+    fired[i]++;
+    if (ev_now() < last_us)
+    {
+        printf("loop time goes backwards\n");
+        failed = 1;
+    }
+    last_us = ev_now();
+    pending--;
+    if ((elapsed + 1 < w->timeout) || (elapsed > w->timeout + 50))
+    {
+        printf("timer %d: timeout %u ms, fired after %lu ms\n",
+               i, w->timeout, (unsigned long)elapsed);
+        failed = 1;
+    }
+    // stop a timer which has not expired yet
+    if ((i % 2 == 0) && (i + 1 < TIMERS) && ev_is_active(&timers[i + 1]))
+    {
+        ev_timer_stop(&timers[i + 1]);
+        pending--;
+    }
+}
+
+
+static void repeat_cb(ev_timer *w)
+{
+    if (++repeats == 5)
+    {
+        ev_timer_stop(w);
+    }
+}
+
+
+static void reset_cb(ev_timer *w)
+{
+    (void)w;
+    // t_reset is pushed back by t_repeat
+    if (ms() - start < 400)
+    {
+        printf("reset timer fired too early\n");
+        failed = 1;
+    }
+}
+
+
+static void long_cb(ev_timer *w)
+{
+    (void)w;
+    printf("long timer fired\n");
+    failed = 1;
+}
+
+
+static void end_cb(ev_timer *w)
+{
+    uint64_t elapsed = (ev_now() - start_us) / 1000;
+    if ((elapsed + 1 < w->timeout) || (elapsed > w->timeout + 50))
+    {
+        printf("loop time: %lu ms elapsed, expected %u ms\n",
+               (unsigned long)elapsed, w->timeout);
+        failed = 1;
+    }
+    ev_stop();
+}
+
+
+static void reset_repeat_cb(ev_timer *w)
+{
+    repeat_cb(w);
+    if (ev_is_active(&t_reset))
+    {
+        ev_timer_reset(&t_reset);
+    }
+}
+
+
+int main(void)
+{
+    if (ev_init() != 0)
+    {
+        return EXIT_FAILURE;
+    }
+
+    srand(1);
+    start = ms();
+    start_us = ev_now();
+    for (int i = 0; i < TIMERS; i++)
+    {
+        ev_timer_init(&timers[i], timer_cb, rand() % 1500, 0);
+        ev_timer_start(&timers[i]);
+    }
+    pending = TIMERS;
+
+    ev_timer_init(&t_repeat, reset_repeat_cb, 50, 50);
+    ev_timer_start(&t_repeat);
+    ev_timer_init(&t_reset, reset_cb, 200, 0);
+    ev_timer_start(&t_reset);
+    ev_timer_init(&t_long, long_cb, 100000000, 0);
+    ev_timer_start(&t_long);
+    ev_timer_init(&t_end, end_cb, 1700, 0);
+    ev_timer_start(&t_end);
+
+    ev_run();
+
+    for (int i = 0; i < TIMERS; i++)
+    {
+        if ((fired[i] > 1) || ev_is_active(&timers[i]))
+        {
+            printf("timer %d: fired %d times\n", i, fired[i]);
+            failed = 1;
+        }
+    }
+    if (pending != 0)
+    {
+        printf("%d timers not fired\n", pending);
+        failed = 1;
+    }
+    if (repeats != 5)
+    {
+        printf("repeat timer fired %d times\n", repeats);
+        failed = 1;
+    }
+    if (ev_is_active(&t_reset) || !ev_is_active(&t_long))
+    {
+        printf("bad timer state\n");
+        failed = 1;
+    }
+
+    printf("%s\n", failed ? "test failed" : "test passed");
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,217 @@
+/*
+ * test_verdict.c - test of saving and loading verdicts
+ *
+ * Copyright (C) 2014 - 2015, Xiaoxiao <i@xiaoxiao.im>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "dns.h"
+#include "utils.h"
+#include "verdict.h"
+
+
+#define CHECK(expr) \
+    do \
+    { \
+        if (!(expr)) \
+        { \
+            printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #expr); \
+            failed = 1; \
+        } \
+    } while (0)
+
+static int failed;
+
+
+static uint64_t us(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+
+/*
+ * @func test_bad()
+ * @desc broken snapshots are rejected
+ */
+static void test_bad(const char *path)
+{
+    size_t count;
+    char bad[64];
+    snprintf(bad, sizeof(bad), "%s.bad", path);
+
+    FILE *f = fopen(bad, "w");
+    fprintf(f, "not a snapshot, not a snapshot, not a snapshot\n");
+    fclose(f);
+    CHECK(verdict_load(bad, &count) != 0);
+
+    // 截断的快照
+    char buf[4096];
+    f = fopen(path, "rb");
+    size_t len = fread(buf, 1, sizeof(buf), f);
+    fclose(f);
+    f = fopen(bad, "wb");
+    fwrite(buf, 1, len - 1, f);
+    fclose(f);
+    CHECK(verdict_load(bad, &count) != 0);
+
+    // count 超出文件长度，32 位系统上 count * 4 会回绕为 0
+    uint32_t n = 0x40000000;
+    uint64_t size = len - 32;
+    memcpy(buf + 12, &n, sizeof(n));
+    memcpy(buf + 16, &size, sizeof(size));
+    f = fopen(bad, "wb");
+    fwrite(buf, 1, len, f);
+    fclose(f);
+    CHECK(verdict_load(bad, &count) != 0);
+
+    // count 比实际多一个
+    f = fopen(path, "rb");
+    len = fread(buf, 1, sizeof(buf), f);
+    fclose(f);
+    memcpy(&n, buf + 12, sizeof(n));
+    n++;
+    memcpy(buf + 12, &n, sizeof(n));
+    f = fopen(bad, "wb");
+    fwrite(buf, 1, len, f);
+    fclose(f);
+    CHECK(verdict_load(bad, &count) != 0);
+    unlink(bad);
+
+    CHECK((verdict_load("/nonexistent/verdicts", &count) == 0) && (count == 0));
+}
+
+
+/*
+ * @func test_registrable()
+ * @desc verdicts are kept per registrable domain, but not for reverse
+ *       lookups or public suffixes
+ */
+static void test_registrable(void)
+{
+    CHECK(strcmp(ns_registrable("www.example.com"), "example.com") == 0);
+    CHECK(strcmp(ns_registrable("a.b.example.co.uk"), "example.co.uk") == 0);
+    CHECK(strcmp(ns_registrable("example.com"), "example.com") == 0);
+    CHECK(ns_registrable("com") == NULL);
+    CHECK(ns_registrable("co.uk") == NULL);
+    CHECK(ns_registrable("in-addr.arpa") == NULL);
+    CHECK(ns_registrable("") == NULL);
+    CHECK(strcmp(ns_registrable("4.3.2.1.in-addr.arpa"), "4.3.2.1.in-addr.arpa") == 0);
+    CHECK(strcmp(ns_registrable("1.0.ip6.arpa"), "1.0.ip6.arpa") == 0);
+
+    // 一次反向解析的结论不能用于所有反向解析
+    verdict_insert(ns_registrable("4.3.2.1.in-addr.arpa"), 1);
+    CHECK(verdict_search("4.3.2.1.in-addr.arpa") == 1);
+    CHECK(verdict_search("8.8.8.8.in-addr.arpa") == -1);
+
+    // 探测 com 得到的结论不能用于其下所有域名
+    const char *zone = ns_registrable("com");
+    if (zone != NULL)
+    {
+        verdict_insert(zone, 0);
+    }
+    CHECK(verdict_search("twitter.com") == -1);
+}
+
+
+/*
+ * @func load()
+ * @desc second run, search verdicts saved by the first one
+ */
+static int load(const char *path)
+{
+    size_t count;
+    uint64_t t0 = us();
+    CHECK(verdict_load(path, &count) == 0);
+    uint64_t t1 = us();
+    printf("loaded %lu verdicts in %.1f ms\n", (unsigned long)count, (t1 - t0) / 1000.0);
+    CHECK(count == 100002);
+
+    CHECK(verdict_search("blocked.com") == 1);
+    CHECK(verdict_search("www.blocked.com") == 1);
+    CHECK(verdict_search("open.blocked.com") == 0);
+    CHECK(verdict_search("a.open.blocked.com") == 0);
+    CHECK(verdict_search("domain7.org") == 1);
+    CHECK(verdict_search("www.domain8.org") == 0);
+    CHECK(verdict_search("unknown.com") == -1);
+
+    // 新的结论优先于快照
+    verdict_insert("blocked.com", 0);
+    CHECK(verdict_search("www.blocked.com") == 0);
+
+    test_registrable();
+
+    // 再次保存时合并快照中的结论
+    CHECK(verdict_save(path) == 0);
+    test_bad(path);
+    unlink(path);
+
+    if (failed)
+    {
+        printf("test failed\n");
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+
+int main(int argc, char **argv)
+{
+    hash_seed();
+    if (argc > 1)
+    {
+        return load(argv[1]);
+    }
+
+    // 第一次运行，保存之后由新进程载入
+    char path[] = "/tmp/sans_verdict_XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0)
+    {
+        return EXIT_FAILURE;
+    }
+    close(fd);
+
+    verdict_insert("blocked.com", 1);
+    verdict_insert("open.blocked.com", 0);
+    char name[32];
+    for (int i = 0; i < 100000; i++)
+    {
+        snprintf(name, sizeof(name), "domain%d.org", i);
+        verdict_insert(name, i & 1);
+    }
+    uint64_t t0 = us();
+    CHECK(verdict_save(path) == 0);
+    uint64_t t1 = us();
+    printf("saved in %.1f ms\n", (t1 - t0) / 1000.0);
+    if (failed)
+    {
+        unlink(path);
+        return EXIT_FAILURE;
+    }
+
+    fflush(stdout);
+    execl(argv[0], argv[0], path, (char *)NULL);
+    unlink(path);
+    return EXIT_FAILURE;
+}